@@ -1,5 +1,7 @@
 #pragma once
 
+#include <utility>
+
 #include "rtweekend.h"
 
 class aabb
@@ -15,6 +17,21 @@ public:
   point3 min() const { return minimum; }
   point3 max() const { return maximum; }
 
+  // Box that contains nothing and is neutral for surrounding_box().
+  static aabb empty()
+  {
+    return aabb(point3(infinity, infinity, infinity),
+                point3(-infinity, -infinity, -infinity));
+  }
+
+  double area() const
+  {
+    auto d = maximum - minimum;
+    if (d.x() < 0 || d.y() < 0 || d.z() < 0)
+      return 0.0;
+    return 2.0 * (d.x() * d.y() + d.y() * d.z() + d.z() * d.x());
+  }
+
   bool hit(const ray& r, double t_min, double t_max) const
   {
     for (int a = 0; a < 3; a++) {
@@ -30,6 +47,26 @@ public:
     return true;
   }
 
+  // Slab test with the reciprocal of the ray direction precomputed by the
+  // caller, so a traversal pays for the divisions once per ray.
+  bool hit(const point3& orig,
+           const vec3& inv_dir,
+           double t_min,
+           double t_max) const
+  {
+    for (int a = 0; a < 3; a++) {
+      auto t0 = (minimum[a] - orig[a]) * inv_dir[a];
+      auto t1 = (maximum[a] - orig[a]) * inv_dir[a];
+      if (inv_dir[a] < 0.0)
+        std::swap(t0, t1);
+      t_min = t0 > t_min ? t0 : t_min;
+      t_max = t1 < t_max ? t1 : t_max;
+      if (t_max <= t_min)
+        return false;
+    }
+    return true;
+  }
+
   point3 minimum;
   point3 maximum;
 };
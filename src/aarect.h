@@ -3,6 +3,25 @@
 #include "rtweekend.h"
 
 #include "hittable.h"
+#include "material.h"
+
+// Density per unit solid angle of directions from origin towards points
+// spread uniformly over a rectangle of the given area: the area density
+// divided by the cosine at the light and the squared distance.
+inline double
+rect_pdf_value(const hittable& rect,
+               double area,
+               const point3& origin,
+               const vec3& direction)
+{
+  hit_record rec;
+  if (!rect.hit(ray(origin, direction), 0.001, infinity, rec))
+    return 0.0;
+
+  auto distance_squared = rec.t * rec.t * direction.length_squared();
+  auto cosine = fabs(dot(direction, rec.normal) / direction.length());
+  return distance_squared / (cosine * area);
+}
 
 class xy_rect : public hittable
 {
@@ -14,7 +33,7 @@ public:
           double _y0,
           double _y1,
           double _k,
-          shared_ptr<material> mat)
+          material_id mat)
     : x0(_x0)
     , x1(_x1)
     , y0(_y0)
@@ -35,8 +54,24 @@ public:
     return true;
   }
 
+  bool is_light(const material_table& materials) const override
+  {
+    return materials[mp].emissive();
+  }
+
+  double pdf_value(const point3& origin, const vec3& direction) const override
+  {
+    return rect_pdf_value(
+      *this, (x1 - x0) * (y1 - y0), origin, direction);
+  }
+
+  vec3 random(const point3& origin) const override
+  {
+    return point3(random_double(x0, x1), random_double(y0, y1), k) - origin;
+  }
+
 public:
-  shared_ptr<material> mp;
+  material_id mp;
   double x0, x1, y0, y1, k;
 };
 
@@ -50,7 +85,7 @@ public:
           double _z0,
           double _z1,
           double _k,
-          shared_ptr<material> mat)
+          material_id mat)
     : x0(_x0)
     , x1(_x1)
     , z0(_z0)
@@ -71,8 +106,24 @@ public:
     return true;
   }
 
+  bool is_light(const material_table& materials) const override
+  {
+    return materials[mp].emissive();
+  }
+
+  double pdf_value(const point3& origin, const vec3& direction) const override
+  {
+    return rect_pdf_value(
+      *this, (x1 - x0) * (z1 - z0), origin, direction);
+  }
+
+  vec3 random(const point3& origin) const override
+  {
+    return point3(random_double(x0, x1), k, random_double(z0, z1)) - origin;
+  }
+
 public:
-  shared_ptr<material> mp;
+  material_id mp;
   double x0, x1, z0, z1, k;
 };
 
@@ -86,7 +137,7 @@ public:
           double _z0,
           double _z1,
           double _k,
-          shared_ptr<material> mat)
+          material_id mat)
     : y0(_y0)
     , y1(_y1)
     , z0(_z0)
@@ -107,12 +158,28 @@ public:
     return true;
   }
 
+  bool is_light(const material_table& materials) const override
+  {
+    return materials[mp].emissive();
+  }
+
+  double pdf_value(const point3& origin, const vec3& direction) const override
+  {
+    return rect_pdf_value(
+      *this, (y1 - y0) * (z1 - z0), origin, direction);
+  }
+
+  vec3 random(const point3& origin) const override
+  {
+    return point3(k, random_double(y0, y1), random_double(z0, z1)) - origin;
+  }
+
 public:
-  shared_ptr<material> mp;
+  material_id mp;
   double y0, y1, z0, z1, k;
 };
 
-bool
+inline bool
 xy_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) const
 {
   auto t = (k - r.origin().z()) / r.direction().z();
@@ -127,12 +194,12 @@ xy_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) const
   rec.t = t;
   auto outward_normal = vec3(0, 0, 1);
   rec.set_face_normal(r, outward_normal);
-  rec.mat_ptr = mp;
+  rec.mat_id = mp;
   rec.p = r.at(t);
   return true;
 }
 
-bool
+inline bool
 xz_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) const
 {
   auto t = (k - r.origin().y()) / r.direction().y();
@@ -147,12 +214,12 @@ xz_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) const
   rec.t = t;
   auto outward_normal = vec3(0, 1, 0);
   rec.set_face_normal(r, outward_normal);
-  rec.mat_ptr = mp;
+  rec.mat_id = mp;
   rec.p = r.at(t);
   return true;
 }
 
-bool
+inline bool
 yz_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) const
 {
   auto t = (k - r.origin().x()) / r.direction().x();
@@ -167,7 +234,7 @@ yz_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) const
   rec.t = t;
   auto outward_normal = vec3(1, 0, 0);
   rec.set_face_normal(r, outward_normal);
-  rec.mat_ptr = mp;
+  rec.mat_id = mp;
   rec.p = r.at(t);
   return true;
 }
\ No newline at end of file
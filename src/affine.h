@@ -0,0 +1,166 @@
+#pragma once
+
+#include "aabb.h"
+#include "rtweekend.h"
+
+// Affine map x -> A x + b, stored as the 3x4 matrix [A | b] row by row.
+class affine
+{
+public:
+  // The identity.
+  affine()
+    : m{ { 1, 0, 0, 0 }, { 0, 1, 0, 0 }, { 0, 0, 1, 0 } }
+  {}
+
+  static affine translation(const vec3& v)
+  {
+    affine t;
+    for (int i = 0; i < 3; ++i)
+      t.m[i][3] = v[i];
+    return t;
+  }
+
+  static affine scaling(const vec3& s)
+  {
+    affine t;
+    for (int i = 0; i < 3; ++i)
+      t.m[i][i] = s[i];
+    return t;
+  }
+
+  // Rotation by the angle about the axis, counterclockwise when the axis
+  // points at the viewer.
+  static affine rotation(const vec3& axis, double degrees)
+  {
+    auto const a = unit_vector(axis);
+    auto const radians = degrees_to_radians(degrees);
+    auto const c = cos(radians);
+    auto const s = sin(radians);
+    auto const k = 1 - c;
+
+    affine t;
+    t.m[0][0] = c + a.x() * a.x() * k;
+    t.m[0][1] = a.x() * a.y() * k - a.z() * s;
+    t.m[0][2] = a.x() * a.z() * k + a.y() * s;
+    t.m[1][0] = a.y() * a.x() * k + a.z() * s;
+    t.m[1][1] = c + a.y() * a.y() * k;
+    t.m[1][2] = a.y() * a.z() * k - a.x() * s;
+    t.m[2][0] = a.z() * a.x() * k - a.y() * s;
+    t.m[2][1] = a.z() * a.y() * k + a.x() * s;
+    t.m[2][2] = c + a.z() * a.z() * k;
+    return t;
+  }
+
+  // Same for the y axis, exact for the common case of turning objects
+  // around on the floor.
+  static affine rotation_y(double degrees)
+  {
+    auto const radians = degrees_to_radians(degrees);
+    affine t;
+    t.m[0][0] = t.m[2][2] = cos(radians);
+    t.m[0][2] = sin(radians);
+    t.m[2][0] = -t.m[0][2];
+    return t;
+  }
+
+  point3 point(const point3& p) const
+  {
+    return point3(m[0][0] * p[0] + m[0][1] * p[1] + m[0][2] * p[2] + m[0][3],
+                  m[1][0] * p[0] + m[1][1] * p[1] + m[1][2] * p[2] + m[1][3],
+                  m[2][0] * p[0] + m[2][1] * p[1] + m[2][2] * p[2] + m[2][3]);
+  }
+
+  vec3 vector(const vec3& v) const
+  {
+    return vec3(m[0][0] * v[0] + m[0][1] * v[1] + m[0][2] * v[2],
+                m[1][0] * v[0] + m[1][1] * v[1] + m[1][2] * v[2],
+                m[2][0] * v[0] + m[2][1] * v[1] + m[2][2] * v[2]);
+  }
+
+  // A^T v. Normals go from the space a map leads to back to the space it
+  // starts from by the transpose of its linear part, so the inverse of a
+  // map carries normals along with the map.
+  vec3 transposed_vector(const vec3& v) const
+  {
+    return vec3(m[0][0] * v[0] + m[1][0] * v[1] + m[2][0] * v[2],
+                m[0][1] * v[0] + m[1][1] * v[1] + m[2][1] * v[2],
+                m[0][2] * v[0] + m[1][2] * v[1] + m[2][2] * v[2]);
+  }
+
+  // This map applied after `o`.
+  affine operator*(const affine& o) const
+  {
+    affine t;
+    for (int i = 0; i < 3; ++i) {
+      for (int j = 0; j < 4; ++j) {
+        t.m[i][j] = m[i][0] * o.m[0][j] + m[i][1] * o.m[1][j] +
+                    m[i][2] * o.m[2][j] + (3 == j ? m[i][3] : 0.0);
+      }
+    }
+    return t;
+  }
+
+  double determinant() const
+  {
+    return m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1]) -
+           m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0]) +
+           m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+  }
+
+  // The inverse; the map must not be singular.
+  affine inverse() const
+  {
+    auto const inv_det = 1.0 / determinant();
+    affine t;
+    t.m[0][0] = (m[1][1] * m[2][2] - m[1][2] * m[2][1]) * inv_det;
+    t.m[0][1] = (m[0][2] * m[2][1] - m[0][1] * m[2][2]) * inv_det;
+    t.m[0][2] = (m[0][1] * m[1][2] - m[0][2] * m[1][1]) * inv_det;
+    t.m[1][0] = (m[1][2] * m[2][0] - m[1][0] * m[2][2]) * inv_det;
+    t.m[1][1] = (m[0][0] * m[2][2] - m[0][2] * m[2][0]) * inv_det;
+    t.m[1][2] = (m[0][2] * m[1][0] - m[0][0] * m[1][2]) * inv_det;
+    t.m[2][0] = (m[1][0] * m[2][1] - m[1][1] * m[2][0]) * inv_det;
+    t.m[2][1] = (m[0][1] * m[2][0] - m[0][0] * m[2][1]) * inv_det;
+    t.m[2][2] = (m[0][0] * m[1][1] - m[0][1] * m[1][0]) * inv_det;
+    auto const b = t.vector(vec3(m[0][3], m[1][3], m[2][3]));
+    for (int i = 0; i < 3; ++i)
+      t.m[i][3] = -b[i];
+    return t;
+  }
+
+  // Whether the map only rotates, mirrors, scales uniformly and moves:
+  // these keep angles, and so the solid angles objects are seen under.
+  bool is_similarity(double tolerance = 1e-9) const
+  {
+    // The columns of A must be orthogonal and of equal length.
+    double g[3][3];
+    for (int i = 0; i < 3; ++i)
+      for (int j = 0; j < 3; ++j)
+        g[i][j] = m[0][i] * m[0][j] + m[1][i] * m[1][j] + m[2][i] * m[2][j];
+    auto const scale = g[0][0];
+    for (int i = 0; i < 3; ++i)
+      for (int j = 0; j < 3; ++j)
+        if (fabs(g[i][j] - (i == j ? scale : 0.0)) > tolerance * scale)
+          return false;
+    return true;
+  }
+
+  // Box around the image of a box (Arvo, "Transforming Axis-Aligned
+  // Bounding Boxes", 1990).
+  aabb box(const aabb& b) const
+  {
+    point3 lo, hi;
+    for (int i = 0; i < 3; ++i) {
+      lo[i] = hi[i] = m[i][3];
+      for (int j = 0; j < 3; ++j) {
+        auto const e = m[i][j] * b.minimum[j];
+        auto const f = m[i][j] * b.maximum[j];
+        lo[i] += fmin(e, f);
+        hi[i] += fmax(e, f);
+      }
+    }
+    return aabb(lo, hi);
+  }
+
+public:
+  double m[3][4];
+};
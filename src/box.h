@@ -9,31 +9,46 @@ class box : public hittable
 {
 public:
   box() {}
-  box(const point3& p0, const point3& p1, shared_ptr<material> ptr);
+  box(const point3& p0, const point3& p1, material_id ptr);
 
   virtual bool hit(const ray& r,
                    double t_min,
                    double t_max,
                    hit_record& rec) const override;
 
-  virtual bool bounding_box(double time0,
-                            double time1,
-                            aabb& output_box) const override
+  virtual bool bounding_box(aabb& output_box) const override
   {
     output_box = aabb(box_min, box_max);
     return true;
   }
 
+  bool is_light(const material_table& materials) const override
+  {
+    return materials[mp].emissive();
+  }
+
+  double pdf_value(const point3& origin, const vec3& direction) const override
+  {
+    return sides.pdf_value(origin, direction);
+  }
+
+  vec3 random(const point3& origin) const override
+  {
+    return sides.random(origin);
+  }
+
 public:
   point3 box_min;
   point3 box_max;
+  material_id mp;
   hittable_list sides;
 };
 
-box::box(const point3& p0, const point3& p1, shared_ptr<material> ptr)
+inline box::box(const point3& p0, const point3& p1, material_id ptr)
 {
   box_min = p0;
   box_max = p1;
+  mp = ptr;
 
   sides.add(make_shared<xy_rect>(p0.x(), p1.x(), p0.y(), p1.y(), p1.z(), ptr));
   sides.add(make_shared<xy_rect>(p0.x(), p1.x(), p0.y(), p1.y(), p0.z(), ptr));
@@ -45,7 +60,7 @@ box::box(const point3& p0, const point3& p1, shared_ptr<material> ptr)
   sides.add(make_shared<yz_rect>(p0.y(), p1.y(), p0.z(), p1.z(), p0.x(), ptr));
 }
 
-bool
+inline bool
 box::hit(const ray& r, double t_min, double t_max, hit_record& rec) const
 {
   return sides.hit(r, t_min, t_max, rec);
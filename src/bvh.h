@@ -1,125 +1,607 @@
 #pragma once
 
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <numeric>
+#include <vector>
 
 #include "rtweekend.h"
 
 #include "hittable.h"
 #include "hittable_list.h"
 
-class bvh_node : public hittable
+// Node of a flattened bounding volume hierarchy. The children of an interior
+// node are stored next to each other, so one index addresses both of them.
+struct bvh_node
 {
-public:
-  bvh_node();
+  aabb box;
+  // Interior node: index of the left child (the right one is left + 1).
+  // Leaf: index of the first primitive of the leaf.
+  std::uint32_t left_first = 0;
+  // Number of primitives in a leaf, 0 for interior nodes.
+  std::uint16_t count = 0;
+  // Axis the node was split along; rays moving in the negative direction of
+  // it visit the right child first.
+  std::uint16_t axis = 0;
 
-  bvh_node(const hittable_list& list)
-    : bvh_node(list.objects, 0, list.objects.size())
-  {}
+  bool is_leaf() const { return 0 != count; }
+};
 
-  bvh_node(const std::vector<shared_ptr<hittable>>& src_objects,
-           size_t start,
-           size_t end);
+// Traversal stack size; builders never produce deeper trees.
+constexpr int bvh_max_depth = 64;
 
-  virtual bool hit(const ray& r,
-                   double t_min,
-                   double t_max,
-                   hit_record& rec) const override;
+// Build time and quality of a hierarchy.
+struct bvh_stats
+{
+  double build_ms = 0.0;
+  // Expected cost of a random ray by the surface area heuristic, in units of
+  // one primitive intersection.
+  double sah_cost = 0.0;
+  std::size_t nodes = 0;
+  std::size_t leaves = 0;
+  unsigned depth = 0;
+  unsigned min_leaf = 0;
+  unsigned max_leaf = 0;
+  double avg_leaf = 0.0;
+};
 
-  virtual bool bounding_box(aabb& output_box) const override;
+inline std::ostream&
+operator<<(std::ostream& out, const bvh_stats& s)
+{
+  return out << "build " << s.build_ms << " ms; SAH cost " << s.sah_cost
+             << "; nodes " << s.nodes << "; leaves " << s.leaves << "; depth "
+             << s.depth << "; leaf size " << s.min_leaf << '/' << s.avg_leaf
+             << '/' << s.max_leaf << " (min/avg/max)";
+}
 
-public:
-  shared_ptr<hittable> left;
-  shared_ptr<hittable> right;
-  aabb box;
+// Tuning of the builder. Costs are relative to one node visit; primitives
+// that are intersected several at a time with SIMD cost a fraction of it and
+// can live in larger leaves.
+struct bvh_build_params
+{
+  double intersection_cost = 1.0;
+  unsigned max_leaf_size = 8;
 };
 
-bool
-bvh_node::bounding_box(aabb& output_box) const
+// Flattened hierarchy over a set of primitive bounding boxes. `indices` maps
+// the leaf primitive ranges back to the positions in the source array.
+struct bvh_tree
 {
-  output_box = box;
-  return true;
+  std::vector<bvh_node> nodes;
+  std::vector<std::uint32_t> indices;
+  bvh_stats stats;
+};
+
+namespace bvh_detail {
+
+// Cost of a node visit, the unit of the SAH.
+constexpr double traversal_cost = 1.0;
+
+constexpr int bins = 16;
+// Subtrees smaller than this are built by the thread that split them.
+constexpr std::uint32_t task_threshold = 4096;
+// Below this depth SAH splits may be unbalanced; deeper nodes are split at
+// the median so the tree never outgrows the traversal stack.
+constexpr unsigned sah_max_depth = bvh_max_depth / 2;
+
+struct build_state
+{
+  const std::vector<aabb>& boxes;
+  const bvh_build_params& params;
+  std::vector<point3> centroids;
+  bvh_tree& tree;
+  std::atomic<std::uint32_t> node_count{ 1 };
+};
+
+inline void
+grow(aabb& box, const aabb& other)
+{
+  for (int a = 0; a < 3; ++a) {
+    box.minimum.e[a] = std::min(box.minimum.e[a], other.minimum.e[a]);
+    box.maximum.e[a] = std::max(box.maximum.e[a], other.maximum.e[a]);
+  }
+}
+
+inline void
+grow(aabb& box, const point3& p)
+{
+  for (int a = 0; a < 3; ++a) {
+    box.minimum.e[a] = std::min(box.minimum.e[a], p.e[a]);
+    box.maximum.e[a] = std::max(box.maximum.e[a], p.e[a]);
+  }
+}
+
+inline void
+make_leaf(build_state& st,
+          std::uint32_t node_i,
+          std::uint32_t start,
+          std::uint32_t end)
+{
+  st.tree.nodes[node_i].left_first = start;
+  st.tree.nodes[node_i].count = static_cast<std::uint16_t>(end - start);
 }
 
-bool
-bvh_node::hit(const ray& r, double t_min, double t_max, hit_record& rec) const
+// Finds the cheapest binned SAH split of [start, end). Returns false if
+// keeping the primitives in a leaf is cheaper; `mid` receives the partition
+// point otherwise.
+inline bool
+sah_split(build_state& st,
+          const aabb& box,
+          const aabb& centroid_box,
+          std::uint32_t start,
+          std::uint32_t end,
+          int& axis,
+          std::uint32_t& mid)
 {
-  if (!box.hit(r, t_min, t_max))
+  auto& indices = st.tree.indices;
+  auto const count = end - start;
+
+  double best_cost = infinity;
+  int best_axis = -1;
+  int best_bin = 0;
+
+  for (int a = 0; a < 3; ++a) {
+    auto const lo = centroid_box.min()[a];
+    auto const extent = centroid_box.max()[a] - lo;
+    if (extent <= 0.0)
+      continue;
+    auto const scale = bins / extent;
+
+    aabb bin_box[bins];
+    std::uint32_t bin_count[bins] = {};
+    for (auto& b : bin_box)
+      b = aabb::empty();
+
+    for (auto i = start; i < end; ++i) {
+      auto const prim = indices[i];
+      int b = std::min(bins - 1,
+                       static_cast<int>((st.centroids[prim][a] - lo) * scale));
+      ++bin_count[b];
+      grow(bin_box[b], st.boxes[prim]);
+    }
+
+    // Sweep from the right to get the cost of every right-hand side, then
+    // from the left to evaluate the splits.
+    double right_area[bins];
+    std::uint32_t right_count[bins];
+    aabb acc = aabb::empty();
+    std::uint32_t n = 0;
+    for (int b = bins - 1; b > 0; --b) {
+      grow(acc, bin_box[b]);
+      n += bin_count[b];
+      right_area[b] = acc.area();
+      right_count[b] = n;
+    }
+
+    acc = aabb::empty();
+    n = 0;
+    for (int b = 0; b < bins - 1; ++b) {
+      grow(acc, bin_box[b]);
+      n += bin_count[b];
+      if (0 == n || 0 == right_count[b + 1])
+        continue;
+      double cost = acc.area() * n + right_area[b + 1] * right_count[b + 1];
+      if (cost < best_cost) {
+        best_cost = cost;
+        best_axis = a;
+        best_bin = b;
+      }
+    }
+  }
+
+  if (best_axis < 0)
     return false;
 
-  bool hit_left = left->hit(r, t_min, t_max, rec);
-  bool hit_right = right->hit(r, t_min, hit_left ? rec.t : t_max, rec);
+  auto const isect = st.params.intersection_cost;
+  best_cost = traversal_cost + isect * best_cost / std::max(box.area(), 1e-300);
+  if (count <= st.params.max_leaf_size && best_cost >= isect * count)
+    return false;
 
-  return hit_left || hit_right;
+  auto const lo = centroid_box.min()[best_axis];
+  auto const scale = bins / (centroid_box.max()[best_axis] - lo);
+  auto it = std::partition(
+    indices.begin() + start,
+    indices.begin() + end,
+    [&st, best_axis, best_bin, lo, scale](std::uint32_t prim) {
+      int b = std::min(
+        bins - 1,
+        static_cast<int>((st.centroids[prim][best_axis] - lo) * scale));
+      return b <= best_bin;
+    });
+
+  axis = best_axis;
+  mid = static_cast<std::uint32_t>(it - indices.begin());
+  return true;
 }
 
-inline bool
-box_compare(const shared_ptr<hittable> a,
-            const shared_ptr<hittable> b,
-            int axis)
+inline void
+build_node(build_state& st,
+           std::uint32_t node_i,
+           std::uint32_t start,
+           std::uint32_t end,
+           unsigned depth)
 {
-  aabb box_a;
-  aabb box_b;
+  auto& indices = st.tree.indices;
+
+  aabb box = aabb::empty();
+  aabb centroid_box = aabb::empty();
+  for (auto i = start; i < end; ++i) {
+    auto const prim = indices[i];
+    grow(box, st.boxes[prim]);
+    grow(centroid_box, st.centroids[prim]);
+  }
+  st.tree.nodes[node_i].box = box;
+
+  auto const count = end - start;
+  if (1 == count) {
+    make_leaf(st, node_i, start, end);
+    return;
+  }
 
-  if (!a->bounding_box(box_a) || !b->bounding_box(box_b))
-    std::cerr << "No bounding box in bvh_node constructor.\n";
+  int axis = 0;
+  std::uint32_t mid = start;
 
-  return box_a.min().e[axis] < box_b.min().e[axis];
+  if (depth < sah_max_depth) {
+    if (!sah_split(st, box, centroid_box, start, end, axis, mid)) {
+      if (count <= st.params.max_leaf_size) {
+        make_leaf(st, node_i, start, end);
+        return;
+      }
+      // All centroids coincide: any split is as good as another.
+      mid = start;
+    }
+  }
+
+  if (mid == start || mid == end) {
+    // Median split along the widest centroid extent.
+    auto const d = centroid_box.max() - centroid_box.min();
+    axis = (d.x() > d.y() && d.x() > d.z()) ? 0 : (d.y() > d.z() ? 1 : 2);
+    mid = start + count / 2;
+    std::nth_element(indices.begin() + start,
+                     indices.begin() + mid,
+                     indices.begin() + end,
+                     [&st, axis](std::uint32_t a, std::uint32_t b) {
+                       return st.centroids[a][axis] < st.centroids[b][axis];
+                     });
+  }
+
+  auto const left = st.node_count.fetch_add(2, std::memory_order_relaxed);
+  st.tree.nodes[node_i].left_first = left;
+  st.tree.nodes[node_i].axis = static_cast<std::uint16_t>(axis);
+
+  if (count >= task_threshold) {
+#pragma omp task default(none) shared(st) firstprivate(left, start, mid, depth)
+    build_node(st, left, start, mid, depth + 1);
+#pragma omp task default(none) shared(st) firstprivate(left, mid, end, depth)
+    build_node(st, left + 1, mid, end, depth + 1);
+  } else {
+    build_node(st, left, start, mid, depth + 1);
+    build_node(st, left + 1, mid, end, depth + 1);
+  }
 }
 
-bool
-box_x_compare(const shared_ptr<hittable> a, const shared_ptr<hittable> b)
+inline void
+collect_stats(bvh_tree& tree, double intersection_cost)
 {
-  return box_compare(a, b, 0);
+  auto& s = tree.stats;
+  s.nodes = tree.nodes.size();
+  s.min_leaf = ~0u;
+
+  auto const root_area = std::max(tree.nodes[0].box.area(), 1e-300);
+  std::size_t prims = 0;
+
+  // (node, depth) pairs; an explicit stack keeps this safe for deep trees.
+  std::vector<std::pair<std::uint32_t, unsigned>> stack{ { 0, 1 } };
+  while (!stack.empty()) {
+    auto [node_i, depth] = stack.back();
+    stack.pop_back();
+    const auto& node = tree.nodes[node_i];
+
+    s.depth = std::max(s.depth, depth);
+    auto const rel_area = node.box.area() / root_area;
+
+    if (node.is_leaf()) {
+      ++s.leaves;
+      prims += node.count;
+      s.min_leaf = std::min<unsigned>(s.min_leaf, node.count);
+      s.max_leaf = std::max<unsigned>(s.max_leaf, node.count);
+      s.sah_cost += rel_area * intersection_cost * node.count;
+    } else {
+      s.sah_cost += rel_area * traversal_cost;
+      stack.push_back({ node.left_first, depth + 1 });
+      stack.push_back({ node.left_first + 1, depth + 1 });
+    }
+  }
+
+  s.avg_leaf = static_cast<double>(prims) / s.leaves;
 }
 
-bool
-box_y_compare(const shared_ptr<hittable> a, const shared_ptr<hittable> b)
+} // namespace bvh_detail
+
+// Builds the hierarchy with binned surface area heuristic splits. Large
+// subtrees are built in parallel as OpenMP tasks.
+inline bvh_tree
+build_bvh(const std::vector<aabb>& boxes,
+          const bvh_build_params& params = bvh_build_params{})
 {
-  return box_compare(a, b, 1);
+  bvh_tree tree;
+  if (boxes.empty())
+    return tree;
+
+  auto const start_time = std::chrono::steady_clock::now();
+
+  auto const n = static_cast<std::uint32_t>(boxes.size());
+  tree.indices.resize(n);
+  std::iota(tree.indices.begin(), tree.indices.end(), 0);
+  tree.nodes.resize(2 * static_cast<std::size_t>(n) - 1);
+
+  bvh_detail::build_state st{ boxes, params, std::vector<point3>(n), tree };
+#pragma omp parallel for
+  for (std::int64_t i = 0; i < static_cast<std::int64_t>(n); ++i)
+    st.centroids[i] = 0.5 * (boxes[i].min() + boxes[i].max());
+
+#pragma omp parallel
+#pragma omp single
+  bvh_detail::build_node(st, 0, 0, n, 1);
+
+  tree.nodes.resize(st.node_count.load());
+  tree.nodes.shrink_to_fit();
+
+  tree.stats.build_ms = std::chrono::duration<double, std::milli>(
+                          std::chrono::steady_clock::now() - start_time)
+                          .count();
+  bvh_detail::collect_stats(tree, params.intersection_cost);
+
+  return tree;
 }
 
-bool
-box_z_compare(const shared_ptr<hittable> a, const shared_ptr<hittable> b)
+// Iterative near-child-first traversal of the subtree under `root`.
+// `leaf(first, count, t_max)` tests the primitives of a leaf, returns whether
+// any was hit and shrinks t_max to the closest hit.
+template<typename Leaf>
+inline bool
+traverse_bvh(const std::vector<bvh_node>& nodes,
+             const ray& r,
+             double t_min,
+             double t_max,
+             Leaf&& leaf,
+             std::uint32_t root = 0)
 {
-  return box_compare(a, b, 2);
+  if (nodes.empty())
+    return false;
+
+  const vec3 inv_dir(
+    1.0 / r.direction().x(), 1.0 / r.direction().y(), 1.0 / r.direction().z());
+  const bool dir_neg[3] = { inv_dir.x() < 0, inv_dir.y() < 0, inv_dir.z() < 0 };
+
+  std::uint32_t stack[bvh_max_depth];
+  int stack_size = 0;
+  std::uint32_t node_i = root;
+  bool hit_anything = false;
+
+  while (true) {
+    const auto& node = nodes[node_i];
+
+    if (node.box.hit(r.origin(), inv_dir, t_min, t_max)) {
+      if (node.is_leaf()) {
+        if (leaf(node.left_first, node.count, t_max))
+          hit_anything = true;
+      } else {
+        // Descend into the child nearer along the split axis, postpone the
+        // other one.
+        if (dir_neg[node.axis]) {
+          stack[stack_size++] = node.left_first;
+          node_i = node.left_first + 1;
+        } else {
+          stack[stack_size++] = node.left_first + 1;
+          node_i = node.left_first;
+        }
+        continue;
+      }
+    }
+
+    if (0 == stack_size)
+      break;
+    node_i = stack[--stack_size];
+  }
+
+  return hit_anything;
 }
 
-bvh_node::bvh_node(const std::vector<shared_ptr<hittable>>& src_objects,
-                   size_t start,
-                   size_t end)
+// Traversal of a coherent packet (see ray_packet::coherent()), ordered by
+// the direction of its first active lane. `leaf(first, count, lanes)` tests
+// the primitives of a leaf for the given lanes, shrinks their t_max and
+// returns the lanes that hit. Once a single lane is left in a subtree it is
+// handed to `single(node, lane)`, which traverses the subtree with the
+// scalar ray, shrinks t_max[lane] on a hit and returns whether there was one.
+template<typename Leaf, typename Single>
+inline int
+traverse_bvh_packet(const std::vector<bvh_node>& nodes,
+                    const ray_packet& rp,
+                    int active,
+                    double t_min,
+                    double* t_max,
+                    Leaf&& leaf,
+                    Single&& single)
 {
-  auto objects =
-    src_objects; // Create a modifiable array of the source scene objects
+  if (nodes.empty() || 0 == active)
+    return 0;
 
-  int axis = random_int(0, 2);
-  auto comparator = (axis == 0)   ? box_x_compare
-                    : (axis == 1) ? box_y_compare
-                                  : box_z_compare;
+  int lead = 0;
+  while (0 == (active & (1 << lead)))
+    ++lead;
+  bool dir_neg[3];
+  vdouble4 org[3], inv_dir[3];
+  for (int a = 0; a < 3; ++a) {
+    dir_neg[a] = rp.inv_dir[a][lead] < 0;
+    org[a] = vdouble4::load(rp.org[a]);
+    inv_dir[a] = vdouble4::load(rp.inv_dir[a]);
+  }
 
-  size_t object_span = end - start;
+  // Node to visit and the lanes still interested in it.
+  struct entry
+  {
+    std::uint32_t node;
+    int lanes;
+  };
+  entry stack[bvh_max_depth];
+  int stack_size = 0;
+  entry cur{ 0, active };
+  int hits = 0;
 
-  if (object_span == 1) {
-    left = right = objects[start];
-  } else if (object_span == 2) {
-    if (comparator(objects[start], objects[start + 1])) {
-      left = objects[start];
-      right = objects[start + 1];
-    } else {
-      left = objects[start + 1];
-      right = objects[start];
+  while (true) {
+    const auto& node = nodes[cur.node];
+
+    // Slab test of all lanes against the node box, as in aabb::hit().
+    auto lo = vdouble4(t_min);
+    auto hi = vdouble4::load(t_max);
+    for (int a = 0; a < 3; ++a) {
+      auto t0 = (vdouble4(node.box.minimum.e[a]) - org[a]) * inv_dir[a];
+      auto t1 = (vdouble4(node.box.maximum.e[a]) - org[a]) * inv_dir[a];
+      if (dir_neg[a])
+        std::swap(t0, t1);
+      lo = max(t0, lo);
+      hi = min(t1, hi);
     }
-  } else {
-    std::sort(objects.begin() + start, objects.begin() + end, comparator);
+    int lanes = cur.lanes & (lo < hi).movemask();
+
+    if (0 != lanes && 1 == lane_count(lanes)) {
+      // The packet has diverged to a single ray.
+      int i = 0;
+      while (0 == (lanes & (1 << i)))
+        ++i;
+      if (single(cur.node, i))
+        hits |= 1 << i;
+    } else if (0 != lanes) {
+      if (node.is_leaf()) {
+        hits |= leaf(node.left_first, node.count, lanes);
+      } else {
+        auto const near = dir_neg[node.axis] ? node.left_first + 1
+                                             : node.left_first;
+        auto const far = dir_neg[node.axis] ? node.left_first
+                                            : node.left_first + 1;
+        stack[stack_size++] = { far, lanes };
+        cur = { near, lanes };
+        continue;
+      }
+    }
+
+    if (0 == stack_size)
+      break;
+    cur = stack[--stack_size];
+  }
+
+  return hits;
+}
+
+// Bounding volume hierarchy over the objects of a hittable_list.
+class bvh : public hittable
+{
+public:
+  bvh() {}
+
+  bvh(const hittable_list& list)
+  {
+    std::vector<aabb> boxes(list.objects.size());
+    for (size_t i = 0; i < list.objects.size(); ++i)
+      if (!list.objects[i]->bounding_box(boxes[i]))
+        std::cerr << "No bounding box in bvh constructor.\n";
+
+    bvh_tree tree = build_bvh(boxes);
+
+    nodes = std::move(tree.nodes);
+    stats = tree.stats;
+    objects.reserve(tree.indices.size());
+    for (auto i : tree.indices)
+      objects.push_back(list.objects[i]);
+  }
+
+  virtual bool hit(const ray& r,
+                   double t_min,
+                   double t_max,
+                   hit_record& rec) const override
+  {
+    return hit_subtree(0, r, t_min, t_max, rec);
+  }
+
+  virtual int hit_packet(const ray_packet& rp,
+                         int active,
+                         double t_min,
+                         double* t_max,
+                         hit_record* rec) const override;
 
-    auto mid = start + object_span / 2;
-    left = make_shared<bvh_node>(objects, start, mid);
-    right = make_shared<bvh_node>(objects, mid, end);
+  virtual bool bounding_box(aabb& output_box) const override
+  {
+    if (nodes.empty())
+      return false;
+    output_box = nodes[0].box;
+    return true;
   }
 
-  aabb box_left, box_right;
+private:
+  bool hit_subtree(std::uint32_t root,
+                   const ray& r,
+                   double t_min,
+                   double t_max,
+                   hit_record& rec) const
+  {
+    return traverse_bvh(
+      nodes,
+      r,
+      t_min,
+      t_max,
+      [this, &r, t_min, &rec](
+        std::uint32_t first, std::uint32_t count, double& closest) {
+        bool hit_anything = false;
+        for (auto i = first; i < first + count; ++i) {
+          if (objects[i]->hit(r, t_min, closest, rec)) {
+            hit_anything = true;
+            closest = rec.t;
+          }
+        }
+        return hit_anything;
+      },
+      root);
+  }
 
-  if (!left->bounding_box(box_left) || !right->bounding_box(box_right))
-    std::cerr << "No bounding box in bvh_node constructor.\n";
+public:
+  std::vector<bvh_node> nodes;
+  bvh_stats stats;
+  // Objects in leaf order.
+  std::vector<shared_ptr<hittable>> objects;
+};
+
+inline int
+bvh::hit_packet(const ray_packet& rp,
+                int active,
+                double t_min,
+                double* t_max,
+                hit_record* rec) const
+{
+  // Rays heading different ways would disagree on the traversal order.
+  if (!rp.coherent(active))
+    return hittable::hit_packet(rp, active, t_min, t_max, rec);
 
-  box = surrounding_box(box_left, box_right);
+  return traverse_bvh_packet(
+    nodes,
+    rp,
+    active,
+    t_min,
+    t_max,
+    [this, &rp, t_min, t_max, rec](
+      std::uint32_t first, std::uint32_t count, int lanes) {
+      int hits = 0;
+      for (auto i = first; i < first + count; ++i)
+        hits |= objects[i]->hit_packet(rp, lanes, t_min, t_max, rec);
+      return hits;
+    },
+    [this, &rp, t_min, t_max, rec](std::uint32_t node, int i) {
+      if (!hit_subtree(node, rp.rays[i], t_min, t_max[i], rec[i]))
+        return false;
+      t_max[i] = rec[i].t;
+      return true;
+    });
 }
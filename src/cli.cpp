@@ -0,0 +1,156 @@
+// Command line renderer: renders without a display and writes a PPM file.
+
+#include <atomic>
+#include <boost/log/trivial.hpp>
+#include <boost/program_options.hpp>
+#include <chrono>
+#include <iostream>
+#include <memory>
+
+#include "manager_draw.h"
+#include "material.h"
+#include "scene_io.h"
+#include "sphere.h"
+
+namespace po = boost::program_options;
+
+namespace {
+
+// The scene the GUI starts with.
+scene
+default_scene()
+{
+  material_table materials;
+  hittable_list world;
+
+  std::array<double, 3> b{ 1.03961212, 0.231792344, 1.01046945 };
+  std::array<double, 3> c{ 6.00069867 * 1e-3,
+                           2.00179144 * 1e-2,
+                           1.03560653 * 1e2 };
+  auto tex_trans = materials.add(make_shared<dielectric>(b, c));
+  auto tex_checker = materials.add(make_shared<lambertian>(
+    make_shared<checker_texture>(color(0, 0, 0), color(1, 1, 1))));
+  auto tex_met_r = materials.add(
+    make_shared<lambertian>(make_shared<solid_color>(color(0.8, 0.6, 0.2))));
+  auto tex_met_l = materials.add(make_shared<metal>(color(0.1, 0.2, 0.5), 0.1));
+
+  world.add(make_shared<sphere>(point3{ 0, -101, 0 }, 100, tex_checker));
+  world.add(make_shared<sphere>(point3{ 0, 1, 0 }, 1, tex_trans));
+  world.add(make_shared<sphere>(point3{ 2, 0, 0 }, 1, tex_met_r));
+  world.add(make_shared<sphere>(point3{ -2, 0, 0 }, 1, tex_met_l));
+
+  return scene{ color(0.7, 0.8, 1.0),
+                point3{ 1, 3, 3 },
+                point3{ 0, 1, 0 },
+                world,
+                materials };
+}
+
+} // namespace
+
+int
+main(int argc, char* argv[])
+{
+  unsigned width, height, spp, max_depth;
+  unsigned threads;
+  double canvas;
+  double noise;
+  bool denoise;
+  std::string output, scene_path, save_text, save_binary;
+
+  po::options_description desc("Options");
+  desc.add_options()("help,h", "show this message")(
+    "width,W", po::value(&width)->default_value(800), "image width")(
+    "height,H", po::value(&height)->default_value(600), "image height")(
+    "spp,s", po::value(&spp)->default_value(100), "samples per pixel")(
+    "max-depth,d",
+    po::value(&max_depth)->default_value(50),
+    "maximum number of bounces")(
+    "canvas,c",
+    po::value(&canvas)->default_value(1.0),
+    "distance from the camera to the canvas")(
+    "threads,j",
+    po::value(&threads)->default_value(0),
+    "render threads, 0 for one per core")(
+    "noise,n",
+    po::value(&noise)->default_value(0.0),
+    "adaptive sampling: stop at this noise level (0..1 of the display "
+    "range), with --spp as the average budget; 0 disables")(
+    "denoise", po::bool_switch(&denoise), "filter the image for noise")(
+    "output,o", po::value(&output)->default_value("out.ppm"), "PPM file")(
+    "scene,i",
+    po::value(&scene_path),
+    "scene file, text or binary; the built-in scene if not given")(
+    "save-text",
+    po::value(&save_text),
+    "write the scene in the text form and exit")(
+    "save-binary",
+    po::value(&save_binary),
+    "write the scene in the binary form and exit");
+
+  po::variables_map vm;
+  try {
+    po::store(po::parse_command_line(argc, argv, desc), vm);
+    po::notify(vm);
+  } catch (const po::error& e) {
+    std::cerr << e.what() << '\n' << desc;
+    return 2;
+  }
+
+  if (vm.count("help")) {
+    std::cout << "Usage: " << argv[0] << " [options]\n" << desc;
+    return 0;
+  }
+
+  scene sc = default_scene();
+  try {
+    if (!scene_path.empty()) {
+      auto start = std::chrono::steady_clock::now();
+      sc = load_scene(scene_path);
+      auto end = std::chrono::steady_clock::now();
+      BOOST_LOG_TRIVIAL(info)
+        << "Scene " << scene_path << " loaded in "
+        << std::chrono::duration<double, std::milli>(end - start).count()
+        << " ms";
+    }
+    if (!save_text.empty())
+      save_scene_text(sc, save_text);
+    if (!save_binary.empty())
+      save_scene_binary(sc, save_binary);
+  } catch (const scene_error& e) {
+    BOOST_LOG_TRIVIAL(error) << e.what();
+    return 1;
+  }
+  if (!save_text.empty() || !save_binary.empty())
+    return 0;
+
+  settings_render rs{ width, height, spp, canvas, max_depth };
+  rs.threads_ = threads;
+  rs.noise_threshold_ = noise;
+  rs.denoise_ = denoise;
+
+  BOOST_LOG_TRIVIAL(info) << "Canvas: " << rs.width_ << 'x' << rs.height_
+                          << "; ray_pp: " << rs.ray_pp_;
+
+  auto job = manager_draw{}.draw(
+    rs,
+    std::make_shared<const scene>(std::move(sc)),
+    // Logged every 10%, the reporter fires far more often.
+    [step = std::make_shared<std::atomic<int>>(-1)](render_progress progress) {
+      int const now = static_cast<int>(progress.percent) / 10;
+      if (now <= step->exchange(now))
+        return;
+      BOOST_LOG_TRIVIAL(info)
+        << progress.percent << "%, " << progress.rays_per_sec * 1e-6
+        << " Mrays/s, ETA " << progress.eta << " s";
+    },
+    [](image, bool) {});
+
+  image img = job->result().get();
+  if (!write_ppm(img, output)) {
+    BOOST_LOG_TRIVIAL(error) << "Can not write " << output;
+    return 1;
+  }
+
+  return 0;
+}
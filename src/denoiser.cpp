@@ -0,0 +1,300 @@
+#include "denoiser.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring> // memcpy
+
+#if defined(__SSE2__)
+#include <pmmintrin.h>
+#endif
+
+namespace {
+
+// Filter passes; pass i spaces its taps 2^i pixels apart, so five passes
+// cover a 63 pixel wide footprint.
+constexpr int passes = 5;
+
+// Edge-stopping parameters as in SVGF: luminance differences are measured
+// in standard deviations and depth differences against the local depth
+// slope. Normals weigh in with the 128th power of their cosine, see pow128.
+constexpr float sigma_luminance = 4.0f;
+constexpr float sigma_depth = 1.0f;
+
+// Pixels darker than this in every albedo channel carry no usable estimate
+// of their lighting and are left alone: their normal is cleared, which
+// gives them zero weight both ways.
+constexpr float min_albedo = 0.01f;
+
+// Taps of the linear B-spline; the 3x3 kernel does as well as the 5x5 B3
+// spline at a third of the cost.
+constexpr float kernel[3] = { 0.25f, 0.5f, 0.25f };
+
+// max(x, lo) without a comparison, which under the default -ftrapping-math
+// would keep the loops below from being vectorized.
+inline float
+at_least(float x, float lo)
+{
+  return 0.5f * (x + lo + std::abs(x - lo));
+}
+
+// exp(x) for x <= 0, to about 2e-3 relative, which is plenty for weights,
+// in a form the vectorizer accepts: 2^x by the integer part put into the
+// exponent bits and a polynomial for the fraction.
+inline float
+exp_neg(float x)
+{
+  float const t = at_least(x, -80.0f) * 1.44269504f;
+  auto const i = static_cast<std::int32_t>(t);
+  float const f = t - i;
+  float const p =
+    1.0f + f * (0.6931472f + f * (0.2402265f + f * (0.05550411f +
+                                                    f * 0.009618129f)));
+  std::int32_t const bits = (i + 127) << 23;
+  float scale;
+  std::memcpy(&scale, &bits, sizeof scale);
+  return p * scale;
+}
+
+// x^128 by repeated squaring, spelled out so the loops around it stay
+// branch-free.
+inline float
+pow128(float x)
+{
+  x *= x;
+  x *= x;
+  x *= x;
+  x *= x;
+  x *= x;
+  x *= x;
+  return x * x;
+}
+
+inline float
+luminance(float r, float g, float b)
+{
+  return 0.2126f * r + 0.7152f * g + 0.0722f * b;
+}
+
+// Flushes denormals to zero on the calling thread while in scope. Weights
+// across edges fall far below the normal range, where arithmetic on them
+// would cost more than the rest of the filter; what they add is nil anyway.
+class flush_denormals
+{
+#if defined(__SSE2__)
+public:
+  flush_denormals()
+    : saved_{ _mm_getcsr() }
+  {
+    _mm_setcsr(saved_ | _MM_FLUSH_ZERO_ON | _MM_DENORMALS_ZERO_ON);
+  }
+  ~flush_denormals() { _mm_setcsr(saved_); }
+
+private:
+  unsigned saved_;
+#endif
+};
+
+// The planes have a border as wide as the widest tap reaches. Border pixels
+// have no normal and so no weight, which spares the filter loop any bounds
+// checks.
+constexpr int margin = 1 << (passes - 1);
+
+} // namespace
+
+void
+denoiser::resize(unsigned width, unsigned height)
+{
+  if (width == width_ && height == height_)
+    return;
+  width_ = width;
+  height_ = height;
+
+  auto const size =
+    static_cast<std::size_t>(width + 2 * margin) * (height + 2 * margin);
+  std::vector<float>* planes[] = {
+    &in_.r,      &in_.g,      &in_.b,      &in_.var,        &out_.r,
+    &out_.g,     &out_.b,     &out_.var,   &albedo_r_,      &albedo_g_,
+    &albedo_b_,  &nx_,        &ny_,        &nz_,            &depth_,
+    &lum_,       &luminance_scale_,        &depth_scale_
+  };
+  for (auto* plane : planes)
+    plane->assign(size, 0.0f);
+}
+
+image
+denoiser::denoise(const framebuffer& fb, const guide_buffer& guides)
+{
+  int const w = fb.width();
+  int const h = fb.height();
+  resize(w, h);
+
+  int const stride = w + 2 * margin;
+  auto at = [stride](int x, int y) {
+    return static_cast<std::size_t>(y + margin) * stride + x + margin;
+  };
+
+  // Only the inner pixels are written from here on, so the border stays as
+  // resize left it. Every inner pixel is, though, as the planes are reused.
+#pragma omp parallel for schedule(static) num_threads(threads_)
+  for (int y = 0; y < h; ++y) {
+    for (int x = 0; x < w; ++x) {
+      auto const i = at(x, y);
+      auto const n = fb.samples(x, y);
+      auto const m = fb.mean(x, y);
+      auto const var = fb.variance(x, y);
+      auto const g = guides.sum(x, y);
+      auto const a = (n ? 1.0 / n : 0.0) * g.albedo;
+
+      albedo_r_[i] = std::max<float>(a.x(), min_albedo);
+      albedo_g_[i] = std::max<float>(a.y(), min_albedo);
+      albedo_b_[i] = std::max<float>(a.z(), min_albedo);
+      in_.r[i] = m.x() / albedo_r_[i];
+      in_.g[i] = m.y() / albedo_g_[i];
+      in_.b[i] = m.z() / albedo_b_[i];
+      // The channels are taken as independent.
+      float const vr = var.x() / (albedo_r_[i] * albedo_r_[i]);
+      float const vg = var.y() / (albedo_g_[i] * albedo_g_[i]);
+      float const vb = var.z() / (albedo_b_[i] * albedo_b_[i]);
+      in_.var[i] = 0.2126f * 0.2126f * vr + 0.7152f * 0.7152f * vg +
+                   0.0722f * 0.0722f * vb;
+
+      auto const len = g.normal.length();
+      bool const usable =
+        len > 0 && std::max({ a.x(), a.y(), a.z() }) > min_albedo;
+      nx_[i] = usable ? g.normal.x() / len : 0.0f;
+      ny_[i] = usable ? g.normal.y() / len : 0.0f;
+      nz_[i] = usable ? g.normal.z() / len : 0.0f;
+      depth_[i] = n ? g.depth / n : 0.0f;
+    }
+  }
+
+  // Depth differences are measured against the local change of depth per
+  // pixel, so surfaces seen at a grazing angle are not cut apart.
+#pragma omp parallel for schedule(static) num_threads(threads_)
+  for (int y = 0; y < h; ++y) {
+    for (int x = 0; x < w; ++x) {
+      auto const l = at(std::max(x - 1, 0), y);
+      auto const r = at(std::min(x + 1, w - 1), y);
+      auto const d = at(x, std::max(y - 1, 0));
+      auto const u = at(x, std::min(y + 1, h - 1));
+      float const slope = 0.5f * std::max(std::abs(depth_[r] - depth_[l]),
+                                          std::abs(depth_[u] - depth_[d]));
+      depth_scale_[at(x, y)] = 1.0f / (sigma_depth * slope + 1e-2f);
+    }
+  }
+
+  for (int pass = 0; pass < passes; ++pass) {
+    int const step = 1 << pass;
+
+    // The taps around the centre: offsets into the planes, spline weights
+    // and reciprocal distances in pixels.
+    constexpr int taps = 8;
+    std::ptrdiff_t offset[taps];
+    float tap[taps], inv_dist[taps];
+    int k = 0;
+    for (int dy = -1; dy <= 1; ++dy) {
+      for (int dx = -1; dx <= 1; ++dx) {
+        if (0 == dx && 0 == dy)
+          continue;
+        offset[k] = static_cast<std::ptrdiff_t>(dy * step) * stride +
+                    static_cast<std::ptrdiff_t>(dx * step);
+        tap[k] = kernel[1 + dy] * kernel[1 + dx];
+        inv_dist[k] = 1.0f / (step * std::sqrt(float(dx * dx + dy * dy)));
+        ++k;
+      }
+    }
+
+#pragma omp parallel num_threads(threads_)
+    {
+      flush_denormals const ftz;
+
+      // The luminance weight is scaled by the noise, estimated from the
+      // variance blurred over 3x3 pixels. The zero border makes it a little
+      // smaller along the image edges, which is harmless.
+#pragma omp for schedule(static)
+      for (int y = 0; y < h; ++y) {
+        std::size_t const row = at(0, y);
+        const float* below = &in_.var[row - stride];
+        const float* level = &in_.var[row];
+        const float* above = &in_.var[row + stride];
+
+#pragma omp simd
+        for (int x = 0; x < w; ++x) {
+          auto blur = [x](const float* v) {
+            return kernel[0] * v[x - 1] + kernel[1] * v[x] +
+                   kernel[2] * v[x + 1];
+          };
+          float const var = kernel[0] * blur(below) + kernel[1] * blur(level) +
+                            kernel[2] * blur(above);
+          std::size_t const i = row + x;
+          luminance_scale_[i] =
+            1.0f / (sigma_luminance * std::sqrt(var) + 1e-6f);
+          lum_[i] = luminance(in_.r[i], in_.g[i], in_.b[i]);
+        }
+      }
+
+#pragma omp for schedule(static)
+      for (int y = 0; y < h; ++y) {
+        std::size_t const row = at(0, y);
+
+#pragma omp simd
+        for (int x = 0; x < w; ++x) {
+          std::size_t const p = row + x;
+
+          // The centre tap always counts in full.
+          float const centre = kernel[1] * kernel[1];
+          float sum_w = centre;
+          float sum_r = centre * in_.r[p];
+          float sum_g = centre * in_.g[p];
+          float sum_b = centre * in_.b[p];
+          float sum_var = centre * centre * in_.var[p];
+
+          // Unrolled, the tap offsets are plain loop invariants and the loop
+          // over x vectorizes.
+#pragma GCC unroll 8
+          for (int k = 0; k < taps; ++k) {
+            std::size_t const q = p + offset[k];
+
+            float const cosine =
+              nx_[p] * nx_[q] + ny_[p] * ny_[q] + nz_[p] * nz_[q];
+            float const wn = pow128(at_least(cosine, 0.0f));
+            float const e =
+              std::abs(lum_[p] - lum_[q]) * luminance_scale_[p] +
+              std::abs(depth_[p] - depth_[q]) * depth_scale_[p] * inv_dist[k];
+            float const wq = tap[k] * wn * exp_neg(-e);
+
+            sum_w += wq;
+            sum_r += wq * in_.r[q];
+            sum_g += wq * in_.g[q];
+            sum_b += wq * in_.b[q];
+            sum_var += wq * wq * in_.var[q];
+          }
+
+          float const inv = 1.0f / sum_w;
+          out_.r[p] = sum_r * inv;
+          out_.g[p] = sum_g * inv;
+          out_.b[p] = sum_b * inv;
+          out_.var[p] = sum_var * inv * inv;
+        }
+      }
+    }
+
+    std::swap(in_, out_);
+  }
+
+  image result(w, h);
+#pragma omp parallel for schedule(static) num_threads(threads_)
+  for (int y = 0; y < h; ++y) {
+    // The planes are bottom-up, the image top-down.
+    std::uint32_t* dst = result.scan_line(h - 1 - y);
+    for (int x = 0; x < w; ++x) {
+      auto const i = at(x, y);
+      if (fb.samples(x, y))
+        dst[x] = display_pixel(in_.r[i] * albedo_r_[i],
+                               in_.g[i] * albedo_g_[i],
+                               in_.b[i] * albedo_b_[i]);
+    }
+  }
+  return result;
+}
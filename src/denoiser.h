@@ -0,0 +1,108 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+#include "framebuffer.h"
+#include "image.h"
+#include "rtweekend.h"
+#include "vec3.h"
+
+// What a camera sample shows the denoiser: the first surface that is not a
+// mirror or glass along its path, with its albedo tinted by the specular
+// surfaces passed through, its normal and the distance to it along the path.
+// Escaped rays leave the normal zero.
+struct guide_sample
+{
+  color albedo;
+  vec3 normal;
+  double depth = 0.0;
+};
+
+// Per pixel sums of guide samples, taken over the same samples as the
+// framebuffer they go with.
+class guide_buffer
+{
+public:
+  guide_buffer() {}
+  guide_buffer(unsigned width, unsigned height)
+    : width_{ width }
+    , albedo_r_(static_cast<std::size_t>(width) * height)
+    , albedo_g_(albedo_r_.size())
+    , albedo_b_(albedo_r_.size())
+    , normal_x_(albedo_r_.size())
+    , normal_y_(albedo_r_.size())
+    , normal_z_(albedo_r_.size())
+    , depth_(albedo_r_.size())
+  {}
+
+  void add(unsigned x, unsigned y, const guide_sample& sum)
+  {
+    auto const i = index(x, y);
+    albedo_r_[i] += static_cast<float>(sum.albedo.x());
+    albedo_g_[i] += static_cast<float>(sum.albedo.y());
+    albedo_b_[i] += static_cast<float>(sum.albedo.z());
+    normal_x_[i] += static_cast<float>(sum.normal.x());
+    normal_y_[i] += static_cast<float>(sum.normal.y());
+    normal_z_[i] += static_cast<float>(sum.normal.z());
+    depth_[i] += static_cast<float>(sum.depth);
+  }
+
+  guide_sample sum(unsigned x, unsigned y) const
+  {
+    auto const i = index(x, y);
+    guide_sample g;
+    g.albedo = color(albedo_r_[i], albedo_g_[i], albedo_b_[i]);
+    g.normal = vec3(normal_x_[i], normal_y_[i], normal_z_[i]);
+    g.depth = depth_[i];
+    return g;
+  }
+
+private:
+  std::size_t index(unsigned x, unsigned y) const
+  {
+    return static_cast<std::size_t>(y) * width_ + x;
+  }
+
+  unsigned width_ = 0;
+  std::vector<float> albedo_r_, albedo_g_, albedo_b_;
+  std::vector<float> normal_x_, normal_y_, normal_z_;
+  std::vector<float> depth_;
+};
+
+// Edge-avoiding a-trous wavelet filter (Dammertz et al., 2010) with the
+// variance-guided luminance weight of SVGF (Schied et al., 2017). Lighting
+// is filtered apart from the albedo, so textures stay sharp, and changes of
+// normal, depth or of luminance beyond the estimated noise stop the filter.
+// Keeps its working planes between calls, so denoising every preview of a
+// render allocates once.
+class denoiser
+{
+public:
+  explicit denoiser(int threads)
+    : threads_{ threads }
+  {}
+
+  // Returns the filtered image ready for display; pixels without samples
+  // stay black.
+  image denoise(const framebuffer& fb, const guide_buffer& guides);
+
+private:
+  // Demodulated lighting and the variance of its luminance.
+  struct lighting
+  {
+    std::vector<float> r, g, b, var;
+  };
+
+  void resize(unsigned width, unsigned height);
+
+  int threads_;
+  unsigned width_ = 0;
+  unsigned height_ = 0;
+  lighting in_, out_;
+  std::vector<float> albedo_r_, albedo_g_, albedo_b_;
+  std::vector<float> nx_, ny_, nz_;
+  std::vector<float> depth_, lum_;
+  // Reciprocals of the scales of the luminance and depth weights.
+  std::vector<float> luminance_scale_, depth_scale_;
+};
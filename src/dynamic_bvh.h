@@ -0,0 +1,556 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <queue>
+#include <vector>
+
+#include "bvh.h"
+
+// Top-level hierarchy kept alive across renders and edited in place. It
+// starts as an SAH build (see build_bvh()); objects inserted later are
+// linked in next to the node that grows the least in surface area, removed
+// ones are unlinked, and moved ones have their leaf and its ancestors
+// refitted bottom-up. Edits let the tree drift away from what a full build
+// would give, so optimize() rebuilds it once its SAH cost has grown by
+// rebuild_ratio, and an insertion rebuilds it once it has grown deeper than
+// traversal allows (bvh_max_depth).
+//
+// The nodes keep the layout of bvh_node and are traversed by the same code
+// as bvh. Objects are referred to by handles, which stay valid across
+// edits and rebuilds until the object is removed. The tree must not be
+// edited while it is being traversed.
+class dynamic_bvh : public hittable
+{
+public:
+  using handle = std::uint32_t;
+
+  // SAH cost growth, relative to the last full build, that optimize()
+  // tolerates.
+  static constexpr double rebuild_ratio = 1.3;
+
+  dynamic_bvh() {}
+
+  // The handle of an object is its position in the list.
+  explicit dynamic_bvh(const hittable_list& list)
+  {
+    for (const auto& object : list.objects)
+      new_slot(new_handle(), object);
+    rebuild();
+  }
+
+  handle insert(shared_ptr<hittable> object);
+  void remove(handle h);
+
+  // Replaces the object, usually by a moved copy of it, and refits the
+  // hierarchy to its new bounding box.
+  void update(handle h, shared_ptr<hittable> object);
+
+  // Full SAH build over the objects present.
+  void rebuild();
+
+  // Rebuilds if edits have made the tree worse than rebuild_ratio allows.
+  // Returns whether it did.
+  bool optimize()
+  {
+    if (nodes.empty() || sah_cost() <= rebuild_ratio * built_cost_)
+      return false;
+    rebuild();
+    return true;
+  }
+
+  // Expected cost of a random ray by the surface area heuristic, as in
+  // bvh_stats::sah_cost.
+  double sah_cost() const
+  {
+    if (nodes.empty())
+      return 0.0;
+    return area_sum_ / std::max(nodes[0].box.area(), 1e-300);
+  }
+
+  const shared_ptr<hittable>& object(handle h) const
+  {
+    return objects[slot_of_[h]];
+  }
+
+  std::size_t size() const { return live_; }
+
+  // Levels of nodes from the root to the deepest leaf.
+  unsigned height() const { return nodes.empty() ? 0 : height_[0]; }
+
+  bool hit(const ray& r,
+           double t_min,
+           double t_max,
+           hit_record& rec) const override
+  {
+    return hit_subtree(0, r, t_min, t_max, rec);
+  }
+
+  int hit_packet(const ray_packet& rp,
+                 int active,
+                 double t_min,
+                 double* t_max,
+                 hit_record* rec) const override;
+
+  bool bounding_box(aabb& output_box) const override
+  {
+    if (nodes.empty())
+      return false;
+    output_box = nodes[0].box;
+    return true;
+  }
+
+public:
+  // Unused nodes and slots are unreachable from the root.
+  std::vector<bvh_node> nodes;
+  // Stats of the last full build.
+  bvh_stats stats;
+  // Objects in leaf order; null in unused slots.
+  std::vector<shared_ptr<hittable>> objects;
+
+private:
+  static constexpr std::uint32_t none = ~std::uint32_t{ 0 };
+
+  bool hit_subtree(std::uint32_t root,
+                   const ray& r,
+                   double t_min,
+                   double t_max,
+                   hit_record& rec) const
+  {
+    return traverse_bvh(
+      nodes,
+      r,
+      t_min,
+      t_max,
+      [this, &r, t_min, &rec](
+        std::uint32_t first, std::uint32_t count, double& closest) {
+        bool hit_anything = false;
+        for (auto i = first; i < first + count; ++i) {
+          if (objects[i]->hit(r, t_min, closest, rec)) {
+            hit_anything = true;
+            closest = rec.t;
+          }
+        }
+        return hit_anything;
+      },
+      root);
+  }
+
+  handle new_handle()
+  {
+    if (!free_handles_.empty()) {
+      auto const h = free_handles_.back();
+      free_handles_.pop_back();
+      return h;
+    }
+    slot_of_.push_back(none);
+    return static_cast<handle>(slot_of_.size() - 1);
+  }
+
+  std::uint32_t new_slot(handle h, shared_ptr<hittable> object)
+  {
+    aabb box;
+    if (!object->bounding_box(box))
+      std::cerr << "No bounding box in dynamic_bvh.\n";
+
+    std::uint32_t slot;
+    if (!free_slots_.empty()) {
+      slot = free_slots_.back();
+      free_slots_.pop_back();
+    } else {
+      slot = static_cast<std::uint32_t>(objects.size());
+      objects.emplace_back();
+      boxes_.emplace_back();
+      handle_of_.push_back(none);
+      leaf_of_.push_back(none);
+    }
+    objects[slot] = std::move(object);
+    boxes_[slot] = box;
+    handle_of_[slot] = h;
+    slot_of_[h] = slot;
+    ++live_;
+    return slot;
+  }
+
+  void free_slot(std::uint32_t slot)
+  {
+    objects[slot].reset();
+    handle_of_[slot] = none;
+    leaf_of_[slot] = none;
+    free_slots_.push_back(slot);
+    --live_;
+  }
+
+  // Index of two adjacent unused nodes.
+  std::uint32_t new_pair()
+  {
+    if (!free_pairs_.empty()) {
+      auto const i = free_pairs_.back();
+      free_pairs_.pop_back();
+      return i;
+    }
+    auto const i = static_cast<std::uint32_t>(nodes.size());
+    nodes.resize(nodes.size() + 2);
+    parent_.resize(nodes.size(), none);
+    height_.resize(nodes.size(), 1);
+    return i;
+  }
+
+  // Share of a node in area_sum_.
+  double weight(std::uint32_t i) const
+  {
+    const auto& n = nodes[i];
+    return n.box.area() * (n.is_leaf() ? static_cast<double>(n.count)
+                                       : bvh_detail::traversal_cost);
+  }
+
+  // Puts node `from` at `to`, which is unused, and tells its children or
+  // objects where it went. Its parent is left to the caller.
+  void move_node(std::uint32_t from, std::uint32_t to)
+  {
+    nodes[to] = nodes[from];
+    height_[to] = height_[from];
+    const auto& n = nodes[to];
+    if (n.is_leaf()) {
+      for (auto s = n.left_first; s < n.left_first + n.count; ++s)
+        leaf_of_[s] = to;
+    } else {
+      parent_[n.left_first] = parent_[n.left_first + 1] = to;
+    }
+  }
+
+  // Box of a node from its children or objects.
+  aabb fitted_box(std::uint32_t i) const
+  {
+    const auto& n = nodes[i];
+    if (!n.is_leaf())
+      return surrounding_box(nodes[n.left_first].box,
+                             nodes[n.left_first + 1].box);
+    aabb box = aabb::empty();
+    for (auto s = n.left_first; s < n.left_first + n.count; ++s)
+      bvh_detail::grow(box, boxes_[s]);
+    return box;
+  }
+
+  // Refits node i and its ancestors, up to the first one whose box stays
+  // the same.
+  void refit(std::uint32_t i)
+  {
+    for (; none != i; i = parent_[i]) {
+      auto const box = fitted_box(i);
+      if (same(box, nodes[i].box))
+        return;
+      area_sum_ -= weight(i);
+      nodes[i].box = box;
+      area_sum_ += weight(i);
+    }
+  }
+
+  // Recomputes the height of node i, which is not a leaf, and of its
+  // ancestors, up to the first one whose height stays the same.
+  void update_height(std::uint32_t i)
+  {
+    for (; none != i; i = parent_[i]) {
+      const auto& n = nodes[i];
+      auto const h =
+        1 + std::max(height_[n.left_first], height_[n.left_first + 1]);
+      if (h == height_[i])
+        return;
+      height_[i] = h;
+    }
+  }
+
+  static bool same(const aabb& a, const aabb& b)
+  {
+    for (int k = 0; k < 3; ++k)
+      if (a.minimum[k] != b.minimum[k] || a.maximum[k] != b.maximum[k])
+        return false;
+    return true;
+  }
+
+  std::uint32_t find_sibling(const aabb& box) const;
+
+  // Parents of the nodes, `none` for the root and unused nodes.
+  std::vector<std::uint32_t> parent_;
+  // Heights of the subtrees under the nodes, 1 for a leaf.
+  std::vector<unsigned> height_;
+  // Per slot: the bounding box of the object, its handle and its leaf.
+  std::vector<aabb> boxes_;
+  std::vector<handle> handle_of_;
+  std::vector<std::uint32_t> leaf_of_;
+  // Per handle: the slot of the object.
+  std::vector<std::uint32_t> slot_of_;
+
+  std::vector<handle> free_handles_;
+  std::vector<std::uint32_t> free_slots_;
+  std::vector<std::uint32_t> free_pairs_;
+  std::size_t live_ = 0;
+
+  // Sum of the node areas weighted as in the SAH: the SAH cost times the
+  // root area.
+  double area_sum_ = 0.0;
+  // SAH cost right after the last full build.
+  double built_cost_ = 0.0;
+};
+
+// Branch and bound search for the node that, made the sibling of a new leaf
+// with the given box, adds the least surface area to the tree: its own
+// grown box plus the growth of all its ancestors (Bittner et al., "Fast
+// Insertion-Based Optimization of Bounding Volume Hierarchies", 2013).
+inline std::uint32_t
+dynamic_bvh::find_sibling(const aabb& box) const
+{
+  auto const area = box.area();
+
+  // (lower bound of the cost in the subtree, node, growth of its ancestors)
+  struct candidate
+  {
+    double bound;
+    std::uint32_t node;
+    double inherited;
+
+    bool operator<(const candidate& o) const { return bound > o.bound; }
+  };
+  std::priority_queue<candidate> queue;
+  queue.push({ area, 0, 0.0 });
+
+  std::uint32_t best = 0;
+  double best_cost = infinity;
+  while (!queue.empty()) {
+    auto const c = queue.top();
+    queue.pop();
+    if (c.bound >= best_cost)
+      break;
+
+    const auto& n = nodes[c.node];
+    auto const grown = surrounding_box(n.box, box).area();
+    auto const cost = c.inherited + grown;
+    if (cost < best_cost) {
+      best_cost = cost;
+      best = c.node;
+    }
+
+    if (!n.is_leaf()) {
+      auto const inherited = c.inherited + grown - n.box.area();
+      if (inherited + area < best_cost) {
+        queue.push({ inherited + area, n.left_first, inherited });
+        queue.push({ inherited + area, n.left_first + 1, inherited });
+      }
+    }
+  }
+  return best;
+}
+
+inline dynamic_bvh::handle
+dynamic_bvh::insert(shared_ptr<hittable> object)
+{
+  auto const h = new_handle();
+  auto const slot = new_slot(h, std::move(object));
+  auto const& box = boxes_[slot];
+
+  bvh_node leaf;
+  leaf.box = box;
+  leaf.left_first = slot;
+  leaf.count = 1;
+
+  if (nodes.empty()) {
+    nodes.push_back(leaf);
+    parent_.push_back(none);
+    height_.push_back(1);
+    leaf_of_[slot] = 0;
+    area_sum_ = weight(0);
+    built_cost_ = 1.0;
+    return h;
+  }
+
+  // The sibling moves down into a new pair of nodes next to the leaf, and
+  // its place is taken by their parent, split along the axis that separates
+  // the two the most.
+  auto const sibling = find_sibling(box);
+  aabb const other = nodes[sibling].box;
+  auto const d = (box.min() + box.max()) - (other.min() + other.max());
+  int const axis = (fabs(d.x()) > fabs(d.y()) && fabs(d.x()) > fabs(d.z()))
+                     ? 0
+                     : (fabs(d.y()) > fabs(d.z()) ? 1 : 2);
+
+  // The child lower along the axis comes first, as in build_bvh(), for
+  // traversal to visit the nearer one first.
+  auto const pair = new_pair();
+  auto const moved = d[axis] < 0 ? pair + 1 : pair;
+  auto const added = d[axis] < 0 ? pair : pair + 1;
+  move_node(sibling, moved);
+  nodes[added] = leaf;
+  height_[added] = 1;
+  leaf_of_[slot] = added;
+  parent_[pair] = parent_[pair + 1] = sibling;
+  area_sum_ += weight(added);
+
+  auto& n = nodes[sibling];
+  n.box = surrounding_box(box, other);
+  n.left_first = pair;
+  n.count = 0;
+  n.axis = static_cast<std::uint16_t>(axis);
+  // The moved node took its share of area_sum_ along.
+  area_sum_ += weight(sibling);
+  if (none != parent_[sibling])
+    refit(parent_[sibling]);
+
+  // The subtree of the moved node went one level down, which insertions
+  // that keep nesting into it repeat until traversal runs out of stack.
+  update_height(sibling);
+  if (height() > bvh_max_depth)
+    rebuild();
+  return h;
+}
+
+inline void
+dynamic_bvh::remove(handle h)
+{
+  auto const slot = slot_of_[h];
+  auto const leaf = leaf_of_[slot];
+  slot_of_[h] = none;
+  free_handles_.push_back(h);
+
+  auto& n = nodes[leaf];
+  if (n.count > 1) {
+    // The last object of the leaf takes the place of the removed one.
+    auto const last = n.left_first + n.count - 1;
+    if (last != slot) {
+      objects[slot] = std::move(objects[last]);
+      boxes_[slot] = boxes_[last];
+      handle_of_[slot] = handle_of_[last];
+      slot_of_[handle_of_[slot]] = slot;
+    }
+    area_sum_ -= weight(leaf);
+    --n.count;
+    area_sum_ += weight(leaf);
+    free_slot(last);
+    refit(leaf);
+    return;
+  }
+
+  free_slot(slot);
+  area_sum_ -= weight(leaf);
+  if (0 == leaf) {
+    nodes.clear();
+    parent_.clear();
+    height_.clear();
+    free_pairs_.clear();
+    area_sum_ = 0.0;
+    return;
+  }
+
+  // The sibling takes the place of the parent.
+  auto const parent = parent_[leaf];
+  auto const pair = nodes[parent].left_first;
+  auto const sibling = leaf == pair ? pair + 1 : pair;
+  area_sum_ -= weight(parent);
+  move_node(sibling, parent);
+  parent_[pair] = parent_[pair + 1] = none;
+  free_pairs_.push_back(pair);
+  if (none != parent_[parent]) {
+    refit(parent_[parent]);
+    update_height(parent_[parent]);
+  }
+}
+
+inline void
+dynamic_bvh::update(handle h, shared_ptr<hittable> object)
+{
+  auto const slot = slot_of_[h];
+  if (!object->bounding_box(boxes_[slot]))
+    std::cerr << "No bounding box in dynamic_bvh.\n";
+  objects[slot] = std::move(object);
+  refit(leaf_of_[slot]);
+}
+
+inline void
+dynamic_bvh::rebuild()
+{
+  // The objects present, in slot order.
+  std::vector<std::uint32_t> slots;
+  slots.reserve(live_);
+  for (std::uint32_t s = 0; s < objects.size(); ++s)
+    if (objects[s])
+      slots.push_back(s);
+  std::vector<aabb> boxes(slots.size());
+  for (std::size_t i = 0; i < slots.size(); ++i)
+    boxes[i] = boxes_[slots[i]];
+
+  bvh_tree tree = build_bvh(boxes);
+
+  std::vector<shared_ptr<hittable>> old_objects;
+  old_objects.swap(objects);
+  auto const old_handles = std::move(handle_of_);
+
+  auto const n = tree.indices.size();
+  objects.resize(n);
+  boxes_.resize(n);
+  handle_of_.resize(n);
+  leaf_of_.assign(n, none);
+  for (std::uint32_t i = 0; i < n; ++i) {
+    auto const s = slots[tree.indices[i]];
+    objects[i] = std::move(old_objects[s]);
+    boxes_[i] = boxes[tree.indices[i]];
+    handle_of_[i] = old_handles[s];
+    slot_of_[handle_of_[i]] = i;
+  }
+  free_slots_.clear();
+  free_pairs_.clear();
+
+  nodes = std::move(tree.nodes);
+  stats = tree.stats;
+  parent_.assign(nodes.size(), none);
+  for (std::uint32_t i = 0; i < nodes.size(); ++i) {
+    const auto& node = nodes[i];
+    if (node.is_leaf()) {
+      for (auto s = node.left_first; s < node.left_first + node.count; ++s)
+        leaf_of_[s] = i;
+    } else {
+      parent_[node.left_first] = parent_[node.left_first + 1] = i;
+    }
+  }
+
+  // Children come after their parents in the build order.
+  height_.assign(nodes.size(), 1);
+  for (auto i = nodes.size(); i-- > 0;) {
+    const auto& node = nodes[i];
+    if (!node.is_leaf())
+      height_[i] = 1 + std::max(height_[node.left_first],
+                                height_[node.left_first + 1]);
+  }
+
+  built_cost_ = stats.sah_cost;
+  area_sum_ = nodes.empty() ? 0.0 : built_cost_ * nodes[0].box.area();
+}
+
+inline int
+dynamic_bvh::hit_packet(const ray_packet& rp,
+                        int active,
+                        double t_min,
+                        double* t_max,
+                        hit_record* rec) const
+{
+  if (!rp.coherent(active))
+    return hittable::hit_packet(rp, active, t_min, t_max, rec);
+
+  return traverse_bvh_packet(
+    nodes,
+    rp,
+    active,
+    t_min,
+    t_max,
+    [this, &rp, t_min, t_max, rec](
+      std::uint32_t first, std::uint32_t count, int lanes) {
+      int hits = 0;
+      for (auto i = first; i < first + count; ++i)
+        hits |= objects[i]->hit_packet(rp, lanes, t_min, t_max, rec);
+      return hits;
+    },
+    [this, &rp, t_min, t_max, rec](std::uint32_t node, int i) {
+      if (!hit_subtree(node, rp.rays[i], t_min, t_max[i], rec[i]))
+        return false;
+      t_max[i] = rec[i].t;
+      return true;
+    });
+}
@@ -0,0 +1,173 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "image.h"
+#include "rtweekend.h"
+#include "vec3.h"
+
+// Gamma-corrects a linear colour for gamma=2.0 and quantizes it into a
+// 0xAARRGGBB word.
+inline std::uint32_t
+display_pixel(float r, float g, float b)
+{
+  auto quantize = [](float linear) {
+    float v = std::sqrt(linear);
+    return static_cast<std::uint32_t>(
+      256.0f * std::min(std::max(v, 0.0f), 0.999f));
+  };
+  return 0xff000000u | (quantize(r) << 16) | (quantize(g) << 8) | quantize(b);
+}
+
+// High dynamic range accumulation buffer: per pixel sums of the radiance
+// samples, of their squares and their number, rows stored bottom-up as the
+// camera produces them. A pixel belongs to one render worker at a time, so
+// writes need no locks; buffers of separate renders of the same frame can be
+// merged.
+class framebuffer
+{
+public:
+  framebuffer() {}
+  framebuffer(unsigned width, unsigned height)
+    : width_{ width }
+    , height_{ height }
+    , r_(static_cast<std::size_t>(width) * height)
+    , g_(r_.size())
+    , b_(r_.size())
+    , r2_(r_.size())
+    , g2_(r_.size())
+    , b2_(r_.size())
+    , samples_(r_.size())
+  {}
+
+  unsigned width() const { return width_; }
+  unsigned height() const { return height_; }
+
+  // `squares` is the per channel sum of the squared samples.
+  void add(unsigned x,
+           unsigned y,
+           const color& sum,
+           const color& squares,
+           std::uint32_t samples)
+  {
+    auto const i = index(x, y);
+    r_[i] += static_cast<float>(sum.x());
+    g_[i] += static_cast<float>(sum.y());
+    b_[i] += static_cast<float>(sum.z());
+    r2_[i] += static_cast<float>(squares.x());
+    g2_[i] += static_cast<float>(squares.y());
+    b2_[i] += static_cast<float>(squares.z());
+    samples_[i] += samples;
+  }
+
+  std::uint32_t samples(unsigned x, unsigned y) const
+  {
+    return samples_[index(x, y)];
+  }
+
+  color mean(unsigned x, unsigned y) const
+  {
+    auto const i = index(x, y);
+    auto const scale = samples_[i] ? 1.0 / samples_[i] : 0.0;
+    return scale * color(r_[i], g_[i], b_[i]);
+  }
+
+  // Estimated variance of the mean, per channel; zero while fewer than two
+  // samples are in.
+  color variance(unsigned x, unsigned y) const
+  {
+    auto const i = index(x, y);
+    auto const n = samples_[i];
+    if (n < 2)
+      return color(0, 0, 0);
+
+    auto channel = [n](double sum, double squares) {
+      return std::max(0.0, (squares - sum * sum / n) / (n - 1)) / n;
+    };
+    return color(
+      channel(r_[i], r2_[i]), channel(g_[i], g2_[i]), channel(b_[i], b2_[i]));
+  }
+
+  // Estimated noise of the pixel as displayed: by how much one standard
+  // error of the mean moves the gamma-corrected value of the worst channel,
+  // on the 0..1 scale. Pixels with fewer than two samples report 1.
+  double noise(unsigned x, unsigned y) const
+  {
+    if (samples(x, y) < 2)
+      return 1.0;
+
+    auto const m = mean(x, y);
+    auto const var = variance(x, y);
+    double worst = 0.0;
+    for (int c = 0; c < 3; ++c) {
+      double const lo = std::min(std::max<double>(m[c], 0.0), 1.0);
+      double const hi = std::min(lo + std::sqrt(var[c]), 1.0);
+      worst = std::max(worst, std::sqrt(hi) - std::sqrt(lo));
+    }
+    return worst;
+  }
+
+  void merge(const framebuffer& other)
+  {
+    for (std::size_t i = 0; i < r_.size(); ++i) {
+      r_[i] += other.r_[i];
+      g_[i] += other.g_[i];
+      b_[i] += other.b_[i];
+      r2_[i] += other.r2_[i];
+      g2_[i] += other.g2_[i];
+      b2_[i] += other.b2_[i];
+      samples_[i] += other.samples_[i];
+    }
+  }
+
+  // Output stage: divides by the sample counts, gamma-corrects for
+  // gamma=2.0, quantizes and writes 0xAARRGGBB words top row first.
+  // `stride` is in pixels.
+  void resolve(std::uint32_t* out, std::size_t stride) const;
+
+  image resolve() const
+  {
+    image img(width_, height_);
+    resolve(img.pixels_.data(), width_);
+    return img;
+  }
+
+private:
+  std::size_t index(unsigned x, unsigned y) const
+  {
+    return static_cast<std::size_t>(y) * width_ + x;
+  }
+
+  unsigned width_ = 0;
+  unsigned height_ = 0;
+  // Colour planes kept apart so the resolve loop vectorizes.
+  std::vector<float> r_, g_, b_;
+  // Sums of squared samples, for variance estimates.
+  std::vector<float> r2_, g2_, b2_;
+  std::vector<std::uint32_t> samples_;
+};
+
+inline void
+framebuffer::resolve(std::uint32_t* out, std::size_t stride) const
+{
+#pragma omp parallel for schedule(static)
+  for (int y = 0; y < static_cast<int>(height_); ++y) {
+    const auto row = static_cast<std::size_t>(y) * width_;
+    const float* r = &r_[row];
+    const float* g = &g_[row];
+    const float* b = &b_[row];
+    const std::uint32_t* n = &samples_[row];
+    // The buffer is bottom-up, the output top-down.
+    std::uint32_t* dst = out + (height_ - 1 - y) * stride;
+
+#pragma omp simd
+    for (unsigned x = 0; x < width_; ++x) {
+      float const scale = n[x] ? 1.0f / n[x] : 0.0f;
+      dst[x] = display_pixel(scale * r[x], scale * g[x], scale * b[x]);
+    }
+  }
+}
@@ -1,16 +1,23 @@
 #pragma once
 
 #include "aabb.h"
+#include "affine.h"
 #include "ray.h"
+#include "ray_packet.h"
 #include "rtweekend.h"
 
-class material;
+#include <cstdint>
+
+class material_table;
+
+// Index of a material in the material_table of the scene.
+using material_id = std::uint32_t;
 
 struct hit_record
 {
   point3 p;
   vec3 normal;
-  std::shared_ptr<material> mat_ptr;
+  material_id mat_id;
   double t;
   double u;
   double v;
@@ -32,139 +39,179 @@ public:
                    hit_record& rec) const = 0;
   virtual bool bounding_box(aabb& output_box) const = 0;
 
-  virtual std::string about() const { return "Нет информации по объету"; }
-};
-
-class translate : public hittable
-{
-public:
-  translate(shared_ptr<hittable> p, const vec3& displacement)
-    : ptr(p)
-    , offset(displacement)
-  {}
-
-  virtual bool hit(const ray& r,
-                   double t_min,
-                   double t_max,
-                   hit_record& rec) const override;
-
-  virtual bool bounding_box(aabb& output_box) const override;
-
-public:
-  shared_ptr<hittable> ptr;
-  vec3 offset;
-};
+  // Intersects the lanes of a packet selected by the `active` mask. t_max
+  // holds the upper bound of every lane and is shrunk to the hits found.
+  // Returns the mask of lanes that hit something; rec is filled for those.
+  virtual int hit_packet(const ray_packet& rp,
+                         int active,
+                         double t_min,
+                         double* t_max,
+                         hit_record* rec) const
+  {
+    int hits = 0;
+    for (int i = 0; i < ray_packet::size; ++i) {
+      if ((active & (1 << i)) && hit(rp.rays[i], t_min, t_max[i], rec[i])) {
+        t_max[i] = rec[i].t;
+        hits |= 1 << i;
+      }
+    }
+    return hits;
+  }
 
-inline bool
-translate::hit(const ray& r, double t_min, double t_max, hit_record& rec) const
-{
-  ray moved_r(r.origin() - offset, r.direction());
-  if (!ptr->hit(moved_r, t_min, t_max, rec))
+  // Light sampling. Whether the object is made of emitting material and
+  // implements the two functions below.
+  virtual bool is_light(const material_table& materials) const
+  {
     return false;
+  }
 
-  rec.p += offset;
-  rec.set_face_normal(moved_r, rec.normal);
-
-  return true;
-}
-
-inline bool
-translate::bounding_box(aabb& output_box) const
-{
-  if (!ptr->bounding_box(output_box))
-    return false;
+  // Density, per unit solid angle, with which random(origin) produces
+  // `direction`.
+  virtual double pdf_value(const point3& origin, const vec3& direction) const
+  {
+    return 0.0;
+  }
 
-  output_box = aabb(output_box.min() + offset, output_box.max() + offset);
+  // Random direction from origin towards the object, distributed as
+  // pdf_value() tells.
+  virtual vec3 random(const point3& origin) const { return vec3(1, 0, 0); }
 
-  return true;
-}
+  virtual std::string about(const material_table& materials) const
+  {
+    return "Нет информации по объету";
+  }
+};
 
-class rotate_y : public hittable
+// Geometry placed in the scene by an affine transform. The geometry itself,
+// a mesh or a sphere soup with its own hierarchy or any other object, is
+// shared, not copied: many instances may refer to one, each costing a
+// transform and a leaf of the top-level BVH. Moving an instance changes its
+// transform, after which only that top level has to be rebuilt.
+class instance : public hittable
 {
 public:
-  rotate_y(shared_ptr<hittable> p, double angle);
+  instance(shared_ptr<hittable> object, const affine& to_world)
+    : object(std::move(object))
+  {
+    set_transform(to_world);
+  }
 
-  virtual bool hit(const ray& r,
-                   double t_min,
-                   double t_max,
-                   hit_record& rec) const override;
+  void set_transform(const affine& t)
+  {
+    to_world = t;
+    to_object = t.inverse();
+    has_box = object->bounding_box(box);
+    if (has_box)
+      box = to_world.box(box);
+  }
 
-  virtual bool bounding_box(aabb& output_box) const override
+  bool hit(const ray& r,
+           double t_min,
+           double t_max,
+           hit_record& rec) const override
   {
-    output_box = bbox;
-    return hasbox;
+    // The direction is not normalized, so distances along the ray are the
+    // same in both spaces.
+    if (!object->hit(local(r), t_min, t_max, rec))
+      return false;
+    to_world_hit(rec);
+    return true;
   }
 
-public:
-  shared_ptr<hittable> ptr;
-  double sin_theta;
-  double cos_theta;
-  bool hasbox;
-  aabb bbox;
-};
+  int hit_packet(const ray_packet& rp,
+                 int active,
+                 double t_min,
+                 double* t_max,
+                 hit_record* rec) const override
+  {
+    // A rotation can flip the signs of direction components, so the local
+    // packet may be incoherent; the object checks and then traces the rays
+    // one by one.
+    ray rs[ray_packet::size];
+    for (int i = 0; i < ray_packet::size; ++i)
+      rs[i] = (active & (1 << i)) ? local(rp.rays[i]) : rp.rays[i];
+
+    int hits = object->hit_packet(ray_packet(rs), active, t_min, t_max, rec);
+    for (int i = 0; i < ray_packet::size; ++i)
+      if (hits & (1 << i))
+        to_world_hit(rec[i]);
+    return hits;
+  }
 
-inline rotate_y::rotate_y(shared_ptr<hittable> p, double angle)
-  : ptr(p)
-{
-  auto radians = degrees_to_radians(angle);
-  sin_theta = sin(radians);
-  cos_theta = cos(radians);
-  hasbox = ptr->bounding_box(bbox);
-
-  point3 min(infinity, infinity, infinity);
-  point3 max(-infinity, -infinity, -infinity);
-
-  for (int i = 0; i < 2; i++) {
-    for (int j = 0; j < 2; j++) {
-      for (int k = 0; k < 2; k++) {
-        auto x = i * bbox.max().x() + (1 - i) * bbox.min().x();
-        auto y = j * bbox.max().y() + (1 - j) * bbox.min().y();
-        auto z = k * bbox.max().z() + (1 - k) * bbox.min().z();
-
-        auto newx = cos_theta * x + sin_theta * z;
-        auto newz = -sin_theta * x + cos_theta * z;
-
-        vec3 tester(newx, y, newz);
-
-        for (int c = 0; c < 3; c++) {
-          min[c] = fmin(min[c], tester[c]);
-          max[c] = fmax(max[c], tester[c]);
-        }
-      }
-    }
+  bool bounding_box(aabb& output_box) const override
+  {
+    output_box = box;
+    return has_box;
   }
 
-  bbox = aabb(min, max);
-}
+  // Densities per solid angle carry over only if the transform keeps
+  // angles; other emitting instances are left to be hit by chance.
+  bool is_light(const material_table& materials) const override
+  {
+    return object->is_light(materials) && to_world.is_similarity();
+  }
 
-inline bool
-rotate_y::hit(const ray& r, double t_min, double t_max, hit_record& rec) const
-{
-  auto origin = r.origin();
-  auto direction = r.direction();
+  double pdf_value(const point3& origin, const vec3& direction) const override
+  {
+    return object->pdf_value(to_object.point(origin),
+                             to_object.vector(direction));
+  }
 
-  origin[0] = cos_theta * r.origin()[0] - sin_theta * r.origin()[2];
-  origin[2] = sin_theta * r.origin()[0] + cos_theta * r.origin()[2];
+  vec3 random(const point3& origin) const override
+  {
+    return to_world.vector(object->random(to_object.point(origin)));
+  }
 
-  direction[0] = cos_theta * r.direction()[0] - sin_theta * r.direction()[2];
-  direction[2] = sin_theta * r.direction()[0] + cos_theta * r.direction()[2];
+  std::string about(const material_table& materials) const override
+  {
+    return object->about(materials);
+  }
 
-  ray rotated_r(origin, direction);
+public:
+  shared_ptr<hittable> object;
+  affine to_world;
+  affine to_object;
 
-  if (!ptr->hit(rotated_r, t_min, t_max, rec))
-    return false;
+private:
+  ray local(const ray& r) const
+  {
+    ray l(to_object.point(r.origin()),
+          to_object.vector(r.direction()),
+          r.channels_);
+    l.wavelength_ = r.wavelength_;
+    return l;
+  }
 
-  auto p = rec.p;
-  auto normal = rec.normal;
+  // The side that was hit stays the same: the normal goes by the inverse
+  // transpose, which keeps its dot product with the direction.
+  void to_world_hit(hit_record& rec) const
+  {
+    rec.p = to_world.point(rec.p);
+    rec.normal = unit_vector(to_object.transposed_vector(rec.normal));
+  }
 
-  p[0] = cos_theta * rec.p[0] + sin_theta * rec.p[2];
-  p[2] = -sin_theta * rec.p[0] + cos_theta * rec.p[2];
+  bool has_box = false;
+  aabb box;
+};
 
-  normal[0] = cos_theta * rec.normal[0] + sin_theta * rec.normal[2];
-  normal[2] = -sin_theta * rec.normal[0] + cos_theta * rec.normal[2];
+// The object moved by t after the placement it has. Transforms of an
+// instance are combined into one rather than nested.
+inline shared_ptr<instance>
+transformed(shared_ptr<hittable> object, const affine& t)
+{
+  if (auto i = std::dynamic_pointer_cast<instance>(object))
+    return make_shared<instance>(i->object, t * i->to_world);
+  return make_shared<instance>(std::move(object), t);
+}
 
-  rec.p = p;
-  rec.set_face_normal(rotated_r, normal);
+inline shared_ptr<instance>
+translate(shared_ptr<hittable> object, const vec3& offset)
+{
+  return transformed(std::move(object), affine::translation(offset));
+}
 
-  return true;
-}
\ No newline at end of file
+inline shared_ptr<instance>
+rotate_y(shared_ptr<hittable> object, double degrees)
+{
+  return transformed(std::move(object), affine::rotation_y(degrees));
+}
@@ -25,6 +25,24 @@ public:
 
   bool bounding_box(aabb& output_box) const override;
 
+  // Samples the objects with equal probability, so the density is the
+  // average of theirs.
+  double pdf_value(const point3& origin, const vec3& direction) const override
+  {
+    if (objects.empty())
+      return 0.0;
+    double sum = 0.0;
+    for (const auto& object : objects)
+      sum += object->pdf_value(origin, direction);
+    return sum / objects.size();
+  }
+
+  vec3 random(const point3& origin) const override
+  {
+    auto const i = random_int(0, static_cast<int>(objects.size()) - 1);
+    return objects[i]->random(origin);
+  }
+
 public:
   std::vector<shared_ptr<hittable>> objects;
 };
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+// 8-bit image, rows from top to bottom. Pixels are 0xAARRGGBB words, the
+// layout of QImage::Format_RGB32, so the GUI can wrap them without
+// conversion.
+struct image
+{
+  image() {}
+  image(unsigned width, unsigned height)
+    : width_{ width }
+    , height_{ height }
+    , pixels_(static_cast<std::size_t>(width) * height, 0xff000000u)
+  {}
+
+  bool empty() const { return pixels_.empty(); }
+
+  std::uint32_t* scan_line(unsigned y)
+  {
+    return &pixels_[static_cast<std::size_t>(y) * width_];
+  }
+  const std::uint32_t* scan_line(unsigned y) const
+  {
+    return &pixels_[static_cast<std::size_t>(y) * width_];
+  }
+
+  unsigned width_ = 0;
+  unsigned height_ = 0;
+  std::vector<std::uint32_t> pixels_;
+};
+
+// Writes a binary PPM (P6). Returns false if the file could not be written.
+inline bool
+write_ppm(const image& img, const std::string& path)
+{
+  std::ofstream out(path, std::ios::binary);
+  out << "P6\n" << img.width_ << ' ' << img.height_ << "\n255\n";
+
+  std::vector<char> row(3 * static_cast<std::size_t>(img.width_));
+  for (unsigned y = 0; y < img.height_; ++y) {
+    const auto* src = img.scan_line(y);
+    for (unsigned x = 0; x < img.width_; ++x) {
+      row[3 * x] = static_cast<char>(src[x] >> 16);
+      row[3 * x + 1] = static_cast<char>(src[x] >> 8);
+      row[3 * x + 2] = static_cast<char>(src[x]);
+    }
+    out.write(row.data(), row.size());
+  }
+
+  return static_cast<bool>(out);
+}
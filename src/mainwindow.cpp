@@ -1,10 +1,14 @@
 #include "mainwindow.h"
 
+#include <QFileDialog>
+#include <QMessageBox>
 #include <boost/log/trivial.hpp>
+#include <numeric>
 
 #include "./ui_mainwindow.h"
 #include "manager_draw.h"
 #include "material.h"
+#include "scene_io.h"
 #include "sphere.h"
 #include "util.h"
 
@@ -14,6 +18,7 @@ main_window::main_window(QWidget* parent)
 {
   ui->setupUi(this);
 
+  qRegisterMetaType<render_progress>();
   connect(
     this, &main_window::notify_progress, this, &main_window::change_progress);
   connect(this, &main_window::img_rendered, this, &main_window::draw_img);
@@ -27,25 +32,33 @@ main_window::main_window(QWidget* parent)
   std::array<double, 3> c{ 6.00069867 * 1e-3,
                            2.00179144 * 1e-2,
                            1.03560653 * 1e2 };
-  auto tex_trans = make_shared<dielectric>(b, c);
-  auto tex_checker = make_shared<lambertian>(
-    make_shared<checker_texture>(color(0, 0, 0), color(1, 1, 1)));
-  auto tex_metall = make_shared<metal>(color(0.8, 0.6, 0.2), 0.0);
-  auto tex_met_r =
-    make_shared<lambertian>(make_shared<solid_color>(color(0.8, 0.6, 0.2)));
-  auto tex_met_l = make_shared<metal>(color(0.1, 0.2, 0.5), 0.1);
-
-  world_.add(make_shared<sphere>(point3{ 0, -101, 0 }, 100, tex_checker));
-  world_.add(make_shared<sphere>(point3{ 0, 1, 0 }, 1, tex_trans));
-  world_.add(make_shared<sphere>(point3{ 2, 0, 0 }, 1, tex_met_r));
-  world_.add(make_shared<sphere>(point3{ -2, 0, 0 }, 1, tex_met_l));
-
+  auto tex_trans = materials_->add(make_shared<dielectric>(b, c));
+  auto tex_checker = materials_->add(make_shared<lambertian>(
+    make_shared<checker_texture>(color(0, 0, 0), color(1, 1, 1))));
+  auto tex_met_r = materials_->add(
+    make_shared<lambertian>(make_shared<solid_color>(color(0.8, 0.6, 0.2))));
+  auto tex_met_l =
+    materials_->add(make_shared<metal>(color(0.1, 0.2, 0.5), 0.1));
+
+  world_->add(make_shared<sphere>(point3{ 0, -101, 0 }, 100, tex_checker));
+  world_->add(make_shared<sphere>(point3{ 0, 1, 0 }, 1, tex_trans));
+  world_->add(make_shared<sphere>(point3{ 2, 0, 0 }, 1, tex_met_r));
+  world_->add(make_shared<sphere>(point3{ -2, 0, 0 }, 1, tex_met_l));
+
+  build_accel();
   fillWorldList();
 }
 
 void
 main_window::on_pb_draw_clicked()
 {
+  // Stops the previous render, if any.
+  render_job_.reset();
+  unsigned const id = ++render_id_;
+
+  if (editable(accel_).optimize())
+    BOOST_LOG_TRIVIAL(info) << "BVH rebuilt: " << accel_->stats;
+
   pd_rend_ptr =
     std::make_unique<QProgressDialog>("Генерация", "Остановить", 0, 100);
   pd_rend_ptr->setMinimumDuration(0);
@@ -63,48 +76,125 @@ main_window::on_pb_draw_clicked()
     BOOST_LOG_TRIVIAL(warning) << "No quality radio button checked";
   }
 
-  // World
-  hittable_list world{ world_ };
-
-  color background{ qRed(ui->cp_background->color().rgb()) / 256.0,
-                    qGreen(ui->cp_background->color().rgb()) / 256.0,
-                    qBlue(ui->cp_background->color().rgb()) / 256.0 };
-
-  scene scene{ background,
-               point3{ ui->dsb_pf_x->value(),
-                       ui->dsb_pf_y->value(),
-                       ui->dsb_pf_z->value() },
-               point3{ ui->dsb_pt_x->value(),
-                       ui->dsb_pt_y->value(),
-                       ui->dsb_pt_z->value() },
-               world };
+  auto const scene = current_scene();
 
   settings_render rs{ static_cast<unsigned int>(ui->gv_canvas->width()),
                       static_cast<unsigned int>(ui->gv_canvas->height()),
                       ray_pp,
                       ui->dsb_cc_d->value() };
+  // Roughly one level of an 8-bit display.
+  if (ui->cb_adaptive->isChecked())
+    rs.noise_threshold_ = 0.004;
+  rs.denoise_ = ui->cb_denoise->isChecked();
 
   BOOST_LOG_TRIVIAL(info) << "Canvas: " << rs.width_ << 'x' << rs.height_
                           << "; ray_pp: " << rs.ray_pp_;
 
-  manager_draw{}.draw(
+  render_job_ = manager_draw{}.draw(
     rs,
     scene,
-    [this](double progress) { emit notify_progress(progress); },
-    // TODO: fix thread race ;(
-    [this]() -> bool {
-      return nullptr == pd_rend_ptr || pd_rend_ptr->wasCanceled();
+    [this, id](render_progress progress) {
+      emit notify_progress(progress, id);
     },
-    [this](QImage img) { emit img_rendered(img); });
+    [this, id](image img, bool final) {
+      emit img_rendered(to_qimage(img), final, id);
+    });
+
+  connect(pd_rend_ptr.get(), &QProgressDialog::canceled, this, [this]() {
+    if (render_job_)
+      render_job_->cancel();
+  });
+}
+
+std::shared_ptr<const scene>
+main_window::current_scene() const
+{
+  color background{ qRed(ui->cp_background->color().rgb()) / 256.0,
+                    qGreen(ui->cp_background->color().rgb()) / 256.0,
+                    qBlue(ui->cp_background->color().rgb()) / 256.0 };
+
+  return std::make_shared<const scene>(background,
+                                       point3{ ui->dsb_pf_x->value(),
+                                               ui->dsb_pf_y->value(),
+                                               ui->dsb_pf_z->value() },
+                                       point3{ ui->dsb_pt_x->value(),
+                                               ui->dsb_pt_y->value(),
+                                               ui->dsb_pt_z->value() },
+                                       world_,
+                                       materials_,
+                                       accel_);
+}
+
+void
+main_window::build_accel()
+{
+  accel_ = std::make_shared<dynamic_bvh>(*world_);
+  handles_.resize(world_->objects.size());
+  std::iota(handles_.begin(), handles_.end(), 0);
+  BOOST_LOG_TRIVIAL(info) << "BVH: " << accel_->stats;
+}
+
+void
+main_window::on_act_open_triggered()
+{
+  QString path = QFileDialog::getOpenFileName(
+    this, "Открыть сцену", QString(), "Сцены (*.scene *.bscene);;Все (*)");
+  if (path.isEmpty())
+    return;
+
+  try {
+    scene s = load_scene(path.toStdString());
+
+    world_ = std::make_shared<hittable_list>(*s.world_);
+    materials_ = std::make_shared<material_table>(*s.materials_);
+    build_accel();
+
+    ui->dsb_pf_x->setValue(s.lookfrom_.x());
+    ui->dsb_pf_y->setValue(s.lookfrom_.y());
+    ui->dsb_pf_z->setValue(s.lookfrom_.z());
+    ui->dsb_pt_x->setValue(s.lookto_.x());
+    ui->dsb_pt_y->setValue(s.lookto_.y());
+    ui->dsb_pt_z->setValue(s.lookto_.z());
+    ui->cp_background->setColor(
+      QColor::fromRgbF(clamp(s.background_.x(), 0.0, 1.0),
+                       clamp(s.background_.y(), 0.0, 1.0),
+                       clamp(s.background_.z(), 0.0, 1.0)));
+
+    fillWorldList();
+  } catch (const scene_error& e) {
+    BOOST_LOG_TRIVIAL(error) << e.what();
+    QMessageBox::critical(this, "Ошибка", e.what());
+  }
+}
+
+void
+main_window::on_act_save_triggered()
+{
+  QString filter;
+  QString path = QFileDialog::getSaveFileName(
+    this,
+    "Сохранить сцену",
+    QString(),
+    "Текстовая сцена (*.scene);;Двоичная сцена (*.bscene)",
+    &filter);
+  if (path.isEmpty())
+    return;
+
+  try {
+    if (path.endsWith(".bscene") || filter.contains("*.bscene"))
+      save_scene_binary(*current_scene(), path.toStdString());
+    else
+      save_scene_text(*current_scene(), path.toStdString());
+  } catch (const scene_error& e) {
+    BOOST_LOG_TRIVIAL(error) << e.what();
+    QMessageBox::critical(this, "Ошибка", e.what());
+  }
 }
 
 void
 main_window::on_pb_add_object_clicked()
 {
-  auto def_material =
-    make_shared<lambertian>(make_shared<solid_color>(color{ 1, 1, 1 }));
-  std::shared_ptr<hittable> obj =
-    std::make_shared<sphere>(point3{ 0, 0, 0 }, 5, def_material);
+  std::shared_ptr<hittable> obj;
 
   // Choosing figure
   point3 center{ ui->dsb_no_f_s_c_x->value(),
@@ -122,7 +212,8 @@ main_window::on_pb_add_object_clicked()
 
       color c = to_color(ui->cp_no_m_m_t_s->color());
 
-      auto material = make_shared<lambertian>(make_shared<solid_color>(c));
+      auto material = editable(materials_).add(
+        make_shared<lambertian>(make_shared<solid_color>(c)));
       obj = std::make_shared<sphere>(center, radius, material);
     } else if (ui->rb_no_m_m_t_checker->isChecked()) {
       BOOST_LOG_TRIVIAL(info) << "Checker checked";
@@ -130,8 +221,8 @@ main_window::on_pb_add_object_clicked()
       color c1 = to_color(ui->cp_no_m_m_t_c1->color());
       color c2 = to_color(ui->cp_no_m_m_t_c1->color());
 
-      auto material =
-        make_shared<lambertian>(make_shared<checker_texture>(c1, c2));
+      auto material = editable(materials_).add(
+        make_shared<lambertian>(make_shared<checker_texture>(c1, c2)));
       obj = std::make_shared<sphere>(center, radius, material);
     } else {
       BOOST_LOG_TRIVIAL(error) << "Texture not checked";
@@ -140,7 +231,7 @@ main_window::on_pb_add_object_clicked()
     BOOST_LOG_TRIVIAL(info) << "Metall checked";
 
     color c = to_color(ui->cp_no_m_me_t_s->color());
-    auto material = std::make_shared<metal>(c, 0.0);
+    auto material = editable(materials_).add(std::make_shared<metal>(c, 0.0));
     obj = std::make_shared<sphere>(center, radius, material);
   } else if (ui->rb_no_m_trans->isChecked()) {
     double b1 = ui->dsb_m_t_b1->value();
@@ -153,7 +244,8 @@ main_window::on_pb_add_object_clicked()
     std::array<double, 3> b{ b1, b2, b3 };
     std::array<double, 3> c{ c1, c2, c3 };
 
-    auto material = std::make_shared<dielectric>(b, c);
+    auto material =
+      editable(materials_).add(std::make_shared<dielectric>(b, c));
 
     obj = std::make_shared<sphere>(center, radius, material);
 
@@ -163,13 +255,21 @@ main_window::on_pb_add_object_clicked()
 
     color c = to_color(ui->cp_no_m_l_c->color());
 
-    auto material = std::make_shared<diffuse_light>(c);
+    auto material =
+      editable(materials_).add(std::make_shared<diffuse_light>(c));
     obj = std::make_shared<sphere>(center, radius, material);
   } else {
     BOOST_LOG_TRIVIAL(error) << "Material not checked";
   }
 
-  world_.add(obj);
+  if (!obj) {
+    auto def_material = editable(materials_).add(
+      make_shared<lambertian>(make_shared<solid_color>(color{ 1, 1, 1 })));
+    obj = std::make_shared<sphere>(point3{ 0, 0, 0 }, 5, def_material);
+  }
+
+  editable(world_).add(obj);
+  handles_.push_back(editable(accel_).insert(obj));
   fillWorldList();
 }
 
@@ -178,9 +278,11 @@ main_window::on_pb_delete_item_clicked()
 {
   int i = ui->sb_del_item_i->value();
 
-  if (i < world_.objects.size()) {
-    world_.objects.erase(world_.objects.begin() + i,
-                         world_.objects.begin() + i + 1);
+  if (i < world_->objects.size()) {
+    auto& objects = editable(world_).objects;
+    objects.erase(objects.begin() + i, objects.begin() + i + 1);
+    editable(accel_).remove(handles_[i]);
+    handles_.erase(handles_.begin() + i);
     fillWorldList();
   } else {
     BOOST_LOG_TRIVIAL(error) << "index " << i << " not in vector range";
@@ -188,19 +290,35 @@ main_window::on_pb_delete_item_clicked()
 }
 
 void
-main_window::draw_img(QImage image)
+main_window::draw_img(QImage image, bool final, unsigned render_id)
 {
-  scene_ptr->clear();
-  scene_ptr->addPixmap(QPixmap::fromImage(image));
-  pd_rend_ptr->close();
-  pd_rend_ptr.reset();
+  if (render_id != render_id_)
+    return;
+
+  if (!image.isNull()) {
+    scene_ptr->clear();
+    scene_ptr->addPixmap(QPixmap::fromImage(image));
+  }
+
+  if (final && pd_rend_ptr) {
+    pd_rend_ptr->close();
+    pd_rend_ptr.reset();
+  }
 }
 
 void
-main_window::change_progress(double progress)
+main_window::change_progress(render_progress progress, unsigned render_id)
 {
-  if (pd_rend_ptr)
-    pd_rend_ptr->setValue(progress);
+  if (render_id != render_id_ || !pd_rend_ptr)
+    return;
+
+  pd_rend_ptr->setValue(progress.percent);
+
+  QString text = QString("Генерация: %1 млн лучей/с")
+                   .arg(progress.rays_per_sec * 1e-6, 0, 'f', 1);
+  if (progress.eta >= 0)
+    text += QString(", осталось %1 с").arg(progress.eta, 0, 'f', 0);
+  pd_rend_ptr->setLabelText(text);
 }
 
 void
@@ -219,7 +337,7 @@ main_window::fillWorldList()
     ui->lw_objs->takeItem(0);
   }
 
-  for (auto const& obj : world_.objects) {
-    ui->lw_objs->addItem(QString::fromStdString(obj->about()));
+  for (auto const& obj : world_->objects) {
+    ui->lw_objs->addItem(QString::fromStdString(obj->about(*materials_)));
   }
 }
@@ -1,11 +1,18 @@
 #pragma once
 
+#include "dynamic_bvh.h"
 #include "hittable_list.h"
+#include "material.h"
+#include "render_job.h"
+#include "render_progress.h"
+#include "scene.h"
 #include <QGraphicsScene>
 #include <QMainWindow>
 #include <QProgressDialog>
 #include <memory> // unique_ptr, shared_ptr
 
+Q_DECLARE_METATYPE(render_progress)
+
 QT_BEGIN_NAMESPACE
 namespace Ui {
 class main_window;
@@ -23,24 +30,54 @@ private slots:
   void on_pb_draw_clicked();
   void on_pb_add_object_clicked();
   void on_pb_delete_item_clicked();
+  void on_act_open_triggered();
+  void on_act_save_triggered();
 
-  void draw_img(QImage image);
-  void change_progress(double progress);
+  void draw_img(QImage image, bool final, unsigned render_id);
+  void change_progress(render_progress progress, unsigned render_id);
 
 signals:
-  void notify_progress(double progress);
-  void img_rendered(QImage image);
+  void notify_progress(render_progress progress, unsigned render_id);
+  void img_rendered(QImage image, bool final, unsigned render_id);
 
 private:
   void resizeEvent(QResizeEvent* e) override;
 
   void fillWorldList();
 
+  // The scene as set up in the window, sharing its parts with the window.
+  std::shared_ptr<const scene> current_scene() const;
+
+  // Hierarchy over world_ from scratch, after world_ was replaced.
+  void build_accel();
+
+  // A part of the scene, ready to be changed. Renders still running keep
+  // the version they started with: the part is copied first if one of them
+  // holds it, and changed in place otherwise.
+  template<typename T>
+  static T& editable(std::shared_ptr<T>& part)
+  {
+    if (part.use_count() > 1)
+      part = std::make_shared<T>(*part);
+    return *part;
+  }
+
 private:
   std::shared_ptr<Ui::main_window> ui;
 
   std::unique_ptr<QGraphicsScene> scene_ptr;
   std::unique_ptr<QProgressDialog> pd_rend_ptr;
 
-  hittable_list world_;
+  std::shared_ptr<hittable_list> world_ = std::make_shared<hittable_list>();
+  std::shared_ptr<material_table> materials_ =
+    std::make_shared<material_table>();
+  // Kept across renders and edited along with world_; handles_[i] is the
+  // handle of world_->objects[i] in it.
+  std::shared_ptr<dynamic_bvh> accel_;
+  std::vector<dynamic_bvh::handle> handles_;
+
+  // Signals of earlier renders still queued are told apart by this number.
+  unsigned render_id_ = 0;
+  // Last so that the render stops before the rest of the window goes away.
+  std::unique_ptr<render_job> render_job_;
 };
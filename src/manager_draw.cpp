@@ -1,139 +1,613 @@
 #include "manager_draw.h"
 
-#include <atomic>
+#include <algorithm>
 #include <boost/log/trivial.hpp>
 #include <chrono>   // duration
+#include <omp.h>
 #include <iostream> // cout
-#include <thread>   // thread
+#include <numeric>  // iota
+#include <vector>
 
 #include "bvh.h"
 #include "camera.h"
 #include "color.h"
+#include "framebuffer.h"
 #include "hittable_list.h"
 #include "material.h"
 #include "ray.h"
+#include "ray_packet.h"
+#include "render_progress.h"
 #include "rtweekend.h"
+#include "spectrum.h"
 #include "sphere.h"
+#include "sphere_soup.h"
 #include "vec3.h"
 
 using namespace std::literals::chrono_literals;
 
+namespace {
+
+// Rays cast by this thread; render workers pass it on to the progress
+// reporter once per tile.
+thread_local std::uint64_t rays_cast = 0;
+
+// Weight of a sample of the strategy with density `pdf` combined with one of
+// density `other` (Veach's power heuristic, beta = 2).
+double
+power_heuristic(double pdf, double other)
+{
+  return pdf * pdf / (pdf * pdf + other * other);
+}
+
+// Next-event estimation: light sent on along r_in from a direction sampled
+// towards the lights, at a vertex that scatters into a spread of
+// directions. It is weighted against finding the light by scattering.
+color
+direct_light(const ray& r_in,
+             const hit_record& rec,
+             const material& mat,
+             const hittable& world,
+             const material_table& materials,
+             const hittable_list& lights)
+{
+  ray const towards(rec.p, lights.random(rec.p), r_in.channels_);
+  auto const direction = unit_vector(towards.direction());
+  auto const light_pdf = lights.pdf_value(rec.p, towards.direction());
+  auto const scatter_pdf = mat.scattering_pdf(r_in, rec, direction);
+  if (light_pdf <= 0 || scatter_pdf <= 0)
+    return color(0, 0, 0);
+
+  hit_record light_rec;
+  ++rays_cast;
+  if (!world.hit(towards, 0.001, infinity, light_rec))
+    return color(0, 0, 0);
+  const material& light = materials[light_rec.mat_id];
+  if (!light.emissive())
+    return color(0, 0, 0);
+
+  return power_heuristic(light_pdf, scatter_pdf) / light_pdf *
+         mat.eval(r_in, rec, direction) *
+         light.emitted(light_rec.u, light_rec.v, light_rec.p);
+}
+
+} // namespace
+
 color
 ray_color(const ray& r,
           const color& background,
           const hittable& world,
-          int depth)
+          const material_table& materials,
+          const hittable_list& lights,
+          int max_depth,
+          int rr_depth,
+          guide_sample* guide)
 {
   hit_record rec;
+  bool hit = false;
+  if (max_depth > 0) {
+    hit = world.hit(r, 0.001, infinity, rec);
+    ++rays_cast;
+  }
+  return ray_color(r,
+                   hit,
+                   rec,
+                   background,
+                   world,
+                   materials,
+                   lights,
+                   max_depth,
+                   rr_depth,
+                   guide);
+}
 
-  // If we've exceeded the ray bounce limit, no more light is gathered.
-  if (depth <= 0)
-    return color(0, 0, 0);
+color
+ray_color(const ray& r,
+          bool hit,
+          const hit_record& first_rec,
+          const color& background,
+          const hittable& world,
+          const material_table& materials,
+          const hittable_list& lights,
+          int max_depth,
+          int rr_depth,
+          guide_sample* guide)
+{
+  // A path pending after its bundle was split: the scattered single-channel
+  // ray, the throughput up to it, the number of bounces behind it and the
+  // density with which the last one chose the ray's direction, zero after
+  // mirrors and glass. While it has only passed mirrors and glass, it also
+  // carries their tint and its length for the guide.
+  struct path_state
+  {
+    ray r;
+    color throughput;
+    int depth;
+    double pdf;
+    bool guiding;
+    color tint;
+    double distance;
+  };
+
+  path_state pending[3];
+  int n_pending = 0;
+
+  color radiance(0, 0, 0);
+  path_state path{
+    r, color(1, 1, 1), 0, 0.0, guide != nullptr, color(1, 1, 1), 0.0
+  };
+  hit_record rec = first_rec;
+
+  // The guide follows the path through mirrors and glass up to the first
+  // other surface. Split channels see different surfaces, so each one sets
+  // its own albedo channel.
+  if (guide)
+    *guide = guide_sample{};
+  auto record_albedo = [&](const color& albedo) {
+    for (int c = 0; c < 3; ++c)
+      if (path.r.channels_ & to_mask(static_cast<RGB>(c)))
+        guide->albedo.e[c] = albedo.e[c];
+  };
+
+  while (true) {
+    bool alive = path.depth < max_depth;
+
+    // The intersection of the camera ray is known on entry.
+    if (alive && path.depth > 0) {
+      hit = world.hit(path.r, 0.001, infinity, rec);
+      ++rays_cast;
+    }
+
+    if (alive && !hit) {
+      // The ray escaped: it gathers the background colour.
+      radiance += path.throughput * background;
+      alive = false;
+      // Normal and depth stay those of the last surface, if any.
+      if (path.guiding) {
+        record_albedo(path.tint);
+        path.guiding = false;
+      }
+    }
+
+    if (alive) {
+      const material& mat = materials[rec.mat_id];
+      if (path.guiding) {
+        path.distance += rec.t * path.r.direction().length();
+        record_albedo(path.tint * mat.albedo_at(rec));
+        guide->normal = rec.normal;
+        guide->depth = path.distance;
+        if (mat.specular())
+          path.tint = path.tint * mat.albedo_at(rec);
+        else
+          path.guiding = false;
+      }
+      if (mat.emissive()) {
+        // Lights found by a diffuse bounce may have been sampled directly
+        // at the vertex before as well; each estimate counts by its weight.
+        double weight = 1.0;
+        if (path.pdf > 0)
+          weight = power_heuristic(
+            path.pdf, lights.pdf_value(path.r.origin(), path.r.direction()));
+        radiance +=
+          weight * path.throughput * mat.emitted(rec.u, rec.v, rec.p);
+      }
+
+      if (!path.r.single_channel() && mat.dispersive()) {
+        // The index of refraction depends on the wavelength, so the bundle is
+        // split here and every channel continues along its own path.
+        for (int c = 0; c < 3; ++c) {
+          if (0 == (path.r.channels_ & to_mask(static_cast<RGB>(c))))
+            continue;
+
+          ray single = path.r;
+          single.set_RGB(static_cast<RGB>(c));
+          single.wavelength_ =
+            sample_wavelength(static_cast<RGB>(c), random_double());
+
+          scatter_record srec;
+          if (!mat.scatter(single, rec, srec))
+            continue;
 
-  // If the ray hits nothing, return the background color.
-  if (!world.hit(r, 0.001, infinity, rec))
-    return background;
+          srec.scattered.channels_ = single.channels_;
+          srec.scattered.wavelength_ = single.wavelength_;
+          color throughput(0, 0, 0);
+          throughput.e[c] = path.throughput.e[c] * srec.attenuation.e[c];
+          pending[n_pending++] = { srec.scattered, throughput,
+                                   path.depth + 1, srec.pdf,
+                                   path.guiding,   path.tint,
+                                   path.distance };
+        }
+        alive = false;
+      } else {
+        // Sampled lights count as one bounce more, if that is allowed. They
+        // are sampled whether or not scattering finds a direction below.
+        if (mat.continuous() && !lights.objects.empty() &&
+            path.depth + 1 < max_depth)
+          radiance +=
+            path.throughput *
+            direct_light(path.r, rec, mat, world, materials, lights);
 
-  ray scattered;
-  color attenuation;
-  color emitted = rec.mat_ptr->emitted(rec.u, rec.v, rec.p);
+        scatter_record srec;
+        if (mat.scatter(path.r, rec, srec)) {
+          srec.scattered.channels_ = path.r.channels_;
+          srec.scattered.wavelength_ = path.r.wavelength_;
+          path.r = srec.scattered;
+          path.pdf = srec.pdf;
+          path.throughput = path.throughput * srec.attenuation;
+          ++path.depth;
+        } else {
+          alive = false;
+        }
+      }
+    }
 
-  if (!rec.mat_ptr->scatter(r, rec, attenuation, scattered))
-    return emitted;
+    // Russian roulette: past the minimum depth a path survives with a
+    // probability following its throughput, and the survivors are weighted
+    // up so the estimate stays unbiased.
+    if (alive && path.depth >= rr_depth) {
+      const auto& beta = path.throughput;
+      auto const p = fmin(0.95, fmax(beta.x(), fmax(beta.y(), beta.z())));
+      if (random_double() >= p)
+        alive = false;
+      else
+        path.throughput /= p;
+    }
 
-  scattered.rgb_ = r.rgb_;
+    if (!alive) {
+      if (0 == n_pending)
+        break;
+      path = pending[--n_pending];
+    }
+  }
 
-  return emitted +
-         attenuation * ray_color(scattered, background, world, depth - 1);
+  return radiance;
 }
 
+namespace {
+
+// Everything a render worker needs to trace samples.
+struct render_context
+{
+  const settings_render& rs;
+  const camera& cam;
+  const hittable& world;
+  const material_table& materials;
+  const hittable_list& lights;
+  color background;
+};
+
+constexpr int tile_size = 32;
+
+void
+accumulate(guide_sample& sum, const guide_sample& g)
+{
+  sum.albedo += g.albedo;
+  sum.normal += g.normal;
+  sum.depth += g.depth;
+}
+
+// Smallest number of samples per pixel on which adaptive sampling trusts a
+// variance estimate, and how far beyond the average budget a noisy pixel may
+// go.
+constexpr unsigned adaptive_min_spp = 16;
+constexpr unsigned adaptive_max_factor = 4;
+
+// Adds samples [s_begin, s_end) of the pixels in `lanes`, a mask over the
+// packet-wide run starting at column j0 of row i, to sums and their squares
+// to squares, and if guides is given, the sums of their guide samples to it.
+// The camera rays of every sample are traced as one packet.
 void
+trace_run(const render_context& ctx,
+          int i,
+          int j0,
+          int lanes,
+          int s_begin,
+          int s_end,
+          color* sums,
+          color* squares,
+          guide_sample* guides)
+{
+  constexpr int run = ray_packet::size;
+  const auto& rs = ctx.rs;
+  int const img_w = rs.width_;
+  int const img_h = rs.height_;
+
+  for (int s = s_begin; s < s_end; ++s) {
+    // Each pixel keeps its own random stream; it is saved after the camera
+    // ray and resumed for the rest of the path.
+    ray rays[run];
+    pcg32 streams[run];
+    guide_sample guide;
+    for (int k = 0; k < run; ++k) {
+      if (0 == (lanes & (1 << k)))
+        continue;
+      seed_sample(i * img_w + j0 + k, s);
+      auto u = (j0 + k + random_double()) / (img_w - 1);
+      auto v = (i + random_double()) / (img_h - 1);
+      rays[k] = ctx.cam.get_ray(u, v);
+      streams[k] = thread_rng;
+    }
+
+    if (rs.packets_ && rs.max_depth_ > 0) {
+      ray_packet rp(rays);
+      double t_max[run];
+      hit_record recs[run];
+      std::fill(t_max, t_max + run, infinity);
+      int hits = ctx.world.hit_packet(rp, lanes, 0.001, t_max, recs);
+
+      for (int k = 0; k < run; ++k) {
+        if (0 == (lanes & (1 << k)))
+          continue;
+        ++rays_cast;
+        thread_rng = streams[k];
+        color const c = ray_color(rays[k],
+                                  0 != (hits & (1 << k)),
+                                  recs[k],
+                                  ctx.background,
+                                  ctx.world,
+                                  ctx.materials,
+                                  ctx.lights,
+                                  rs.max_depth_,
+                                  rs.rr_depth_,
+                                  guides ? &guide : nullptr);
+        sums[k] += c;
+        squares[k] += c * c;
+        if (guides)
+          accumulate(guides[k], guide);
+      }
+    } else {
+      for (int k = 0; k < run; ++k) {
+        if (0 == (lanes & (1 << k)))
+          continue;
+        thread_rng = streams[k];
+        color const c = ray_color(rays[k],
+                                  ctx.background,
+                                  ctx.world,
+                                  ctx.materials,
+                                  ctx.lights,
+                                  rs.max_depth_,
+                                  rs.rr_depth_,
+                                  guides ? &guide : nullptr);
+        sums[k] += c;
+        squares[k] += c * c;
+        if (guides)
+          accumulate(guides[k], guide);
+      }
+    }
+  }
+}
+
+} // namespace
+
+std::unique_ptr<render_job>
 manager_draw::draw(settings_render const rs,
-                   scene scene,
-                   std::function<void(double progress)> notify_progress,
-                   std::function<bool()> is_cancelled,
-                   std::function<void(QImage)> send_pic)
+                   std::shared_ptr<const scene> scene,
+                   std::function<void(render_progress)> notify_progress,
+                   std::function<void(image, bool)> send_pic)
 {
-  auto th = std::thread(
-    [notify_progress, is_cancelled, send_pic](settings_render rs,
-                                              struct scene const& scene) {
+  return std::make_unique<render_job>(
+    [rs, scene, notify_progress, send_pic](const render_job& job) {
       unsigned img_w = rs.width_;
       unsigned img_h = rs.height_;
 
-      QImage image(img_w, img_h, QImage::Format::Format_ARGB32_Premultiplied);
-      image.fill(QColor(255, 255, 255));
-
       // Image
       const auto aspect_ratio = static_cast<double>(img_w) / img_h;
-      const int max_depth = 50;
 
-      hittable_list objects;
-      objects.add(make_shared<bvh_node>(scene.world_));
+      shared_ptr<const hittable> world = scene->accel_;
+      if (!world) {
+        auto built = make_shared<bvh>(pack_spheres(*scene->world_));
+        BOOST_LOG_TRIVIAL(info) << "BVH: " << built->stats;
+        world = std::move(built);
+      }
 
       // Camera
-      camera cam(scene.lookfrom_,
-                 scene.lookto_,
+      camera cam(scene->lookfrom_,
+                 scene->lookto_,
                  vec3(0, 1, 0),
                  45,
                  aspect_ratio,
                  rs.camera_canvas_);
 
-      color background = scene.background_;
+      hittable_list const lights = scene->lights();
+      BOOST_LOG_TRIVIAL(info) << "Lights: " << lights.objects.size();
 
-      unsigned u_progress = 0;
-#pragma omp parallel for schedule(dynamic)
-      for (int p = 0; p < img_w * img_h; ++p) {
-        if (is_cancelled())
-          continue;
+      render_context ctx{
+        rs, cam, *world, *scene->materials_, lights, scene->background_
+      };
+
+      framebuffer fb(img_w, img_h);
+      guide_buffer guides;
+      if (rs.denoise_)
+        guides = guide_buffer(img_w, img_h);
+
+      const int tiles_x = (img_w + tile_size - 1) / tile_size;
+      const int tiles_y = (img_h + tile_size - 1) / tile_size;
+      int const threads = rs.threads_ ? rs.threads_ : omp_get_max_threads();
+      double const budget = static_cast<double>(img_w) * img_h * rs.ray_pp_;
+      progress_reporter progress(budget);
+
+      // With adaptive sampling pixels go on at their own pace: converged
+      // ones drop out, and what they leave of the budget goes to the rest.
+      // Tiles keep a common sample count for the pixels still sampled, so
+      // a pixel always holds samples 0, 1, ... of its own sequence.
+      bool const adaptive = rs.noise_threshold_ > 0;
+      unsigned const max_spp =
+        adaptive ? adaptive_max_factor * rs.ray_pp_ : rs.ray_pp_;
+      std::vector<unsigned> tile_spp(tiles_x * tiles_y, 0);
+      std::vector<unsigned> tile_end(tiles_x * tiles_y, 0);
+      std::vector<std::uint64_t> tile_live(tiles_x * tiles_y);
+      std::vector<char> converged(static_cast<std::size_t>(img_w) * img_h, 0);
+      std::vector<int> active(tiles_x * tiles_y);
+      std::iota(active.begin(), active.end(), 0);
+      for (int t : active)
+        tile_live[t] =
+          static_cast<std::uint64_t>(
+            std::min<int>(tile_size, img_h - (t / tiles_x) * tile_size)) *
+          std::min<int>(tile_size, img_w - (t % tiles_x) * tile_size);
+      std::uint64_t samples_done = 0;
+      denoiser filter(threads);
+      std::chrono::duration<double, std::milli> denoise_time{};
+
+      // Progressive passes: after each one the live pixels of every active
+      // tile hold twice as many samples as before, and the image is
+      // published as a preview.
+      image preview;
+      while (!active.empty() && !job.cancelled()) {
+        std::uint64_t pass_samples = 0;
+
+        // The last pass is cut short to what is left of the budget.
+        double const left = budget - samples_done;
+        double pass_cost = 0.0;
+        double live = 0.0;
+        for (int t : active) {
+          tile_end[t] = std::min(max_spp, tile_spp[t] ? 2 * tile_spp[t] : 1);
+          pass_cost +=
+            static_cast<double>(tile_live[t]) * (tile_end[t] - tile_spp[t]);
+          live += tile_live[t];
+        }
+        if (pass_cost > left) {
+          auto const step = std::max(1u, static_cast<unsigned>(left / live));
+          for (int t : active)
+            tile_end[t] = std::min(tile_end[t], tile_spp[t] + step);
+        }
+
+#pragma omp parallel for schedule(dynamic) num_threads(threads)             \
+  reduction(+ : pass_samples)
+        for (int a = 0; a < static_cast<int>(active.size()); ++a) {
+          if (!job.checkpoint())
+            continue;
+
+          int const t = active[a];
+          unsigned const spp = tile_spp[t];
+          unsigned const pass_end = tile_end[t];
+          unsigned const pass_spp = pass_end - spp;
+          int const i0 = (t / tiles_x) * tile_size;
+          int const j0 = (t % tiles_x) * tile_size;
+          int const i1 = std::min<int>(i0 + tile_size, img_h);
+          int const j1 = std::min<int>(j0 + tile_size, img_w);
+
+          auto const rays_before = rays_cast;
+          std::uint64_t const live_before = tile_live[t];
+          for (int i = i0; i < i1; ++i) {
+            for (int j = j0; j < j1; j += ray_packet::size) {
+              int const n = std::min<int>(ray_packet::size, j1 - j);
+              const char* done =
+                &converged[static_cast<std::size_t>(i) * img_w + j];
+              int lanes = 0;
+              for (int k = 0; k < n; ++k)
+                lanes |= done[k] ? 0 : 1 << k;
+              if (!lanes)
+                continue;
+
+              color sums[ray_packet::size];
+              color squares[ray_packet::size];
+              guide_sample guide_sums[ray_packet::size];
+              trace_run(ctx,
+                        i,
+                        j,
+                        lanes,
+                        spp,
+                        pass_end,
+                        sums,
+                        squares,
+                        rs.denoise_ ? guide_sums : nullptr);
+              for (int k = 0; k < n; ++k) {
+                if (0 == (lanes & (1 << k)))
+                  continue;
+                fb.add(j + k, i, sums[k], squares[k], pass_spp);
+                if (rs.denoise_)
+                  guides.add(j + k, i, guide_sums[k]);
+              }
+            }
+          }
+
+          pass_samples += live_before * pass_spp;
+          progress.add(live_before * pass_spp, rays_cast - rays_before);
+          progress.report(notify_progress);
+        }
+
+        // A cancelled pass is incomplete; the image of the last finished one
+        // becomes the result.
+        if (job.cancelled())
+          break;
+
+        // A pixel converges once its 3x3 neighbourhood is quiet: a pixel
+        // alone may have seen the same value in every sample by chance.
+        // Neighbours are read across tiles, so this waits for the whole pass.
+        if (adaptive) {
+#pragma omp parallel for schedule(dynamic) num_threads(threads)
+          for (int a = 0; a < static_cast<int>(active.size()); ++a) {
+            int const t = active[a];
+            if (tile_end[t] < adaptive_min_spp)
+              continue;
+
+            int const i0 = (t / tiles_x) * tile_size;
+            int const j0 = (t % tiles_x) * tile_size;
+            int const i1 = std::min<int>(i0 + tile_size, img_h);
+            int const j1 = std::min<int>(j0 + tile_size, img_w);
+            for (int i = i0; i < i1; ++i) {
+              for (int j = j0; j < j1; ++j) {
+                char& done = converged[static_cast<std::size_t>(i) * img_w + j];
+                if (done)
+                  continue;
+
+                double noise = 0.0;
+                for (int y = std::max(i - 1, 0);
+                     y <= std::min<int>(i + 1, img_h - 1);
+                     ++y)
+                  for (int x = std::max(j - 1, 0);
+                       x <= std::min<int>(j + 1, img_w - 1);
+                       ++x)
+                    noise = std::max(noise, fb.noise(x, y));
+                if (noise < rs.noise_threshold_) {
+                  done = 1;
+                  --tile_live[t];
+                }
+              }
+            }
+          }
+        }
 
-        int i = p / img_w;
-        int j = p % img_w;
-
-        color pixel_color(0, 0, 0);
-        for (int s = 0; s < rs.ray_pp_; ++s) {
-          auto u = (j + random_double()) / (img_w - 1);
-          auto v = (i + random_double()) / (img_h - 1);
-          ray r = cam.get_ray(u, v);
-          r.set_RGB(RGB::R);
-          pixel_color.e[0] +=
-            ray_color(r, background, scene.world_, max_depth).e[0];
-          r.set_RGB(RGB::G);
-          pixel_color.e[1] +=
-            ray_color(r, background, scene.world_, max_depth).e[1];
-          r.set_RGB(RGB::B);
-          pixel_color.e[2] +=
-            ray_color(r, background, scene.world_, max_depth).e[2];
+        // A tile is done when its pixels have reached the most samples they
+        // may take or have all converged.
+        samples_done += pass_samples;
+        double remaining = 0.0;
+        std::vector<int> next;
+        for (int t : active) {
+          tile_spp[t] = tile_end[t];
+          if (tile_spp[t] < max_spp && tile_live[t]) {
+            next.push_back(t);
+            remaining +=
+              static_cast<double>(tile_live[t]) * (max_spp - tile_spp[t]);
+          }
         }
+        if (samples_done >= budget)
+          next.clear();
+        active.swap(next);
 
-        auto r = pixel_color.x();
-        auto g = pixel_color.y();
-        auto b = pixel_color.z();
-
-        // Divide the color by the number of samples and gamma-correct for
-        // gamma=2.0.
-        auto scale = 1.0 / rs.ray_pp_;
-        r = sqrt(scale * r);
-        g = sqrt(scale * g);
-        b = sqrt(scale * b);
-
-        image.setPixelColor(j,
-                            i,
-                            { static_cast<int>(256 * clamp(r, 0.0, 0.999)),
-                              static_cast<int>(256 * clamp(g, 0.0, 0.999)),
-                              static_cast<int>(256 * clamp(b, 0.0, 0.999)) });
-
-#pragma omp critical
-        {
-          double progress = (100.0 * ++u_progress) / (img_h * img_w);
-          notify_progress(progress);
+        double const unspent = std::max(budget - samples_done, 0.0);
+        progress.set_total(samples_done + std::min(remaining, unspent));
+        progress.report(notify_progress, true);
+        if (rs.denoise_) {
+          auto start = std::chrono::steady_clock::now();
+          preview = filter.denoise(fb, guides);
+          denoise_time = std::chrono::steady_clock::now() - start;
+        } else {
+          preview = fb.resolve();
         }
+        if (!active.empty())
+          send_pic(preview, false);
       }
 
-      image = image.mirrored(false, true);
-      send_pic(image);
-    },
-    rs,
-    scene);
+      if (adaptive)
+        BOOST_LOG_TRIVIAL(info)
+          << "Adaptive sampling: "
+          << static_cast<double>(samples_done) / (img_w * img_h)
+          << " samples per pixel on average";
+      if (rs.denoise_)
+        BOOST_LOG_TRIVIAL(info)
+          << "Denoised in " << denoise_time.count() << " ms";
 
-  th.detach();
+      send_pic(preview, true);
+      return preview;
+    });
 }
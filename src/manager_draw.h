@@ -1,25 +1,58 @@
 #pragma once
 
-#include <QImage>
 #include <functional> // function
+#include <memory>     // unique_ptr
 
+#include "denoiser.h"
+#include "image.h"
+#include "render_job.h"
+#include "render_progress.h"
 #include "scene.h"
 #include "settings_render.h"
 
 class manager_draw
 {
 public:
-  void draw(settings_render const rs,
-            scene scene,
-            std::function<void(double progress)> notify_progress,
-            std::function<bool()> is_cancelled,
-            std::function<void(QImage)> send_pic);
+  // Starts a render in the background and returns its handle. The render
+  // keeps the scene alive and reads it while it runs; nothing is copied.
+  // notify_progress is called from the workers at most every 50 ms and after
+  // every pass. send_pic receives a preview after every progressive pass and
+  // the result with final set; the result is an empty image if the render
+  // was cancelled before the first pass.
+  std::unique_ptr<render_job> draw(
+    settings_render const rs,
+    std::shared_ptr<const scene> scene,
+    std::function<void(render_progress)> notify_progress,
+    std::function<void(image, bool final)> send_pic);
 
 private:
 };
 
+// Radiance arriving along r. Paths end after max_depth bounces at the
+// latest; from rr_depth on they are terminated by Russian roulette. At
+// matte and rough surfaces the lights are also sampled directly, combined
+// with the bounces by multiple importance sampling. If guide is given, it
+// receives what the denoiser needs of the sample.
 color
 ray_color(const ray& r,
           const color& background,
           const hittable& world,
-          int depth);
\ No newline at end of file
+          const material_table& materials,
+          const hittable_list& lights,
+          int max_depth,
+          int rr_depth,
+          guide_sample* guide = nullptr);
+
+// Same for a camera ray whose first intersection has already been searched
+// for: `hit` tells whether there is one and `rec` describes it.
+color
+ray_color(const ray& r,
+          bool hit,
+          const hit_record& rec,
+          const color& background,
+          const hittable& world,
+          const material_table& materials,
+          const hittable_list& lights,
+          int max_depth,
+          int rr_depth,
+          guide_sample* guide = nullptr);
\ No newline at end of file
@@ -1,11 +1,29 @@
 #pragma once
 
+#include <algorithm>
+#include <array>
 #include <memory>
+#include <string>
+#include <vector>
 
+#include "hittable.h"
+#include "microfacet.h"
+#include "onb.h"
 #include "rtweekend.h"
+#include "spectrum.h"
 #include "texture.h"
 
-struct hit_record;
+// A direction sampled by material::scatter(): the ray going on, the weight
+// of the sample, i.e. the BSDF times the cosine over the density, and the
+// density per unit solid angle with which the direction was chosen. The
+// density is zero for mirrors and glass, which scatter into single
+// directions that sampling lights can not find.
+struct scatter_record
+{
+  ray scattered;
+  color attenuation;
+  double pdf = 0.0;
+};
 
 class material
 {
@@ -17,8 +35,48 @@ public:
 
   virtual bool scatter(const ray& r_in,
                        const hit_record& rec,
-                       color& attenuation,
-                       ray& scattered) const = 0;
+                       scatter_record& srec) const = 0;
+
+  // The BSDF times the cosine for light arriving from the unit `direction`
+  // and leaving against r_in. Zero for surfaces whose scatter() densities
+  // are zero.
+  virtual color eval(const ray& r_in,
+                     const hit_record& rec,
+                     const vec3& direction) const
+  {
+    return color(0, 0, 0);
+  }
+
+  // Density with which scatter() picks the unit `direction`.
+  virtual double scattering_pdf(const ray& r_in,
+                                const hit_record& rec,
+                                const vec3& direction) const
+  {
+    return 0.0;
+  }
+
+  // Whether scatter() draws from a density, so that lights may be sampled
+  // instead. Mirrors and glass scatter into single directions.
+  virtual bool continuous() const { return false; }
+
+  // Whether emitted() may be non-zero, i.e. objects of this material are
+  // lights.
+  virtual bool emissive() const { return false; }
+
+  // Whether scattering depends on the wavelength, i.e. a ray bundle carrying
+  // several colour channels has to be split at this surface.
+  virtual bool dispersive() const { return false; }
+
+  // Colour of the surface itself, apart from its lighting. The denoiser uses
+  // it to keep texture detail out of the filter.
+  virtual color albedo_at(const hit_record& rec) const
+  {
+    return color(0, 0, 0);
+  }
+
+  // Whether the surface shows a sharp image of something else, so that the
+  // denoiser should be guided by what is seen through it.
+  virtual bool specular() const { return false; }
 
   virtual std::string about() const { return "нет информации по материалу"; }
 };
@@ -34,33 +92,53 @@ public:
     : albedo(a)
   {}
 
-  virtual bool scatter(const ray& r_in,
-                       const hit_record& rec,
-                       color& attenuation,
-                       ray& scattered) const override
+  // Cosine-weighted directions: the weight is the albedo itself.
+  bool scatter(const ray& r_in,
+               const hit_record& rec,
+               scatter_record& srec) const override
+  {
+    onb uvw(rec.normal);
+    vec3 direction = uvw.local(random_cosine_direction());
+    srec.scattered = ray(rec.p, direction);
+    srec.attenuation = albedo->value(rec.u, rec.v, rec.p);
+    srec.pdf = fmax(0.0, dot(rec.normal, direction)) / pi;
+    return true;
+  }
+
+  color eval(const ray& r_in,
+             const hit_record& rec,
+             const vec3& direction) const override
   {
-    auto scatter_direction = rec.normal + random_unit_vector();
+    return scattering_pdf(r_in, rec, direction) *
+           albedo->value(rec.u, rec.v, rec.p);
+  }
+
+  double scattering_pdf(const ray& r_in,
+                        const hit_record& rec,
+                        const vec3& direction) const override
+  {
+    return fmax(0.0, dot(rec.normal, direction)) / pi;
+  }
 
-    // Catch degenerate scatter direction
-    if (scatter_direction.near_zero())
-      scatter_direction = rec.normal;
+  bool continuous() const override { return true; }
 
-    scattered = ray(rec.p, scatter_direction);
-    attenuation = albedo->value(rec.u, rec.v, rec.p);
-    return true;
+  color albedo_at(const hit_record& rec) const override
+  {
+    return albedo->value(rec.u, rec.v, rec.p);
   }
 
   std::string about() const override
   {
-    return QString("матовый (текстура: %1)")
-      .arg(QString::fromStdString(albedo->about()))
-      .toStdString();
+    return "матовый (текстура: " + albedo->about() + ")";
   }
 
 public:
   shared_ptr<texture> albedo;
 };
 
+// Conductor with a GGX microfacet surface of roughness fuzz, and Schlick's
+// Fresnel term with the albedo at normal incidence. Directions are drawn
+// from the visible microfacet normals; fuzz 0 makes a perfect mirror.
 class metal : public material
 {
 public:
@@ -69,61 +147,122 @@ public:
     , fuzz(f < 1 ? f : 1)
   {}
 
-  virtual bool scatter(const ray& r_in,
-                       const hit_record& rec,
-                       color& attenuation,
-                       ray& scattered) const override
+  bool scatter(const ray& r_in,
+               const hit_record& rec,
+               scatter_record& srec) const override
+  {
+    vec3 const unit_in = unit_vector(r_in.direction());
+    if (mirror()) {
+      vec3 reflected = reflect(unit_in, rec.normal);
+      srec.scattered = ray(rec.p, reflected);
+      srec.attenuation = fresnel_schlick(albedo, dot(reflected, rec.normal));
+      srec.pdf = 0.0;
+      return true;
+    }
+
+    onb uvw(rec.normal);
+    vec3 const wo = uvw.coordinates(-unit_in);
+    if (wo.z() <= 0)
+      return false;
+    vec3 const h =
+      ggx_sample_visible(wo, fuzz, random_double(), random_double());
+    vec3 const wi = 2 * dot(wo, h) * h - wo;
+    if (wi.z() <= 0)
+      return false;
+
+    // BSDF times cosine is F D G2 / (4 wo.z), the density G1 D / (4 wo.z).
+    auto const lambda_o = ggx_lambda(wo, fuzz);
+    auto const lambda_i = ggx_lambda(wi, fuzz);
+    srec.scattered = ray(rec.p, uvw.local(wi));
+    srec.attenuation = fresnel_schlick(albedo, dot(wo, h)) *
+                       ((1 + lambda_o) / (1 + lambda_o + lambda_i));
+    srec.pdf = ggx_d(h, fuzz) / (4 * wo.z() * (1 + lambda_o));
+    return true;
+  }
+
+  color eval(const ray& r_in,
+             const hit_record& rec,
+             const vec3& direction) const override
+  {
+    vec3 wo, wi, h;
+    if (!local_frame(r_in, rec, direction, wo, wi, h))
+      return color(0, 0, 0);
+    auto const g2 =
+      1 / (1 + ggx_lambda(wo, fuzz) + ggx_lambda(wi, fuzz));
+    return fresnel_schlick(albedo, dot(wo, h)) *
+           (ggx_d(h, fuzz) * g2 / (4 * wo.z()));
+  }
+
+  double scattering_pdf(const ray& r_in,
+                        const hit_record& rec,
+                        const vec3& direction) const override
   {
-    vec3 reflected = reflect(unit_vector(r_in.direction()), rec.normal);
-    scattered = ray(rec.p, reflected + fuzz * random_in_unit_sphere());
-    attenuation = albedo;
-    return (dot(scattered.direction(), rec.normal) > 0);
+    vec3 wo, wi, h;
+    if (!local_frame(r_in, rec, direction, wo, wi, h))
+      return 0.0;
+    return ggx_d(h, fuzz) / (4 * wo.z() * (1 + ggx_lambda(wo, fuzz)));
   }
 
+  bool continuous() const override { return !mirror(); }
+
+  color albedo_at(const hit_record& rec) const override { return albedo; }
+
+  // Blurrier reflections are left to the filter.
+  bool specular() const override { return fuzz <= 0.1; }
+
   std::string about() const override { return "металл"; }
 
 public:
   color albedo;
   double fuzz;
+
+private:
+  // Below this roughness the microfacet terms lose precision, while the
+  // reflection is as sharp as a mirror's.
+  bool mirror() const { return fuzz < 1e-3; }
+
+  // Outgoing and incoming directions and their half vector in the frame of
+  // the surface; false if either is below it.
+  bool local_frame(const ray& r_in,
+                   const hit_record& rec,
+                   const vec3& direction,
+                   vec3& wo,
+                   vec3& wi,
+                   vec3& h) const
+  {
+    if (mirror())
+      return false;
+    onb uvw(rec.normal);
+    wo = uvw.coordinates(-unit_vector(r_in.direction()));
+    wi = uvw.coordinates(direction);
+    if (wo.z() <= 0 || wi.z() <= 0)
+      return false;
+    h = unit_vector(wo + wi);
+    return true;
+  }
 };
 
+// Transparent material whose index of refraction follows the Sellmeier
+// equation with coefficients b (dimensionless) and c (square micrometres).
 class dielectric : public material
 {
 public:
   dielectric(std::array<double, 3> b, std::array<double, 3> c)
     : b_{ b }
     , c_{ c }
-  {}
-
-#define RA 0.01
+  {
+    for (int i = 0; i <= ior_table_size; ++i)
+      ior_[i] = sellmeier(min_wavelength + i * ior_table_step);
+  }
 
-  virtual bool scatter(const ray& r_in,
-                       const hit_record& rec,
-                       color& attenuation,
-                       ray& scattered) const override
-  {
-    attenuation = color(1.0, 1.0, 1.0);
-    double ray_len = 0.0;
-    char color = 'a';
-    if (r_in.rgb_ == RGB::R) {
-      color = 'r';
-      // 630-780
-      ray_len = 630 + rand() % (780 - 630);
-    } else if (r_in.rgb_ == RGB::B) {
-      color = 'b';
-      // 450-480
-      ray_len = 450 + rand() % (480 - 450);
-    } else {
-      color = 'g';
-      // 510-550
-      ray_len = 510 + rand() % (550 - 510);
-    }
-    ray_len /= 1e3;
+  bool scatter(const ray& r_in,
+               const hit_record& rec,
+               scatter_record& srec) const override
+  {
+    srec.attenuation = color(1.0, 1.0, 1.0);
+    srec.pdf = 0.0;
 
-    auto n =
-      std::sqrt(1 + (b_[0] * ray_len * ray_len) / (ray_len * ray_len - c_[0]) +
-                (b_[1] * ray_len * ray_len) / (ray_len * ray_len - c_[1]) +
-                (b_[2] * ray_len * ray_len) / (ray_len * ray_len - c_[2]));
+    auto n = index_of_refraction(ray_wavelength(r_in));
     double refraction_ratio = rec.front_face ? (1.0 / n) : n;
 
     vec3 unit_direction = unit_vector(r_in.direction());
@@ -139,25 +278,71 @@ public:
     else
       direction = refract(unit_direction, rec.normal, refraction_ratio);
 
-    scattered = ray(rec.p, direction);
+    srec.scattered = ray(rec.p, direction);
 
     return true;
   }
 
+  bool dispersive() const override
+  {
+    // A Sellmeier term varies with the wavelength only if both of its
+    // coefficients are non-zero.
+    for (int i = 0; i < 3; ++i)
+      if (b_[i] != 0.0 && c_[i] != 0.0)
+        return true;
+    return false;
+  }
+
+  // Index of refraction at a wavelength in micrometres, interpolated in the
+  // table; wavelengths outside the bands are clamped to them.
+  double index_of_refraction(double wavelength) const
+  {
+    auto x = (wavelength - min_wavelength) * (1 / ior_table_step);
+    x = clamp(x, 0.0, ior_table_size);
+    auto const i = std::min(static_cast<int>(x), ior_table_size - 1);
+    auto const f = x - i;
+    return ior_[i] + f * (ior_[i + 1] - ior_[i]);
+  }
+
+  color albedo_at(const hit_record& rec) const override
+  {
+    return color(1, 1, 1);
+  }
+
+  bool specular() const override { return true; }
+
   std::string about() const override { return "прозрачный"; }
 
 public:
+  // Read only: the table below is computed from them.
   std::array<double, 3> b_;
   std::array<double, 3> c_;
 
 private:
+  // The index over the bands in steps of about 0.3 nm, far below what
+  // linear interpolation needs to follow the Sellmeier curve.
+  static constexpr int ior_table_size = 1024;
+  static constexpr double ior_table_step =
+    (max_wavelength - min_wavelength) / ior_table_size;
+
+  double sellmeier(double wavelength) const
+  {
+    auto const l2 = wavelength * wavelength;
+    return std::sqrt(1 + b_[0] * l2 / (l2 - c_[0]) +
+                     b_[1] * l2 / (l2 - c_[1]) + b_[2] * l2 / (l2 - c_[2]));
+  }
+
   static double reflectance(double cosine, double ref_idx)
   {
     // Use Schlick's approximation for reflectance.
     auto r0 = (1 - ref_idx) / (1 + ref_idx);
     r0 = r0 * r0;
-    return r0 + (1 - r0) * pow((1 - cosine), 5);
+    auto const m = 1 - cosine;
+    auto const m2 = m * m;
+    return r0 + (1 - r0) * (m2 * m2 * m);
   }
+
+  std::array<double, ior_table_size + 1> ior_;
 };
 
 class diffuse_light : public material
@@ -171,10 +356,9 @@ public:
     : emitt(make_shared<solid_color>(c))
   {}
 
-  virtual bool scatter(const ray& r_in,
-                       const hit_record& rec,
-                       color& attenuation,
-                       ray& scattered) const override
+  bool scatter(const ray& r_in,
+               const hit_record& rec,
+               scatter_record& srec) const override
   {
     return false;
   }
@@ -184,8 +368,34 @@ public:
     return emitt->value(u, v, p);
   }
 
+  bool emissive() const override { return true; }
+
+  color albedo_at(const hit_record& rec) const override
+  {
+    return emitt->value(rec.u, rec.v, rec.p);
+  }
+
   std::string about() const override { return "источник света"; }
 
 public:
   shared_ptr<texture> emitt;
 };
+
+// Materials of a scene. Primitives and hit records refer to them by
+// material_id, so tracing a ray never touches a shared_ptr reference count.
+class material_table
+{
+public:
+  material_id add(shared_ptr<material> m)
+  {
+    materials_.push_back(std::move(m));
+    return static_cast<material_id>(materials_.size() - 1);
+  }
+
+  const material& operator[](material_id id) const { return *materials_[id]; }
+
+  std::size_t size() const { return materials_.size(); }
+
+private:
+  std::vector<shared_ptr<material>> materials_;
+};
@@ -0,0 +1,60 @@
+#pragma once
+
+#include "rtweekend.h"
+
+// Isotropic GGX (Trowbridge-Reitz) microfacet model with the Smith shadowing
+// term. Directions are in the local frame of the surface, the normal being
+// the z axis, and point away from it; alpha is the roughness.
+
+// Density of microfacet normals h per unit of projected area.
+inline double
+ggx_d(const vec3& h, double alpha)
+{
+  auto a2 = alpha * alpha;
+  auto d = h.z() * h.z() * (a2 - 1) + 1;
+  return a2 / (pi * d * d);
+}
+
+// Smith's Lambda(w): the masking term G1(w) is 1 / (1 + Lambda(w)).
+inline double
+ggx_lambda(const vec3& w, double alpha)
+{
+  auto tan2 = (w.x() * w.x() + w.y() * w.y()) / (w.z() * w.z());
+  return 0.5 * (sqrt(1 + alpha * alpha * tan2) - 1);
+}
+
+// Microfacet normal sampled from the normals visible from wo, given two
+// uniform numbers (Heitz, "Sampling the GGX Distribution of Visible
+// Normals", 2018). Its density is G1(wo) max(0, wo.h) D(h) / wo.z.
+inline vec3
+ggx_sample_visible(const vec3& wo, double alpha, double u1, double u2)
+{
+  // Stretch the view so the distribution becomes a hemisphere.
+  vec3 vh = unit_vector(vec3(alpha * wo.x(), alpha * wo.y(), wo.z()));
+
+  auto lensq = vh.x() * vh.x() + vh.y() * vh.y();
+  vec3 t1 = lensq > 0 ? vec3(-vh.y(), vh.x(), 0) / sqrt(lensq) : vec3(1, 0, 0);
+  vec3 t2 = cross(vh, t1);
+
+  // A point of the projected hemisphere: a disk, half of it squashed.
+  auto r = sqrt(u1);
+  auto phi = 2 * pi * u2;
+  auto p1 = r * cos(phi);
+  auto p2 = r * sin(phi);
+  auto s = 0.5 * (1 + vh.z());
+  p2 = (1 - s) * sqrt(1 - p1 * p1) + s * p2;
+
+  vec3 nh =
+    p1 * t1 + p2 * t2 + sqrt(fmax(0.0, 1 - p1 * p1 - p2 * p2)) * vh;
+  return unit_vector(vec3(alpha * nh.x(), alpha * nh.y(), fmax(0.0, nh.z())));
+}
+
+// Schlick's approximation of the Fresnel reflectance, per channel, of a
+// surface reflecting f0 at normal incidence.
+inline color
+fresnel_schlick(const color& f0, double cosine)
+{
+  auto m = 1 - cosine;
+  auto m2 = m * m;
+  return f0 + (m2 * m2 * m) * (color(1, 1, 1) - f0);
+}
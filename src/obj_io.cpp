@@ -0,0 +1,324 @@
+#include "obj_io.h"
+
+#include <charconv>
+#include <cstdint>
+#include <fstream>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace {
+
+constexpr std::uint32_t none = ~std::uint32_t{ 0 };
+
+// Indices of the position, texture coordinate and normal of a face corner;
+// `none` for what the corner does not give.
+struct corner
+{
+  std::uint32_t v = none;
+  std::uint32_t vt = none;
+  std::uint32_t vn = none;
+
+  bool operator==(const corner& o) const
+  {
+    return v == o.v && vt == o.vt && vn == o.vn;
+  }
+};
+
+struct corner_hash
+{
+  std::size_t operator()(const corner& c) const
+  {
+    std::uint64_t h = c.v;
+    h = h * 0x9e3779b97f4a7c15ull + c.vt;
+    h = h * 0x9e3779b97f4a7c15ull + c.vn;
+    return static_cast<std::size_t>(h ^ (h >> 32));
+  }
+};
+
+// Whitespace separated tokens of one line.
+class line_reader
+{
+public:
+  line_reader(std::string_view line, const std::string& path, unsigned number)
+    : line_{ line }
+    , path_{ path }
+    , number_{ number }
+  {}
+
+  // The next token, empty at the end of the line or at a comment.
+  std::string_view word()
+  {
+    while (pos_ < line_.size() && is_blank(line_[pos_]))
+      ++pos_;
+    if (pos_ == line_.size() || '#' == line_[pos_])
+      return {};
+    auto const begin = pos_;
+    while (pos_ < line_.size() && !is_blank(line_[pos_]) && '#' != line_[pos_])
+      ++pos_;
+    return line_.substr(begin, pos_ - begin);
+  }
+
+  float number()
+  {
+    auto w = word();
+    float value = 0.0f;
+    auto [end, ec] = std::from_chars(w.data(), w.data() + w.size(), value);
+    if (w.empty() || ec != std::errc() || end != w.data() + w.size())
+      fail("number expected instead of '" + std::string(w) + "'");
+    return value;
+  }
+
+  [[noreturn]] void fail(const std::string& message) const
+  {
+    throw scene_error(path_ + ":" + std::to_string(number_) + ": " + message);
+  }
+
+private:
+  static bool is_blank(char c) { return ' ' == c || '\t' == c || '\r' == c; }
+
+  std::string_view line_;
+  const std::string& path_;
+  unsigned number_;
+  std::size_t pos_ = 0;
+};
+
+// Zero-based index of a 1-based or negative OBJ index into `count` elements.
+std::uint32_t
+obj_index(std::string_view s, std::size_t count, const line_reader& in)
+{
+  long long i = 0;
+  auto [end, ec] = std::from_chars(s.data(), s.data() + s.size(), i);
+  if (s.empty() || ec != std::errc() || end != s.data() + s.size())
+    in.fail("bad index '" + std::string(s) + "'");
+  auto const n = static_cast<long long>(count);
+  if (i < 0)
+    i += n;
+  else
+    --i;
+  if (i < 0 || i >= n)
+    in.fail("index " + std::string(s) + " out of range");
+  return static_cast<std::uint32_t>(i);
+}
+
+// Builds the mesh from the statements as they are read.
+class obj_builder
+{
+public:
+  explicit obj_builder(material_id material)
+    : mesh_{ std::make_shared<triangle_mesh>(material) }
+  {}
+
+  void position(float x, float y, float z) { push(positions_, { x, y, z }); }
+  void uv(float u, float v) { push(uvs_, { u, v }); }
+  void normal(float x, float y, float z) { push(normals_, { x, y, z }); }
+
+  corner parse_corner(std::string_view s, const line_reader& in) const
+  {
+    corner c;
+    auto const slash = s.find('/');
+    c.v = obj_index(s.substr(0, slash), positions_.size() / 3, in);
+    if (std::string_view::npos == slash)
+      return c;
+
+    s = s.substr(slash + 1);
+    auto const slash2 = s.find('/');
+    auto const vt = s.substr(0, slash2);
+    if (!vt.empty())
+      c.vt = obj_index(vt, uvs_.size() / 2, in);
+    if (std::string_view::npos != slash2)
+      c.vn = obj_index(s.substr(slash2 + 1), normals_.size() / 3, in);
+    return c;
+  }
+
+  // Index of the mesh vertex for a corner, added on its first use.
+  std::uint32_t vertex(const corner& c)
+  {
+    // Corners with a position only, the bulk of large scanned meshes, are
+    // looked up in a plain array.
+    if (none == c.vt && none == c.vn) {
+      if (by_position_.size() <= c.v)
+        by_position_.resize(positions_.size() / 3, none);
+      auto& i = by_position_[c.v];
+      if (none == i)
+        i = add_vertex(c);
+      return i;
+    }
+
+    auto it = by_corner_.find(c);
+    if (it != by_corner_.end())
+      return it->second;
+    auto const i = add_vertex(c);
+    by_corner_.emplace(c, i);
+    return i;
+  }
+
+  void triangle(std::uint32_t a, std::uint32_t b, std::uint32_t c)
+  {
+    // Triangles without area are never hit, and light sampling must not
+    // pick them.
+    auto const p0 = mesh_->position(a);
+    if (cross(mesh_->position(b) - p0, mesh_->position(c) - p0)
+          .length_squared() > 0)
+      mesh_->add_triangle(a, b, c);
+  }
+
+  std::shared_ptr<triangle_mesh> finish()
+  {
+    mesh_->positions.shrink_to_fit();
+    mesh_->normals.shrink_to_fit();
+    mesh_->uvs.shrink_to_fit();
+    mesh_->indices.shrink_to_fit();
+    mesh_->build();
+    return std::move(mesh_);
+  }
+
+private:
+  static void push(std::vector<float>& v, std::initializer_list<float> values)
+  {
+    v.insert(v.end(), values);
+  }
+
+  // Attributes are stored for all vertices once any vertex has them; the
+  // ones added before get zeros.
+  std::uint32_t add_vertex(const corner& c)
+  {
+    auto& m = *mesh_;
+    if (m.vertex_count() >= none)
+      throw scene_error("too many vertices in a mesh");
+    auto const i = static_cast<std::uint32_t>(m.vertex_count());
+
+    auto const* p = &positions_[3 * std::size_t{ c.v }];
+    m.positions.insert(m.positions.end(), p, p + 3);
+
+    if (none != c.vn || m.has_normals()) {
+      m.normals.resize(3 * std::size_t{ i }, 0.0f);
+      if (none != c.vn) {
+        auto const* n = &normals_[3 * std::size_t{ c.vn }];
+        m.normals.insert(m.normals.end(), n, n + 3);
+      } else {
+        m.normals.resize(m.normals.size() + 3, 0.0f);
+      }
+    }
+
+    if (none != c.vt || m.has_uvs()) {
+      m.uvs.resize(2 * std::size_t{ i }, 0.0f);
+      if (none != c.vt) {
+        auto const* uv = &uvs_[2 * std::size_t{ c.vt }];
+        m.uvs.insert(m.uvs.end(), uv, uv + 2);
+      } else {
+        m.uvs.resize(m.uvs.size() + 2, 0.0f);
+      }
+    }
+
+    return i;
+  }
+
+  std::shared_ptr<triangle_mesh> mesh_;
+  // The elements as the file lists them.
+  std::vector<float> positions_, uvs_, normals_;
+  // Mesh vertices made of them.
+  std::vector<std::uint32_t> by_position_;
+  std::unordered_map<corner, std::uint32_t, corner_hash> by_corner_;
+};
+
+// Shortest representation that reads back to the same value.
+void
+write_number(std::ostream& out, float x)
+{
+  char buf[32];
+  auto [end, ec] = std::to_chars(buf, buf + sizeof(buf), x);
+  out.write(buf, end - buf);
+}
+
+} // namespace
+
+std::shared_ptr<triangle_mesh>
+load_obj(const std::string& path, material_id material)
+{
+  std::ifstream file(path, std::ios::binary);
+  if (!file)
+    throw scene_error("can not open " + path);
+
+  obj_builder builder(material);
+  std::string line;
+  std::vector<std::uint32_t> face;
+  unsigned number = 0;
+
+  while (std::getline(file, line)) {
+    line_reader in(line, path, ++number);
+    auto const keyword = in.word();
+
+    if ("v" == keyword) {
+      auto x = in.number();
+      auto y = in.number();
+      builder.position(x, y, in.number());
+    } else if ("vt" == keyword) {
+      auto u = in.number();
+      builder.uv(u, in.number());
+    } else if ("vn" == keyword) {
+      auto x = in.number();
+      auto y = in.number();
+      builder.normal(x, y, in.number());
+    } else if ("f" == keyword) {
+      face.clear();
+      for (auto w = in.word(); !w.empty(); w = in.word())
+        face.push_back(builder.vertex(builder.parse_corner(w, in)));
+      if (face.size() < 3)
+        in.fail("a face needs three corners");
+      // Polygons are assumed convex and split into a fan.
+      for (std::size_t k = 2; k < face.size(); ++k)
+        builder.triangle(face[0], face[k - 1], face[k]);
+    }
+  }
+  if (file.bad())
+    throw scene_error("read error in " + path);
+
+  auto mesh = builder.finish();
+  if (0 == mesh->size())
+    throw scene_error("no triangles in " + path);
+  return mesh;
+}
+
+void
+save_obj(const triangle_mesh& mesh, const std::string& path)
+{
+  std::ofstream out(path, std::ios::binary);
+  if (!out)
+    throw scene_error("can not write " + path);
+
+  auto write_elements = [&out](const char* keyword,
+                               const std::vector<float>& v,
+                               std::size_t n) {
+    for (std::size_t i = 0; i < v.size(); i += n) {
+      out << keyword;
+      for (std::size_t k = 0; k < n; ++k) {
+        out << ' ';
+        write_number(out, v[i + k]);
+      }
+      out << '\n';
+    }
+  };
+  write_elements("v", mesh.positions, 3);
+  write_elements("vt", mesh.uvs, 2);
+  write_elements("vn", mesh.normals, 3);
+
+  // Attributes share the vertex indices.
+  for (std::size_t i = 0; i < mesh.indices.size(); i += 3) {
+    out << 'f';
+    for (int k = 0; k < 3; ++k) {
+      auto const v = mesh.indices[i + k] + 1;
+      out << ' ' << v;
+      if (mesh.has_uvs() || mesh.has_normals())
+        out << '/';
+      if (mesh.has_uvs())
+        out << v;
+      if (mesh.has_normals())
+        out << '/' << v;
+    }
+    out << '\n';
+  }
+
+  if (!out)
+    throw scene_error("write error");
+}
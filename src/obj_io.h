@@ -0,0 +1,22 @@
+#pragma once
+
+#include <memory>
+#include <string>
+
+#include "scene_io.h"
+#include "triangle_mesh.h"
+
+// Wavefront OBJ geometry: `v`, `vt`, `vn` and `f` statements, faces with
+// any number of corners written as `v`, `v/vt`, `v//vn` or `v/vt/vn`, and
+// negative indices counting back from the last element. Other statements
+// (groups, smoothing, materials) are skipped.
+//
+// The file is read line by line and never held in memory as a whole. Every
+// distinct combination of position, texture coordinate and normal becomes
+// one vertex of the mesh, which gets the given material and its hierarchy.
+// Throws scene_error for unreadable or malformed files.
+std::shared_ptr<triangle_mesh>
+load_obj(const std::string& path, material_id material);
+
+void
+save_obj(const triangle_mesh& mesh, const std::string& path);
@@ -9,16 +9,31 @@ enum class RGB
   B
 };
 
+// Set of colour channels (wavelength bands) transported by a ray. Camera rays
+// carry the whole bundle; it is split into single channels only when the path
+// meets a dispersive surface.
+using channel_mask = unsigned char;
+
+constexpr channel_mask all_channels = 0b111;
+
+constexpr channel_mask
+to_mask(RGB const rgb)
+{
+  return static_cast<channel_mask>(1u << static_cast<int>(rgb));
+}
+
 class ray
 {
 public:
-  ray(RGB const rgb = RGB::R)
-    : rgb_{ rgb }
+  ray(channel_mask const channels = all_channels)
+    : channels_{ channels }
   {}
-  ray(const point3& origin, const vec3& direction, RGB const rgb = RGB::R)
+  ray(const point3& origin,
+      const vec3& direction,
+      channel_mask const channels = all_channels)
     : orig(origin)
     , dir(direction)
-    , rgb_{ rgb }
+    , channels_{ channels }
   {}
 
   point3 origin() const { return orig; }
@@ -26,10 +41,26 @@ public:
 
   point3 at(double t) const { return orig + t * dir; }
 
-  void set_RGB(RGB const rgb) { rgb_ = rgb; }
+  void set_RGB(RGB const rgb) { channels_ = to_mask(rgb); }
+
+  bool single_channel() const { return 0 == (channels_ & (channels_ - 1)); }
+
+  // Channel of a single-channel ray; for a bundle, the first one it carries.
+  RGB rgb() const
+  {
+    if (channels_ & to_mask(RGB::R))
+      return RGB::R;
+    if (channels_ & to_mask(RGB::G))
+      return RGB::G;
+    return RGB::B;
+  }
 
 public:
   point3 orig;
   vec3 dir;
-  RGB rgb_ = RGB::R;
+  channel_mask channels_ = all_channels;
+  // Wavelength in micrometres of a single-channel ray, drawn from the band
+  // of its channel when the bundle was split; zero for bundles. The path
+  // keeps it, so every dispersive surface on the way bends it alike.
+  double wavelength_ = 0.0;
 };
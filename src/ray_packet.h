@@ -0,0 +1,59 @@
+#pragma once
+
+#include "ray.h"
+#include "simd.h"
+
+// Group of rays traced together through the acceleration structure. Besides
+// the rays themselves it keeps their components lane by lane, laid out for
+// vdouble4 loads.
+struct ray_packet
+{
+  static constexpr int size = vdouble4::lanes;
+  static constexpr int all_lanes = (1 << size) - 1;
+
+  ray_packet() {}
+
+  explicit ray_packet(const ray (&rs)[size])
+  {
+    for (int i = 0; i < size; ++i) {
+      rays[i] = rs[i];
+      for (int a = 0; a < 3; ++a) {
+        org[a][i] = rs[i].origin()[a];
+        dir[a][i] = rs[i].direction()[a];
+        inv_dir[a][i] = 1.0 / rs[i].direction()[a];
+      }
+    }
+  }
+
+  // Whether the directions of the lanes in `active` agree in sign on every
+  // axis, so a single front-to-back order suits all of them.
+  bool coherent(int active) const
+  {
+    int first = 0;
+    while (0 == (active & (1 << first)))
+      ++first;
+
+    for (int i = first + 1; i < size; ++i) {
+      if (0 == (active & (1 << i)))
+        continue;
+      for (int a = 0; a < 3; ++a)
+        if ((inv_dir[a][i] < 0) != (inv_dir[a][first] < 0))
+          return false;
+    }
+    return true;
+  }
+
+  ray rays[size];
+  double org[3][size];
+  double dir[3][size];
+  double inv_dir[3][size];
+};
+
+inline int
+lane_count(int mask)
+{
+  int n = 0;
+  for (; mask; mask &= mask - 1)
+    ++n;
+  return n;
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <functional> // function
+#include <future>
+#include <mutex>
+#include <thread>
+
+#include "image.h"
+
+// A render running on its own thread. The work polls checkpoint() between
+// tiles, which is where cancel() and pause() take effect. The handle owns the
+// thread: destroying it cancels the render and waits for it to finish.
+class render_job
+{
+public:
+  using work = std::function<image(const render_job& job)>;
+
+  explicit render_job(work w)
+    : result_{ promise_.get_future().share() }
+    , thread_{ [this, w = std::move(w)]() {
+      try {
+        promise_.set_value(w(*this));
+      } catch (...) {
+        promise_.set_exception(std::current_exception());
+      }
+    } }
+  {}
+
+  render_job(const render_job&) = delete;
+  render_job& operator=(const render_job&) = delete;
+
+  ~render_job()
+  {
+    cancel();
+    thread_.join();
+  }
+
+  void cancel()
+  {
+    cancelled_.store(true, std::memory_order_relaxed);
+    resume();
+  }
+
+  void pause()
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    paused_.store(true, std::memory_order_relaxed);
+  }
+
+  void resume()
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      paused_.store(false, std::memory_order_relaxed);
+    }
+    unpaused_.notify_all();
+  }
+
+  bool cancelled() const { return cancelled_.load(std::memory_order_relaxed); }
+
+  // Blocks while the job is paused. Returns false if the work should stop.
+  bool checkpoint() const
+  {
+    if (paused_.load(std::memory_order_relaxed)) {
+      std::unique_lock<std::mutex> lock(mutex_);
+      unpaused_.wait(lock, [this] {
+        return !paused_.load(std::memory_order_relaxed) || cancelled();
+      });
+    }
+    return !cancelled();
+  }
+
+  // The image the work returned; a cancelled render returns what it had.
+  std::shared_future<image> result() const { return result_; }
+
+private:
+  std::atomic<bool> cancelled_{ false };
+  std::atomic<bool> paused_{ false };
+  mutable std::mutex mutex_;
+  mutable std::condition_variable unpaused_;
+
+  std::promise<image> promise_;
+  std::shared_future<image> result_;
+  // Started last, once everything above is initialized.
+  std::thread thread_;
+};
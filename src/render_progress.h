@@ -0,0 +1,83 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+// Snapshot of a running render.
+struct render_progress
+{
+  double percent;
+  // Rays cast per second since the start, all bounces included.
+  double rays_per_sec;
+  // Estimated time left in seconds, negative while unknown.
+  double eta;
+};
+
+// Collects the work done by render workers without locking and publishes it
+// at a bounded rate: whichever worker notices that the interval has passed
+// reports, the others return at once.
+class progress_reporter
+{
+public:
+  using clock = std::chrono::steady_clock;
+
+  explicit progress_reporter(
+    double total_samples,
+    clock::duration interval = std::chrono::milliseconds(50))
+    : total_{ total_samples }
+    , interval_{ interval.count() }
+    , start_{ clock::now() }
+  {}
+
+  // Revises the expected amount of work once it is better known. Not to be
+  // called while workers report.
+  void set_total(double total_samples) { total_ = total_samples; }
+
+  void add(std::uint64_t samples, std::uint64_t rays)
+  {
+    samples_.fetch_add(samples, std::memory_order_relaxed);
+    rays_.fetch_add(rays, std::memory_order_relaxed);
+  }
+
+  // Calls publish(render_progress) if the interval since the previous
+  // report has passed, or unconditionally if force is set.
+  template<typename Publish>
+  void report(Publish&& publish, bool force = false)
+  {
+    auto const now = (clock::now() - start_).count();
+    auto last = last_.load(std::memory_order_relaxed);
+    if (!force && (now - last < interval_ ||
+                   !last_.compare_exchange_strong(
+                     last, now, std::memory_order_relaxed)))
+      return;
+    if (force)
+      last_.store(now, std::memory_order_relaxed);
+
+    publish(snapshot(now));
+  }
+
+private:
+  render_progress snapshot(clock::rep now) const
+  {
+    double const elapsed =
+      std::chrono::duration<double>(clock::duration(now)).count();
+    double const done = samples_.load(std::memory_order_relaxed);
+    double const rays = rays_.load(std::memory_order_relaxed);
+
+    render_progress p;
+    p.percent = total_ > 0 ? std::min(100.0 * done / total_, 100.0) : 100.0;
+    p.rays_per_sec = elapsed > 0 ? rays / elapsed : 0.0;
+    p.eta =
+      done > 0 ? elapsed * std::max(total_ - done, 0.0) / done : -1.0;
+    return p;
+  }
+
+  double total_;
+  clock::rep interval_;
+  clock::time_point start_;
+  std::atomic<std::uint64_t> samples_{ 0 };
+  std::atomic<std::uint64_t> rays_{ 0 };
+  std::atomic<clock::rep> last_{ 0 };
+};
@@ -3,7 +3,8 @@
 #include <cmath>
 #include <limits>
 #include <memory>
-#include <random>
+
+#include "sampler.h"
 
 // Usings
 
@@ -37,9 +38,8 @@ clamp(double x, double min, double max)
 inline double
 random_double()
 {
-  static std::uniform_real_distribution<double> distribution(0.0, 1.0);
-  static std::mt19937 generator;
-  return distribution(generator);
+  // Returns a random real in [0,1) from the stream of the current sample.
+  return thread_rng.next_double();
 }
 
 inline double
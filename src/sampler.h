@@ -0,0 +1,69 @@
+#pragma once
+
+#include <cstdint>
+
+// Minimal PCG32 generator (O'Neill, "PCG: A Family of Simple Fast
+// Space-Efficient Statistically Good Algorithms for Random Number
+// Generation"): 64-bit LCG state with a permuted 32-bit output.
+class pcg32
+{
+public:
+  pcg32() { seed(0, 0); }
+  pcg32(std::uint64_t initstate, std::uint64_t stream)
+  {
+    seed(initstate, stream);
+  }
+
+  void seed(std::uint64_t initstate, std::uint64_t stream)
+  {
+    state_ = 0u;
+    inc_ = (stream << 1u) | 1u;
+    next_uint();
+    state_ += initstate;
+    next_uint();
+  }
+
+  std::uint32_t next_uint()
+  {
+    std::uint64_t old = state_;
+    state_ = old * 6364136223846793005ULL + inc_;
+    auto xorshifted = static_cast<std::uint32_t>(((old >> 18u) ^ old) >> 27u);
+    auto rot = static_cast<std::uint32_t>(old >> 59u);
+    return (xorshifted >> rot) | (xorshifted << ((32u - rot) & 31u));
+  }
+
+  // Uniform double in [0, 1) with 53 random bits.
+  double next_double()
+  {
+    std::uint64_t hi = next_uint() >> 5u;
+    std::uint64_t lo = next_uint() >> 6u;
+    return static_cast<double>((hi << 26u) | lo) * (1.0 / 9007199254740992.0);
+  }
+
+private:
+  std::uint64_t state_ = 0;
+  std::uint64_t inc_ = 1;
+};
+
+inline std::uint64_t
+mix_bits(std::uint64_t v)
+{
+  // SplitMix64 finalizer.
+  v ^= v >> 30u;
+  v *= 0xbf58476d1ce4e5b9ULL;
+  v ^= v >> 27u;
+  v *= 0x94d049bb133111ebULL;
+  v ^= v >> 31u;
+  return v;
+}
+
+// Generator of the calling thread. Render loops reseed it at the start of
+// every sample, so the random sequence of a sample depends only on the pixel
+// and the sample number, never on which thread traced it.
+inline thread_local pcg32 thread_rng;
+
+inline void
+seed_sample(std::uint64_t pixel, std::uint64_t sample)
+{
+  thread_rng.seed(mix_bits(pixel), mix_bits(sample));
+}
@@ -4,19 +4,69 @@
 
 #include "color.h"
 #include "hittable_list.h"
+#include "material.h"
+#include "sphere.h"
+#include "sphere_soup.h"
 #include "vec3.h"
 
+// What a render needs. Once made, a scene is not changed: renders share it
+// with the window and with each other by reference. The parts that are
+// expensive to copy are held by reference too, so a new scene made after an
+// edit shares with the old one every part the edit left alone.
 struct scene
 {
-  scene(color background, point3 lookfrom_, point3 lookto_, hittable_list world)
+  scene(color background,
+        point3 lookfrom_,
+        point3 lookto_,
+        hittable_list world,
+        material_table materials)
+    : scene(background,
+            lookfrom_,
+            lookto_,
+            make_shared<const hittable_list>(std::move(world)),
+            make_shared<const material_table>(std::move(materials)))
+  {}
+
+  scene(color background,
+        point3 lookfrom_,
+        point3 lookto_,
+        shared_ptr<const hittable_list> world,
+        shared_ptr<const material_table> materials,
+        shared_ptr<const hittable> accel = nullptr)
     : background_{ background }
     , lookfrom_{ lookfrom_ }
     , lookto_{ lookto_ }
     , world_{ std::move(world) }
+    , materials_{ std::move(materials) }
+    , accel_{ std::move(accel) }
   {}
 
+  // Emitting objects, to be sampled directly. Spheres of a soup are taken
+  // out of it one by one.
+  hittable_list lights() const
+  {
+    hittable_list lights;
+    for (const auto& object : world_->objects) {
+      if (auto soup = std::dynamic_pointer_cast<sphere_soup>(object)) {
+        for (std::size_t i = 0; i < soup->size(); ++i)
+          if ((*materials_)[soup->materials[i]].emissive())
+            lights.add(make_shared<sphere>(
+              point3(soup->cx[i], soup->cy[i], soup->cz[i]),
+              soup->radius[i],
+              soup->materials[i]));
+      } else if (object->is_light(*materials_)) {
+        lights.add(object);
+      }
+    }
+    return lights;
+  }
+
   color background_;
   point3 lookfrom_;
   point3 lookto_;
-  hittable_list world_;
+  shared_ptr<const hittable_list> world_;
+  shared_ptr<const material_table> materials_;
+  // Hierarchy over world_ that the caller keeps across renders (see
+  // dynamic_bvh); without it every render builds its own.
+  shared_ptr<const hittable> accel_;
 };
\ No newline at end of file
@@ -0,0 +1,1339 @@
+#include "scene_io.h"
+
+#include <algorithm>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <charconv>
+#include <cmath>
+#include <cstddef>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <limits>
+#include <map>
+#include <string_view>
+#include <type_traits>
+#include <unordered_map>
+
+#include "aarect.h"
+#include "box.h"
+#include "obj_io.h"
+#include "sphere.h"
+#include "sphere_soup.h"
+#include "triangle_mesh.h"
+
+namespace {
+
+namespace bip = boost::interprocess;
+
+// Defaults for statements missing from a file.
+const point3 default_lookfrom{ 1, 3, 3 };
+const point3 default_lookto{ 0, 1, 0 };
+const color default_background{ 0, 0, 0 };
+
+enum class texture_type : std::uint32_t
+{
+  solid,
+  checker
+};
+
+enum class material_type : std::uint32_t
+{
+  lambertian,
+  metal,
+  dielectric,
+  light
+};
+
+enum class shape_type : std::uint32_t
+{
+  sphere,
+  box,
+  xy_rect,
+  xz_rect,
+  yz_rect
+};
+
+enum class transform_type : std::uint32_t
+{
+  rotate_y,
+  translate,
+  matrix
+};
+
+struct transform_op
+{
+  transform_type type;
+  // rotate_y: the angle in degrees in x; translate: the offset.
+  vec3 v;
+  // matrix: the whole transform.
+  affine m;
+};
+
+affine
+to_affine(const transform_op& op)
+{
+  switch (op.type) {
+    case transform_type::rotate_y:
+      return affine::rotation_y(op.v.x());
+    case transform_type::translate:
+      return affine::translation(op.v);
+    case transform_type::matrix:
+      return op.m;
+  }
+  throw scene_error("unknown transform");
+}
+
+// The placement of an instance in the terms of the files: a rotation about
+// y and a translation where it is one, which is what hand-written files
+// have, and the matrix otherwise.
+std::vector<transform_op>
+decompose(const affine& t)
+{
+  auto const& m = t.m;
+  bool const upright = 1.0 == m[1][1] && 0.0 == m[0][1] && 0.0 == m[1][0] &&
+                       0.0 == m[1][2] && 0.0 == m[2][1] &&
+                       m[0][0] == m[2][2] && m[0][2] == -m[2][0];
+  bool const turned = !(1.0 == m[0][0] && 0.0 == m[0][2]);
+  if (!upright ||
+      (turned && fabs(m[0][0] * m[0][0] + m[0][2] * m[0][2] - 1) > 1e-12))
+    return { { transform_type::matrix, vec3(), t } };
+
+  std::vector<transform_op> ops;
+  if (turned) {
+    // The result is rounded so that angles written by hand survive a round
+    // trip unchanged.
+    auto const degrees = std::atan2(m[0][2], m[0][0]) * 180.0 / pi;
+    ops.push_back({ transform_type::rotate_y,
+                    vec3(std::round(degrees * 1e9) / 1e9, 0, 0) });
+  }
+  vec3 const offset(m[0][3], m[1][3], m[2][3]);
+  if (0.0 != offset.length_squared())
+    ops.push_back({ transform_type::translate, offset });
+  return ops;
+}
+
+// ---------------------------------------------------------------------------
+// Flattening a scene for writing
+
+struct shape_desc
+{
+  shape_type type;
+  material_id mat;
+  // sphere: centre and radius; box: corners; rect: ranges and position.
+  double p[6];
+  std::vector<transform_op> ops;
+};
+
+struct mesh_desc
+{
+  const triangle_mesh* mesh;
+  std::vector<transform_op> ops;
+};
+
+// Objects, textures and the spheres to store as a soup, in writing order.
+struct flat_scene
+{
+  // Children precede the checker textures that refer to them.
+  std::vector<const texture*> textures;
+  std::unordered_map<const texture*, std::uint32_t> texture_ids;
+
+  std::vector<shape_desc> shapes;
+  std::vector<mesh_desc> meshes;
+
+  // With packing on, untransformed spheres are gathered here instead of in
+  // `shapes`.
+  bool pack = false;
+  std::vector<const sphere*> spheres;
+  std::vector<const sphere_soup*> soups;
+
+  std::uint32_t texture_id(const texture* t)
+  {
+    auto it = texture_ids.find(t);
+    if (it != texture_ids.end())
+      return it->second;
+
+    if (auto c = dynamic_cast<const checker_texture*>(t)) {
+      texture_id(c->even.get());
+      texture_id(c->odd.get());
+    } else if (!dynamic_cast<const solid_color*>(t)) {
+      throw scene_error("unsupported texture");
+    }
+
+    auto id = static_cast<std::uint32_t>(textures.size());
+    textures.push_back(t);
+    texture_ids[t] = id;
+    return id;
+  }
+
+  void add_materials(const material_table& materials)
+  {
+    for (material_id i = 0; i < materials.size(); ++i) {
+      const material* m = &materials[i];
+      if (auto l = dynamic_cast<const lambertian*>(m))
+        texture_id(l->albedo.get());
+      else if (auto d = dynamic_cast<const diffuse_light*>(m))
+        texture_id(d->emitt.get());
+      else if (!dynamic_cast<const metal*>(m) &&
+               !dynamic_cast<const dielectric*>(m))
+        throw scene_error("unsupported material");
+    }
+  }
+
+  void add_object(const hittable* object)
+  {
+    // Nested instances are placed by the product of their transforms.
+    affine placement;
+    bool placed = false;
+    while (auto i = dynamic_cast<const instance*>(object)) {
+      placement = placement * i->to_world;
+      placed = true;
+      object = i->object.get();
+    }
+    auto const ops =
+      placed ? decompose(placement) : std::vector<transform_op>{};
+
+    if (auto list = dynamic_cast<const hittable_list*>(object)) {
+      if (!ops.empty())
+        throw scene_error("transformed object lists are not supported");
+      for (const auto& o : list->objects)
+        add_object(o.get());
+    } else if (auto s = dynamic_cast<const sphere*>(object)) {
+      if (pack && ops.empty())
+        spheres.push_back(s);
+      else
+        shapes.push_back({ shape_type::sphere,
+                           s->mat_id,
+                           { s->center.x(),
+                             s->center.y(),
+                             s->center.z(),
+                             s->radius,
+                             0,
+                             0 },
+                           ops });
+    } else if (auto soup = dynamic_cast<const sphere_soup*>(object)) {
+      if (pack && ops.empty()) {
+        soups.push_back(soup);
+      } else {
+        for (std::size_t i = 0; i < soup->size(); ++i)
+          shapes.push_back({ shape_type::sphere,
+                             soup->materials[i],
+                             { soup->cx[i],
+                               soup->cy[i],
+                               soup->cz[i],
+                               soup->radius[i],
+                               0,
+                               0 },
+                             ops });
+      }
+    } else if (auto b = dynamic_cast<const box*>(object)) {
+      shapes.push_back({ shape_type::box,
+                         b->mp,
+                         { b->box_min.x(),
+                           b->box_min.y(),
+                           b->box_min.z(),
+                           b->box_max.x(),
+                           b->box_max.y(),
+                           b->box_max.z() },
+                         ops });
+    } else if (auto r = dynamic_cast<const xy_rect*>(object)) {
+      shapes.push_back({ shape_type::xy_rect,
+                         r->mp,
+                         { r->x0, r->x1, r->y0, r->y1, r->k, 0 },
+                         ops });
+    } else if (auto r = dynamic_cast<const xz_rect*>(object)) {
+      shapes.push_back({ shape_type::xz_rect,
+                         r->mp,
+                         { r->x0, r->x1, r->z0, r->z1, r->k, 0 },
+                         ops });
+    } else if (auto r = dynamic_cast<const yz_rect*>(object)) {
+      shapes.push_back({ shape_type::yz_rect,
+                         r->mp,
+                         { r->y0, r->y1, r->z0, r->z1, r->k, 0 },
+                         ops });
+    } else if (auto m = dynamic_cast<const triangle_mesh*>(object)) {
+      meshes.push_back({ m, ops });
+    } else {
+      throw scene_error("unsupported object");
+    }
+  }
+};
+
+flat_scene
+flatten(const scene& s, bool pack)
+{
+  flat_scene flat;
+  flat.pack = pack;
+  flat.add_materials(*s.materials_);
+  flat.add_object(s.world_.get());
+  return flat;
+}
+
+shared_ptr<hittable>
+make_shape(shape_type type, material_id mat, const double* p)
+{
+  switch (type) {
+    case shape_type::sphere:
+      return make_shared<sphere>(point3(p[0], p[1], p[2]), p[3], mat);
+    case shape_type::box:
+      return make_shared<box>(
+        point3(p[0], p[1], p[2]), point3(p[3], p[4], p[5]), mat);
+    case shape_type::xy_rect:
+      return make_shared<xy_rect>(p[0], p[1], p[2], p[3], p[4], mat);
+    case shape_type::xz_rect:
+      return make_shared<xz_rect>(p[0], p[1], p[2], p[3], p[4], mat);
+    case shape_type::yz_rect:
+      return make_shared<yz_rect>(p[0], p[1], p[2], p[3], p[4], mat);
+  }
+  throw scene_error("unknown object type");
+}
+
+// ---------------------------------------------------------------------------
+// Text form
+
+const char* const shape_keywords[] = {
+  "sphere", "box", "xy_rect", "xz_rect", "yz_rect"
+};
+// Number of values before the material name.
+const int shape_params[] = { 4, 6, 5, 5, 5 };
+
+// Whitespace separated tokens, statements end with the line.
+class text_reader
+{
+public:
+  text_reader(std::string data, std::string path)
+    : data_{ std::move(data) }
+    , path_{ std::move(path) }
+  {}
+
+  // Moves to the first token of the next statement; false at the end.
+  bool next_statement()
+  {
+    while (true) {
+      skip_blanks();
+      if (pos_ == data_.size())
+        return false;
+      if ('\n' != data_[pos_])
+        return true;
+      ++pos_;
+      ++line_;
+    }
+  }
+
+  bool at_line_end()
+  {
+    skip_blanks();
+    return pos_ == data_.size() || '\n' == data_[pos_];
+  }
+
+  void end_statement()
+  {
+    if (!at_line_end())
+      fail("unexpected '" + std::string(word()) + "'");
+  }
+
+  std::string_view word()
+  {
+    if (at_line_end())
+      fail("unexpected end of line");
+
+    auto const begin = pos_;
+    while (pos_ < data_.size() && !is_blank(data_[pos_]) &&
+           '\n' != data_[pos_] && '#' != data_[pos_])
+      ++pos_;
+    return std::string_view(data_).substr(begin, pos_ - begin);
+  }
+
+  double number()
+  {
+    auto w = word();
+    double value = 0.0;
+    auto [end, ec] = std::from_chars(w.data(), w.data() + w.size(), value);
+    if (ec != std::errc() || end != w.data() + w.size())
+      fail("number expected instead of '" + std::string(w) + "'");
+    return value;
+  }
+
+  vec3 triple()
+  {
+    double x = number();
+    double y = number();
+    double z = number();
+    return vec3(x, y, z);
+  }
+
+  [[noreturn]] void fail(const std::string& message) const
+  {
+    throw scene_error(path_ + ":" + std::to_string(line_) + ": " + message);
+  }
+
+private:
+  static bool is_blank(char c) { return ' ' == c || '\t' == c || '\r' == c; }
+
+  // Skips spaces and a comment, stopping at the end of the line.
+  void skip_blanks()
+  {
+    while (pos_ < data_.size() && is_blank(data_[pos_]))
+      ++pos_;
+    if (pos_ < data_.size() && '#' == data_[pos_])
+      while (pos_ < data_.size() && '\n' != data_[pos_])
+        ++pos_;
+  }
+
+  std::string data_;
+  std::string path_;
+  std::size_t pos_ = 0;
+  unsigned line_ = 1;
+};
+
+// Reads the transforms that end an object statement and places the object
+// by them, if there are any.
+shared_ptr<hittable>
+read_transforms(text_reader& in, shared_ptr<hittable> object)
+{
+  if (in.at_line_end())
+    return object;
+
+  affine t;
+  while (!in.at_line_end()) {
+    auto const op = in.word();
+    if ("rotate_y" == op) {
+      t = affine::rotation_y(in.number()) * t;
+    } else if ("rotate" == op) {
+      auto const axis = in.triple();
+      if (0.0 == axis.length_squared())
+        in.fail("rotation about a zero axis");
+      t = affine::rotation(axis, in.number()) * t;
+    } else if ("scale" == op) {
+      t = affine::scaling(in.triple()) * t;
+    } else if ("translate" == op) {
+      t = affine::translation(in.triple()) * t;
+    } else if ("matrix" == op) {
+      affine m;
+      for (auto& row : m.m)
+        for (auto& x : row)
+          x = in.number();
+      t = m * t;
+    } else {
+      in.fail("unknown transform '" + std::string(op) + "'");
+    }
+  }
+  if (0.0 == t.determinant())
+    in.fail("the transform flattens the object");
+  return transformed(std::move(object), t);
+}
+
+// Path of a file named in a scene file: relative ones start from the
+// directory of the scene.
+std::string
+resolve_path(const std::string& scene_path, std::string_view file)
+{
+  auto const slash = scene_path.find_last_of('/');
+  if ((!file.empty() && '/' == file.front()) || std::string::npos == slash)
+    return std::string(file);
+  return scene_path.substr(0, slash + 1) + std::string(file);
+}
+
+std::string
+read_file(const std::string& path)
+{
+  std::ifstream in(path, std::ios::binary);
+  if (!in)
+    throw scene_error("can not open " + path);
+  return std::string(std::istreambuf_iterator<char>(in),
+                     std::istreambuf_iterator<char>());
+}
+
+// Shortest representation that reads back to the same value.
+std::string
+to_text(double x)
+{
+  char buf[32];
+  auto [end, ec] = std::to_chars(buf, buf + sizeof(buf), x);
+  return std::string(buf, end);
+}
+
+std::string
+to_text(const vec3& v)
+{
+  return to_text(v.x()) + ' ' + to_text(v.y()) + ' ' + to_text(v.z());
+}
+
+void
+write_transforms(std::ostream& out, const std::vector<transform_op>& ops)
+{
+  for (const auto& op : ops) {
+    if (transform_type::rotate_y == op.type) {
+      out << " rotate_y " << to_text(op.v.x());
+    } else if (transform_type::translate == op.type) {
+      out << " translate " << to_text(op.v);
+    } else {
+      out << " matrix";
+      for (const auto& row : op.m.m)
+        for (double x : row)
+          out << ' ' << to_text(x);
+    }
+  }
+}
+
+// ---------------------------------------------------------------------------
+// Binary form
+
+namespace binary {
+
+// The last bytes catch transfers that mangle line ends.
+constexpr char signature[8] = { 'D', 'N', 'S', 'C', 'E', 'N', '\r', '\n' };
+// Version 2 added triangle meshes, version 3 matrix transforms and meshes
+// shared by several records; older files are still read.
+constexpr std::uint32_t version = 3;
+constexpr std::uint32_t byte_order = 0x01020304;
+
+struct section
+{
+  std::uint64_t offset;
+  std::uint64_t count;
+};
+
+struct header
+{
+  char signature[8];
+  std::uint32_t version;
+  std::uint32_t byte_order;
+  double background[3];
+  double lookfrom[3];
+  double lookto[3];
+
+  section textures;
+  section materials;
+  section shapes;
+  section transforms;
+
+  // The sphere_soup: its hierarchy and arrays in leaf order. The geometry
+  // arrays are doubles followed by soup_padding dummy entries.
+  section soup_nodes;
+  section soup_cx;
+  section soup_cy;
+  section soup_cz;
+  section soup_radius;
+  section soup_materials;
+
+  // mesh_record entries; version 1 headers end before this.
+  section meshes;
+};
+
+constexpr std::size_t header_v1_size = offsetof(header, meshes);
+
+// The padding of sphere_soup in double precision builds, kept in files
+// whatever the build.
+constexpr std::size_t soup_padding = 3;
+
+struct texture_record
+{
+  texture_type type;
+  // checker: the textures of the even and odd cells, defined earlier.
+  std::uint32_t even;
+  std::uint32_t odd;
+  std::uint32_t reserved;
+  double color[3];
+};
+
+struct material_record
+{
+  material_type type;
+  // lambertian, light: texture index.
+  std::uint32_t texture;
+  // metal: albedo and fuzz.
+  double color[3];
+  double fuzz;
+  // dielectric: Sellmeier coefficients.
+  double b[3];
+  double c[3];
+};
+
+struct shape_record
+{
+  shape_type type;
+  material_id material;
+  std::uint32_t first_transform;
+  std::uint32_t transform_count;
+  double p[6];
+};
+
+// A matrix takes four records of its type in a row, holding the columns of
+// [A | b].
+struct transform_record
+{
+  transform_type type;
+  std::uint32_t reserved;
+  double v[3];
+};
+
+// A triangle_mesh: its hierarchy and arrays, triangles in leaf order.
+// Records of instances of one mesh refer to the same sections.
+struct mesh_record
+{
+  material_id material;
+  std::uint32_t first_transform;
+  std::uint32_t transform_count;
+  std::uint32_t reserved;
+  section nodes;
+  section positions;
+  section normals;
+  section uvs;
+  section indices;
+};
+
+// A hierarchy node as stored: bvh_node with double precision boxes. Builds
+// with another vec3 convert nodes on the way in and out.
+struct node_record
+{
+  double box[6];
+  std::uint32_t left_first;
+  std::uint16_t count;
+  std::uint16_t axis;
+};
+
+// Whether bvh_node is laid out as node_record and can be copied as is.
+constexpr bool raw_nodes = std::is_same<vec3, basic_vec3<double>>::value;
+
+static_assert(!raw_nodes || (sizeof(bvh_node) == sizeof(node_record) &&
+                             offsetof(bvh_node, left_first) ==
+                               offsetof(node_record, left_first)),
+              "bvh nodes are stored as raw bytes");
+static_assert(std::is_trivially_copyable<bvh_node>::value,
+              "bvh nodes are stored as raw bytes");
+
+void
+put_transforms(std::vector<transform_record>& records,
+               const std::vector<transform_op>& ops)
+{
+  for (const auto& op : ops) {
+    transform_record t{};
+    t.type = op.type;
+    if (transform_type::matrix == op.type) {
+      for (int j = 0; j < 4; ++j) {
+        for (int i = 0; i < 3; ++i)
+          t.v[i] = op.m.m[i][j];
+        records.push_back(t);
+      }
+    } else {
+      for (int i = 0; i < 3; ++i)
+        t.v[i] = op.v[i];
+      records.push_back(t);
+    }
+  }
+}
+
+// The placement made of `count` records.
+affine
+get_transforms(const transform_record* records, std::uint32_t count)
+{
+  affine t;
+  std::uint32_t k = 0;
+  while (k < count) {
+    const auto& r = records[k];
+    transform_op op{ r.type, vec3(r.v[0], r.v[1], r.v[2]) };
+    if (transform_type::matrix == r.type) {
+      if (count - k < 4)
+        throw scene_error("corrupt transform record");
+      for (int j = 0; j < 4; ++j) {
+        if (transform_type::matrix != records[k + j].type)
+          throw scene_error("corrupt transform record");
+        for (int i = 0; i < 3; ++i)
+          op.m.m[i][j] = records[k + j].v[i];
+      }
+      k += 4;
+    } else {
+      ++k;
+    }
+    t = to_affine(op) * t;
+  }
+  if (0.0 == t.determinant())
+    throw scene_error("corrupt transform record");
+  return t;
+}
+
+void
+put(double* dst, const vec3& v)
+{
+  dst[0] = v.x();
+  dst[1] = v.y();
+  dst[2] = v.z();
+}
+
+vec3
+get(const double* src)
+{
+  return vec3(src[0], src[1], src[2]);
+}
+
+class writer
+{
+public:
+  explicit writer(const std::string& path)
+    : out_(path, std::ios::binary)
+  {
+    if (!out_)
+      throw scene_error("can not write " + path);
+  }
+
+  void reserve(std::size_t bytes)
+  {
+    std::vector<char> zeros(bytes);
+    out_.write(zeros.data(), zeros.size());
+  }
+
+  template<typename T>
+  section write(const T* data, std::size_t count)
+  {
+    // Sections start at multiples of 8 so mapped records are aligned.
+    static const char zeros[8] = {};
+    out_.write(zeros, (8 - out_.tellp() % 8) % 8);
+
+    section s{ static_cast<std::uint64_t>(out_.tellp()), count };
+    out_.write(reinterpret_cast<const char*>(data), count * sizeof(T));
+    return s;
+  }
+
+  template<typename T>
+  section write(const std::vector<T>& v)
+  {
+    return write(v.data(), v.size());
+  }
+
+  section write(const std::vector<bvh_node>& nodes)
+  {
+    if constexpr (raw_nodes) {
+      return write(nodes.data(), nodes.size());
+    } else {
+      std::vector<node_record> records(nodes.size());
+      for (std::size_t i = 0; i < nodes.size(); ++i) {
+        const auto& n = nodes[i];
+        auto& r = records[i];
+        for (int a = 0; a < 3; ++a) {
+          r.box[a] = n.box.minimum[a];
+          r.box[3 + a] = n.box.maximum[a];
+        }
+        r.left_first = n.left_first;
+        r.count = n.count;
+        r.axis = n.axis;
+      }
+      return write(records);
+    }
+  }
+
+  void finish(const header& h)
+  {
+    out_.seekp(0);
+    out_.write(reinterpret_cast<const char*>(&h), sizeof(h));
+    out_.flush();
+    if (!out_)
+      throw scene_error("write error");
+  }
+
+private:
+  std::ofstream out_;
+};
+
+// Read-only view of a mapped file with bounds-checked sections.
+class reader
+{
+public:
+  explicit reader(const std::string& path)
+  try : file_(path.c_str(), bip::read_only), region_(file_, bip::read_only) {
+  } catch (const bip::interprocess_exception& e) {
+    throw scene_error("can not map " + path + ": " + e.what());
+  }
+
+  std::size_t size() const { return region_.get_size(); }
+  const char* data() const
+  {
+    return static_cast<const char*>(region_.get_address());
+  }
+
+  template<typename T>
+  const T* view(const section& s) const
+  {
+    if (s.offset % alignof(T) != 0 || s.offset > size() ||
+        s.count > (size() - s.offset) / sizeof(T))
+      throw scene_error("corrupt scene file");
+    return reinterpret_cast<const T*>(data() + s.offset);
+  }
+
+private:
+  bip::file_mapping file_;
+  bip::mapped_region region_;
+};
+
+void
+get_nodes(const reader& in, const section& s, std::vector<bvh_node>& nodes)
+{
+  if constexpr (raw_nodes) {
+    const auto* p = in.view<bvh_node>(s);
+    nodes.assign(p, p + s.count);
+  } else {
+    // Boxes are rounded outwards and still hold what they held.
+    auto const lower = [](double x) {
+      auto const f = static_cast<real>(x);
+      return f > x ? std::nextafter(f, -std::numeric_limits<real>::infinity())
+                   : f;
+    };
+    auto const upper = [](double x) {
+      auto const f = static_cast<real>(x);
+      return f < x ? std::nextafter(f, std::numeric_limits<real>::infinity())
+                   : f;
+    };
+
+    const auto* p = in.view<node_record>(s);
+    nodes.resize(s.count);
+    for (std::size_t i = 0; i < nodes.size(); ++i) {
+      const auto& r = p[i];
+      auto& n = nodes[i];
+      n.box = aabb(point3(lower(r.box[0]), lower(r.box[1]), lower(r.box[2])),
+                   point3(upper(r.box[3]), upper(r.box[4]), upper(r.box[5])));
+      n.left_first = r.left_first;
+      n.count = r.count;
+      n.axis = r.axis;
+    }
+  }
+}
+
+} // namespace binary
+
+// Validates what the renderer relies on in a hierarchy over n_prims
+// primitives of the named kind: child and primitive indices in range and no
+// deeper than the traversal stack.
+void
+check_hierarchy(const std::vector<bvh_node>& nodes,
+                std::size_t n_prims,
+                const std::string& kind)
+{
+  auto const n_nodes = nodes.size();
+  if (n_prims && 0 == n_nodes)
+    throw scene_error("corrupt " + kind + " data");
+
+  std::vector<unsigned char> depth(n_nodes, 1);
+  for (std::size_t i = 0; i < n_nodes; ++i) {
+    const auto& node = nodes[i];
+    if (node.is_leaf()) {
+      if (node.left_first + std::size_t{ node.count } > n_prims)
+        throw scene_error("corrupt " + kind + " hierarchy");
+    } else {
+      // Children always follow their parent.
+      if (node.left_first <= i || node.left_first + std::size_t{ 1 } >= n_nodes)
+        throw scene_error("corrupt " + kind + " hierarchy");
+      if (depth[i] >= bvh_max_depth)
+        throw scene_error(kind + " hierarchy is too deep");
+      depth[node.left_first] = depth[node.left_first + 1] = depth[i] + 1;
+    }
+  }
+}
+
+void
+check_soup(const sphere_soup& soup)
+{
+  auto const n_spheres = soup.size();
+  auto const padding = sphere_soup::padding;
+
+  if (soup.cx.size() != n_spheres + padding ||
+      soup.cy.size() != soup.cx.size() || soup.cz.size() != soup.cx.size() ||
+      soup.radius.size() != soup.cx.size())
+    throw scene_error("corrupt sphere data");
+
+  check_hierarchy(soup.nodes, n_spheres, "sphere");
+}
+
+void
+check_mesh(const triangle_mesh& mesh)
+{
+  auto const n_vertices = mesh.vertex_count();
+
+  if (mesh.positions.size() % 3 != 0 || mesh.indices.size() % 3 != 0 ||
+      (mesh.has_normals() && mesh.normals.size() != mesh.positions.size()) ||
+      (mesh.has_uvs() && mesh.uvs.size() != 2 * n_vertices))
+    throw scene_error("corrupt mesh data");
+  for (auto v : mesh.indices)
+    if (v >= n_vertices)
+      throw scene_error("corrupt mesh data");
+
+  check_hierarchy(mesh.nodes, mesh.size(), "mesh");
+}
+
+} // namespace
+
+scene
+load_scene(const std::string& path)
+{
+  char sig[sizeof(binary::signature)] = {};
+  std::ifstream in(path, std::ios::binary);
+  if (!in)
+    throw scene_error("can not open " + path);
+  in.read(sig, sizeof(sig));
+
+  if (0 == std::memcmp(sig, binary::signature, sizeof(sig)))
+    return load_scene_binary(path);
+  return load_scene_text(path);
+}
+
+scene
+load_scene_text(const std::string& path)
+{
+  text_reader in(read_file(path), path);
+
+  point3 lookfrom = default_lookfrom;
+  point3 lookto = default_lookto;
+  color background = default_background;
+  hittable_list world;
+  material_table materials;
+
+  std::unordered_map<std::string, shared_ptr<texture>> textures;
+  std::unordered_map<std::string, material_id> material_ids;
+  std::map<std::pair<std::string, material_id>, std::shared_ptr<triangle_mesh>>
+    meshes;
+
+  auto texture_named = [&](std::string_view name) {
+    auto it = textures.find(std::string(name));
+    if (it == textures.end())
+      in.fail("unknown texture '" + std::string(name) + "'");
+    return it->second;
+  };
+
+  while (in.next_statement()) {
+    auto const keyword = in.word();
+
+    if ("camera" == keyword) {
+      lookfrom = in.triple();
+      lookto = in.triple();
+    } else if ("background" == keyword) {
+      background = in.triple();
+    } else if ("texture" == keyword) {
+      std::string name(in.word());
+      auto const type = in.word();
+      shared_ptr<texture> t;
+      if ("solid" == type) {
+        t = make_shared<solid_color>(in.triple());
+      } else if ("checker" == type) {
+        auto even = texture_named(in.word());
+        auto odd = texture_named(in.word());
+        t = make_shared<checker_texture>(even, odd);
+      } else {
+        in.fail("unknown texture type '" + std::string(type) + "'");
+      }
+      textures[name] = t;
+    } else if ("material" == keyword) {
+      std::string name(in.word());
+      auto const type = in.word();
+      shared_ptr<material> m;
+      if ("lambertian" == type) {
+        m = make_shared<lambertian>(texture_named(in.word()));
+      } else if ("metal" == type) {
+        auto albedo = in.triple();
+        m = make_shared<metal>(albedo, in.number());
+      } else if ("dielectric" == type) {
+        auto b = in.triple();
+        auto c = in.triple();
+        m = make_shared<dielectric>(std::array<double, 3>{ b[0], b[1], b[2] },
+                                    std::array<double, 3>{ c[0], c[1], c[2] });
+      } else if ("light" == type) {
+        m = make_shared<diffuse_light>(texture_named(in.word()));
+      } else {
+        in.fail("unknown material type '" + std::string(type) + "'");
+      }
+      material_ids[name] = materials.add(m);
+    } else if ("mesh" == keyword) {
+      auto const file = resolve_path(path, in.word());
+      auto name = in.word();
+      auto m = material_ids.find(std::string(name));
+      if (m == material_ids.end())
+        in.fail("unknown material '" + std::string(name) + "'");
+      // Every statement naming the same file with the same material places
+      // one more instance of a single mesh.
+      auto& mesh = meshes[{ file, m->second }];
+      if (!mesh)
+        mesh = load_obj(file, m->second);
+      world.add(read_transforms(in, mesh));
+    } else {
+      auto const kw = std::find(
+        std::begin(shape_keywords), std::end(shape_keywords), keyword);
+      if (kw == std::end(shape_keywords))
+        in.fail("unknown statement '" + std::string(keyword) + "'");
+      auto const type = static_cast<std::size_t>(kw - shape_keywords);
+
+      double p[6] = {};
+      for (int i = 0; i < shape_params[type]; ++i)
+        p[i] = in.number();
+
+      auto name = in.word();
+      auto m = material_ids.find(std::string(name));
+      if (m == material_ids.end())
+        in.fail("unknown material '" + std::string(name) + "'");
+
+      world.add(read_transforms(
+        in, make_shape(static_cast<shape_type>(type), m->second, p)));
+    }
+
+    in.end_statement();
+  }
+
+  return scene{ background, lookfrom, lookto, world, materials };
+}
+
+void
+save_scene_text(const scene& s, const std::string& path)
+{
+  auto flat = flatten(s, false);
+
+  std::ofstream out(path);
+  if (!out)
+    throw scene_error("can not write " + path);
+
+  out << "camera " << to_text(s.lookfrom_) << "  " << to_text(s.lookto_)
+      << '\n';
+  out << "background " << to_text(s.background_) << "\n\n";
+
+  for (std::size_t i = 0; i < flat.textures.size(); ++i) {
+    const texture* t = flat.textures[i];
+    out << "texture t" << i;
+    if (auto c = dynamic_cast<const checker_texture*>(t))
+      out << " checker t" << flat.texture_ids[c->even.get()] << " t"
+          << flat.texture_ids[c->odd.get()] << '\n';
+    else
+      out << " solid "
+          << to_text(static_cast<const solid_color*>(t)->color_value) << '\n';
+  }
+
+  for (material_id i = 0; i < s.materials_->size(); ++i) {
+    const material* m = &(*s.materials_)[i];
+    out << "material m" << i;
+    if (auto l = dynamic_cast<const lambertian*>(m)) {
+      out << " lambertian t" << flat.texture_ids[l->albedo.get()];
+    } else if (auto mt = dynamic_cast<const metal*>(m)) {
+      out << " metal " << to_text(mt->albedo) << ' ' << to_text(mt->fuzz);
+    } else if (auto d = dynamic_cast<const dielectric*>(m)) {
+      out << " dielectric";
+      for (double b : d->b_)
+        out << ' ' << to_text(b);
+      for (double c : d->c_)
+        out << ' ' << to_text(c);
+    } else if (auto l = dynamic_cast<const diffuse_light*>(m)) {
+      out << " light t" << flat.texture_ids[l->emitt.get()];
+    }
+    out << '\n';
+  }
+  out << '\n';
+
+  for (const auto& shape : flat.shapes) {
+    auto const type = static_cast<std::size_t>(shape.type);
+    out << shape_keywords[type];
+    for (int i = 0; i < shape_params[type]; ++i)
+      out << ' ' << to_text(shape.p[i]);
+    out << " m" << shape.mat;
+    write_transforms(out, shape.ops);
+    out << '\n';
+  }
+
+  // Instances of one mesh refer to one file.
+  std::unordered_map<const triangle_mesh*, std::string> files;
+  for (auto const& m : flat.meshes) {
+    auto [it, first] = files.emplace(m.mesh, std::string());
+    if (first) {
+      auto const file = path + '.' + std::to_string(files.size() - 1) + ".obj";
+      save_obj(*m.mesh, file);
+      it->second = file.substr(file.find_last_of('/') + 1);
+    }
+    out << "mesh " << it->second << " m" << m.mesh->mat_id;
+    write_transforms(out, m.ops);
+    out << '\n';
+  }
+
+  if (!out)
+    throw scene_error("write error");
+}
+
+scene
+load_scene_binary(const std::string& path)
+{
+  binary::reader in(path);
+
+  if (in.size() < binary::header_v1_size)
+    throw scene_error("corrupt scene file");
+  binary::header h{};
+  std::memcpy(&h, in.data(), std::min(in.size(), sizeof(h)));
+  if (0 != std::memcmp(h.signature, binary::signature, sizeof(h.signature)) ||
+      binary::byte_order != h.byte_order)
+    throw scene_error("not a scene file");
+  if (h.version < 1 || h.version > binary::version)
+    throw scene_error("unsupported scene file version " +
+                      std::to_string(h.version));
+  if (1 == h.version)
+    h.meshes = binary::section{};
+
+  auto const* texture_records = in.view<binary::texture_record>(h.textures);
+  std::vector<shared_ptr<texture>> textures;
+  for (std::size_t i = 0; i < h.textures.count; ++i) {
+    const auto& r = texture_records[i];
+    if (texture_type::solid == r.type) {
+      textures.push_back(make_shared<solid_color>(binary::get(r.color)));
+    } else if (texture_type::checker == r.type && r.even < i && r.odd < i) {
+      textures.push_back(
+        make_shared<checker_texture>(textures[r.even], textures[r.odd]));
+    } else {
+      throw scene_error("corrupt texture record");
+    }
+  }
+
+  auto const* material_records =
+    in.view<binary::material_record>(h.materials);
+  material_table materials;
+  for (std::size_t i = 0; i < h.materials.count; ++i) {
+    const auto& r = material_records[i];
+    bool const textured = material_type::lambertian == r.type ||
+                          material_type::light == r.type;
+    if (textured && r.texture >= textures.size())
+      throw scene_error("corrupt material record");
+
+    switch (r.type) {
+      case material_type::lambertian:
+        materials.add(make_shared<lambertian>(textures[r.texture]));
+        break;
+      case material_type::metal:
+        materials.add(make_shared<metal>(binary::get(r.color), r.fuzz));
+        break;
+      case material_type::dielectric:
+        materials.add(make_shared<dielectric>(
+          std::array<double, 3>{ r.b[0], r.b[1], r.b[2] },
+          std::array<double, 3>{ r.c[0], r.c[1], r.c[2] }));
+        break;
+      case material_type::light:
+        materials.add(make_shared<diffuse_light>(textures[r.texture]));
+        break;
+      default:
+        throw scene_error("corrupt material record");
+    }
+  }
+
+  hittable_list world;
+
+  auto copy = [&in](auto& v, const binary::section& s) {
+    using T = typename std::remove_reference_t<decltype(v)>::value_type;
+    const T* p = in.view<T>(s);
+    v.assign(p, p + s.count);
+  };
+
+  auto const n_spheres = h.soup_materials.count;
+  auto copy_soup = [&in, n_spheres](std::vector<real>& v,
+                                    const binary::section& s) {
+    if (s.count != n_spheres + binary::soup_padding)
+      throw scene_error("corrupt sphere data");
+    const double* p = in.view<double>(s);
+    v.assign(p, p + n_spheres);
+    v.resize(n_spheres + sphere_soup::padding, 0);
+  };
+
+  if (0 != n_spheres) {
+    auto soup = make_shared<sphere_soup>();
+    binary::get_nodes(in, h.soup_nodes, soup->nodes);
+    copy_soup(soup->cx, h.soup_cx);
+    copy_soup(soup->cy, h.soup_cy);
+    copy_soup(soup->cz, h.soup_cz);
+    copy_soup(soup->radius, h.soup_radius);
+    copy(soup->materials, h.soup_materials);
+    check_soup(*soup);
+    for (auto m : soup->materials)
+      if (m >= materials.size())
+        throw scene_error("corrupt sphere data");
+    world.add(soup);
+  }
+
+  auto const* shapes = in.view<binary::shape_record>(h.shapes);
+  auto const* transforms = in.view<binary::transform_record>(h.transforms);
+  for (std::size_t i = 0; i < h.shapes.count; ++i) {
+    const auto& r = shapes[i];
+    if (r.material >= materials.size() ||
+        r.first_transform > h.transforms.count ||
+        r.transform_count > h.transforms.count - r.first_transform)
+      throw scene_error("corrupt object record");
+
+    auto object = make_shape(r.type, r.material, r.p);
+    if (0 != r.transform_count)
+      object = transformed(
+        object,
+        binary::get_transforms(transforms + r.first_transform,
+                               r.transform_count));
+    world.add(object);
+  }
+
+  // Meshes by the offset of their positions: records sharing a mesh share
+  // that section.
+  std::unordered_map<std::uint64_t, shared_ptr<triangle_mesh>> loaded;
+
+  auto const* meshes = in.view<binary::mesh_record>(h.meshes);
+  for (std::size_t i = 0; i < h.meshes.count; ++i) {
+    const auto& r = meshes[i];
+    if (r.material >= materials.size() ||
+        r.first_transform > h.transforms.count ||
+        r.transform_count > h.transforms.count - r.first_transform)
+      throw scene_error("corrupt mesh record");
+
+    auto& mesh = loaded[r.positions.offset];
+    if (!mesh || mesh->mat_id != r.material) {
+      mesh = make_shared<triangle_mesh>(r.material);
+      binary::get_nodes(in, r.nodes, mesh->nodes);
+      copy(mesh->positions, r.positions);
+      copy(mesh->normals, r.normals);
+      copy(mesh->uvs, r.uvs);
+      copy(mesh->indices, r.indices);
+      check_mesh(*mesh);
+    }
+
+    shared_ptr<hittable> object = mesh;
+    if (0 != r.transform_count)
+      object = transformed(
+        object,
+        binary::get_transforms(transforms + r.first_transform,
+                               r.transform_count));
+    world.add(object);
+  }
+
+  return scene{ binary::get(h.background),
+                binary::get(h.lookfrom),
+                binary::get(h.lookto),
+                world,
+                materials };
+}
+
+void
+save_scene_binary(const scene& s, const std::string& path)
+{
+  auto flat = flatten(s, true);
+
+  // A single soup is written as it is; otherwise one is built for all the
+  // untransformed spheres.
+  sphere_soup packed;
+  const sphere_soup* soup = nullptr;
+  if (flat.spheres.empty() && 1 == flat.soups.size()) {
+    soup = flat.soups.front();
+  } else if (!flat.spheres.empty() || !flat.soups.empty()) {
+    for (auto sp : flat.spheres)
+      packed.add(sp->center, sp->radius, sp->mat_id);
+    for (auto so : flat.soups)
+      for (std::size_t i = 0; i < so->size(); ++i)
+        packed.add(point3(so->cx[i], so->cy[i], so->cz[i]),
+                   so->radius[i],
+                   so->materials[i]);
+    packed.build();
+    soup = &packed;
+  }
+
+  std::vector<binary::texture_record> textures;
+  for (const texture* t : flat.textures) {
+    binary::texture_record r{};
+    if (auto c = dynamic_cast<const checker_texture*>(t)) {
+      r.type = texture_type::checker;
+      r.even = flat.texture_ids[c->even.get()];
+      r.odd = flat.texture_ids[c->odd.get()];
+    } else {
+      r.type = texture_type::solid;
+      binary::put(r.color, static_cast<const solid_color*>(t)->color_value);
+    }
+    textures.push_back(r);
+  }
+
+  std::vector<binary::material_record> materials;
+  for (material_id i = 0; i < s.materials_->size(); ++i) {
+    const material* m = &(*s.materials_)[i];
+    binary::material_record r{};
+    if (auto l = dynamic_cast<const lambertian*>(m)) {
+      r.type = material_type::lambertian;
+      r.texture = flat.texture_ids[l->albedo.get()];
+    } else if (auto mt = dynamic_cast<const metal*>(m)) {
+      r.type = material_type::metal;
+      binary::put(r.color, mt->albedo);
+      r.fuzz = mt->fuzz;
+    } else if (auto d = dynamic_cast<const dielectric*>(m)) {
+      r.type = material_type::dielectric;
+      std::copy(d->b_.begin(), d->b_.end(), r.b);
+      std::copy(d->c_.begin(), d->c_.end(), r.c);
+    } else if (auto l = dynamic_cast<const diffuse_light*>(m)) {
+      r.type = material_type::light;
+      r.texture = flat.texture_ids[l->emitt.get()];
+    }
+    materials.push_back(r);
+  }
+
+  std::vector<binary::shape_record> shapes;
+  std::vector<binary::transform_record> transforms;
+  for (const auto& shape : flat.shapes) {
+    binary::shape_record r{};
+    r.type = shape.type;
+    r.material = shape.mat;
+    r.first_transform = static_cast<std::uint32_t>(transforms.size());
+    std::copy(shape.p, shape.p + 6, r.p);
+    binary::put_transforms(transforms, shape.ops);
+    r.transform_count =
+      static_cast<std::uint32_t>(transforms.size() - r.first_transform);
+    shapes.push_back(r);
+  }
+
+  // Mesh arrays are written after the records, which are completed then.
+  std::vector<binary::mesh_record> meshes;
+  for (const auto& desc : flat.meshes) {
+    binary::mesh_record r{};
+    r.material = desc.mesh->mat_id;
+    r.first_transform = static_cast<std::uint32_t>(transforms.size());
+    binary::put_transforms(transforms, desc.ops);
+    r.transform_count =
+      static_cast<std::uint32_t>(transforms.size() - r.first_transform);
+    meshes.push_back(r);
+  }
+
+  binary::header h{};
+  std::memcpy(h.signature, binary::signature, sizeof(h.signature));
+  h.version = binary::version;
+  h.byte_order = binary::byte_order;
+  binary::put(h.background, s.background_);
+  binary::put(h.lookfrom, s.lookfrom_);
+  binary::put(h.lookto, s.lookto_);
+
+  binary::writer out(path);
+  out.reserve(sizeof(h));
+  h.textures = out.write(textures);
+  h.materials = out.write(materials);
+  h.shapes = out.write(shapes);
+  h.transforms = out.write(transforms);
+  if (soup) {
+    auto stored = [n = soup->size()](const std::vector<real>& v) {
+      std::vector<double> d(v.begin(), v.begin() + n);
+      d.resize(n + binary::soup_padding, 0.0);
+      return d;
+    };
+    h.soup_nodes = out.write(soup->nodes);
+    h.soup_cx = out.write(stored(soup->cx));
+    h.soup_cy = out.write(stored(soup->cy));
+    h.soup_cz = out.write(stored(soup->cz));
+    h.soup_radius = out.write(stored(soup->radius));
+    h.soup_materials = out.write(soup->materials);
+  }
+  // Every mesh is written once, whatever the number of its instances.
+  std::unordered_map<const triangle_mesh*, std::size_t> written;
+  for (std::size_t i = 0; i < meshes.size(); ++i) {
+    const auto* mesh = flat.meshes[i].mesh;
+    auto [it, first] = written.emplace(mesh, i);
+    if (!first) {
+      auto const& r = meshes[it->second];
+      meshes[i].nodes = r.nodes;
+      meshes[i].positions = r.positions;
+      meshes[i].normals = r.normals;
+      meshes[i].uvs = r.uvs;
+      meshes[i].indices = r.indices;
+      continue;
+    }
+    meshes[i].nodes = out.write(mesh->nodes);
+    meshes[i].positions = out.write(mesh->positions);
+    meshes[i].normals = out.write(mesh->normals);
+    meshes[i].uvs = out.write(mesh->uvs);
+    meshes[i].indices = out.write(mesh->indices);
+  }
+  h.meshes = out.write(meshes);
+  out.finish(h);
+}
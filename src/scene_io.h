@@ -0,0 +1,69 @@
+#pragma once
+
+#include <stdexcept>
+#include <string>
+
+#include "scene.h"
+
+// Scene files come in two forms with the same content: camera, background,
+// textures, materials and objects (spheres, boxes, axis-aligned rectangles,
+// triangle meshes, each optionally placed by an affine transform).
+//
+// The text form is meant to be written by hand, one statement per line:
+//
+//   # comment
+//   camera <from x y z> <at x y z>
+//   background <r g b>
+//   texture <name> solid <r g b>
+//   texture <name> checker <even texture> <odd texture>
+//   material <name> lambertian <texture>
+//   material <name> metal <r g b> <fuzz>
+//   material <name> dielectric <b1 b2 b3> <c1 c2 c3>
+//   material <name> light <texture>
+//   sphere <x y z> <radius> <material> [transform ...]
+//   box <x0 y0 z0> <x1 y1 z1> <material> [transform ...]
+//   xy_rect <x0 x1> <y0 y1> <z> <material> [transform ...]
+//   xz_rect <x0 x1> <z0 z1> <y> <material> [transform ...]
+//   yz_rect <y0 y1> <z0 z1> <x> <material> [transform ...]
+//   mesh <file.obj> <material> [transform ...]
+//
+// where a transform is one of
+//
+//   rotate_y <degrees>
+//   rotate <axis x y z> <degrees>
+//   scale <sx sy sz>
+//   translate <dx dy dz>
+//   matrix <a11 a12 a13 b1 a21 a22 a23 b2 a31 a32 a33 b3>
+//
+// applied from left to right; `matrix` maps x to A x + b. Names must be
+// defined before they are used. Mesh files are looked up next to the scene
+// file unless their path is absolute. Statements naming the same file and
+// material are instances of one mesh, kept in memory once; saving writes
+// every distinct mesh to <scene file>.<number>.obj.
+//
+// The binary form is memory-mapped on loading. Untransformed spheres are
+// stored as one sphere_soup, hierarchy included, and triangle meshes are
+// stored with their hierarchies too, once however many instances refer to
+// them; both are loaded by copying whole arrays. Other objects are few and
+// read record by record.
+
+// Thrown for unreadable or malformed scene files.
+class scene_error : public std::runtime_error
+{
+public:
+  using std::runtime_error::runtime_error;
+};
+
+// Loads either form, telling them apart by the signature of the binary one.
+scene
+load_scene(const std::string& path);
+
+scene
+load_scene_text(const std::string& path);
+scene
+load_scene_binary(const std::string& path);
+
+void
+save_scene_text(const scene& s, const std::string& path);
+void
+save_scene_binary(const scene& s, const std::string& path);
@@ -6,15 +6,34 @@ public:
   settings_render(unsigned width,
                   unsigned height,
                   unsigned ray_pp,
-                  double camera_canvas)
+                  double camera_canvas,
+                  unsigned max_depth = 50,
+                  unsigned rr_depth = 3)
     : width_{ width }
     , height_{ height }
     , ray_pp_{ ray_pp }
     , camera_canvas_{ camera_canvas }
+    , max_depth_{ max_depth }
+    , rr_depth_{ rr_depth }
   {}
 
   unsigned width_ = 0;
   unsigned height_ = 0;
   unsigned ray_pp_ = 100;
   double camera_canvas_ = 1.0;
+  // Upper bound of bounces per path.
+  unsigned max_depth_ = 50;
+  // Bounces after which paths are subject to Russian roulette.
+  unsigned rr_depth_ = 3;
+  // Trace camera rays of neighbouring pixels as SIMD packets.
+  bool packets_ = true;
+  // Render threads; 0 leaves the choice to OpenMP.
+  unsigned threads_ = 0;
+  // Adaptive sampling: a pixel stops taking samples once its noise and that
+  // of its neighbours, in display units (see framebuffer::noise), is below
+  // this. ray_pp_ then is the average budget, and noisy pixels may get up to
+  // four times as many samples. 0 samples every pixel ray_pp_ times.
+  double noise_threshold_ = 0.0;
+  // Run the published images through the edge-aware denoiser.
+  bool denoise_ = false;
 };
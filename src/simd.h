@@ -0,0 +1,458 @@
+#pragma once
+
+#include <cmath>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Four double lanes. Backed by one AVX register, a pair of SSE2 registers, or
+// plain arrays on other targets; kernels are written once against this type.
+// Comparisons return masks of the same type: all bits set in true lanes.
+struct vdouble4
+{
+  static constexpr int lanes = 4;
+
+#if defined(__AVX__)
+  __m256d v;
+
+  vdouble4() {}
+  vdouble4(__m256d x)
+    : v(x)
+  {}
+  vdouble4(double x)
+    : v(_mm256_set1_pd(x))
+  {}
+
+  static vdouble4 load(const double* p) { return _mm256_loadu_pd(p); }
+  void store(double* p) const { _mm256_storeu_pd(p, v); }
+
+  // Bit i is set if lane i of the mask is true.
+  int movemask() const { return _mm256_movemask_pd(v); }
+#elif defined(__SSE2__)
+  __m128d lo, hi;
+
+  vdouble4() {}
+  vdouble4(__m128d l, __m128d h)
+    : lo(l)
+    , hi(h)
+  {}
+  vdouble4(double x)
+    : lo(_mm_set1_pd(x))
+    , hi(_mm_set1_pd(x))
+  {}
+
+  static vdouble4 load(const double* p)
+  {
+    return { _mm_loadu_pd(p), _mm_loadu_pd(p + 2) };
+  }
+  void store(double* p) const
+  {
+    _mm_storeu_pd(p, lo);
+    _mm_storeu_pd(p + 2, hi);
+  }
+
+  int movemask() const
+  {
+    return _mm_movemask_pd(lo) | (_mm_movemask_pd(hi) << 2);
+  }
+#else
+  double e[4];
+
+  vdouble4() {}
+  vdouble4(double x)
+    : e{ x, x, x, x }
+  {}
+
+  static vdouble4 load(const double* p)
+  {
+    vdouble4 r;
+    for (int i = 0; i < 4; ++i)
+      r.e[i] = p[i];
+    return r;
+  }
+  void store(double* p) const
+  {
+    for (int i = 0; i < 4; ++i)
+      p[i] = e[i];
+  }
+
+  int movemask() const
+  {
+    int m = 0;
+    for (int i = 0; i < 4; ++i)
+      m |= (std::signbit(e[i]) ? 1 : 0) << i;
+    return m;
+  }
+#endif
+};
+
+#if defined(__AVX__)
+
+inline vdouble4
+operator+(vdouble4 a, vdouble4 b)
+{
+  return _mm256_add_pd(a.v, b.v);
+}
+inline vdouble4
+operator-(vdouble4 a, vdouble4 b)
+{
+  return _mm256_sub_pd(a.v, b.v);
+}
+inline vdouble4
+operator*(vdouble4 a, vdouble4 b)
+{
+  return _mm256_mul_pd(a.v, b.v);
+}
+inline vdouble4
+operator/(vdouble4 a, vdouble4 b)
+{
+  return _mm256_div_pd(a.v, b.v);
+}
+inline vdouble4
+min(vdouble4 a, vdouble4 b)
+{
+  return _mm256_min_pd(a.v, b.v);
+}
+inline vdouble4
+max(vdouble4 a, vdouble4 b)
+{
+  return _mm256_max_pd(a.v, b.v);
+}
+inline vdouble4
+sqrt(vdouble4 a)
+{
+  return _mm256_sqrt_pd(a.v);
+}
+inline vdouble4
+operator<(vdouble4 a, vdouble4 b)
+{
+  return _mm256_cmp_pd(a.v, b.v, _CMP_LT_OQ);
+}
+inline vdouble4
+operator<=(vdouble4 a, vdouble4 b)
+{
+  return _mm256_cmp_pd(a.v, b.v, _CMP_LE_OQ);
+}
+inline vdouble4
+operator&(vdouble4 a, vdouble4 b)
+{
+  return _mm256_and_pd(a.v, b.v);
+}
+inline vdouble4
+operator|(vdouble4 a, vdouble4 b)
+{
+  return _mm256_or_pd(a.v, b.v);
+}
+// Lanes of a where the mask is set, lanes of b elsewhere.
+inline vdouble4
+select(vdouble4 mask, vdouble4 a, vdouble4 b)
+{
+  return _mm256_blendv_pd(b.v, a.v, mask.v);
+}
+
+#elif defined(__SSE2__)
+
+#define VDOUBLE4_BINARY(fn, intrinsic)                                         \
+  inline vdouble4 fn(vdouble4 a, vdouble4 b)                                   \
+  {                                                                            \
+    return { intrinsic(a.lo, b.lo), intrinsic(a.hi, b.hi) };                   \
+  }
+
+VDOUBLE4_BINARY(operator+, _mm_add_pd)
+VDOUBLE4_BINARY(operator-, _mm_sub_pd)
+VDOUBLE4_BINARY(operator*, _mm_mul_pd)
+VDOUBLE4_BINARY(operator/, _mm_div_pd)
+VDOUBLE4_BINARY(min, _mm_min_pd)
+VDOUBLE4_BINARY(max, _mm_max_pd)
+VDOUBLE4_BINARY(operator<, _mm_cmplt_pd)
+VDOUBLE4_BINARY(operator<=, _mm_cmple_pd)
+VDOUBLE4_BINARY(operator&, _mm_and_pd)
+VDOUBLE4_BINARY(operator|, _mm_or_pd)
+
+#undef VDOUBLE4_BINARY
+
+inline vdouble4
+sqrt(vdouble4 a)
+{
+  return { _mm_sqrt_pd(a.lo), _mm_sqrt_pd(a.hi) };
+}
+inline vdouble4
+select(vdouble4 mask, vdouble4 a, vdouble4 b)
+{
+  return { _mm_or_pd(_mm_and_pd(mask.lo, a.lo), _mm_andnot_pd(mask.lo, b.lo)),
+           _mm_or_pd(_mm_and_pd(mask.hi, a.hi), _mm_andnot_pd(mask.hi, b.hi)) };
+}
+
+#else
+
+#define VDOUBLE4_BINARY(fn, expr)                                              \
+  inline vdouble4 fn(vdouble4 a, vdouble4 b)                                   \
+  {                                                                            \
+    vdouble4 r;                                                                \
+    for (int i = 0; i < 4; ++i) {                                              \
+      double x = a.e[i], y = b.e[i];                                           \
+      r.e[i] = (expr);                                                         \
+    }                                                                          \
+    return r;                                                                  \
+  }
+
+// Masks are -0.0 (sign bit set) in true lanes and +0.0 in false ones.
+VDOUBLE4_BINARY(operator+, x + y)
+VDOUBLE4_BINARY(operator-, x - y)
+VDOUBLE4_BINARY(operator*, x* y)
+VDOUBLE4_BINARY(operator/, x / y)
+VDOUBLE4_BINARY(min, x < y ? x : y)
+VDOUBLE4_BINARY(max, x > y ? x : y)
+VDOUBLE4_BINARY(operator<, x < y ? -0.0 : 0.0)
+VDOUBLE4_BINARY(operator<=, x <= y ? -0.0 : 0.0)
+VDOUBLE4_BINARY(operator&, std::signbit(x) && std::signbit(y) ? -0.0 : 0.0)
+VDOUBLE4_BINARY(operator|, std::signbit(x) || std::signbit(y) ? -0.0 : 0.0)
+
+#undef VDOUBLE4_BINARY
+
+inline vdouble4
+sqrt(vdouble4 a)
+{
+  vdouble4 r;
+  for (int i = 0; i < 4; ++i)
+    r.e[i] = std::sqrt(a.e[i]);
+  return r;
+}
+inline vdouble4
+select(vdouble4 mask, vdouble4 a, vdouble4 b)
+{
+  vdouble4 r;
+  for (int i = 0; i < 4; ++i)
+    r.e[i] = std::signbit(mask.e[i]) ? a.e[i] : b.e[i];
+  return r;
+}
+
+#endif
+
+// Eight float lanes, in the same 256 bits as vdouble4 and with the same
+// operations: one AVX register, a pair of SSE registers, or plain arrays.
+// Kernels over single-precision data use it to test twice as many
+// primitives per instruction.
+struct vfloat8
+{
+  static constexpr int lanes = 8;
+
+#if defined(__AVX__)
+  __m256 v;
+
+  vfloat8() {}
+  vfloat8(__m256 x)
+    : v(x)
+  {}
+  vfloat8(float x)
+    : v(_mm256_set1_ps(x))
+  {}
+
+  static vfloat8 load(const float* p) { return _mm256_loadu_ps(p); }
+  void store(float* p) const { _mm256_storeu_ps(p, v); }
+
+  // Bit i is set if lane i of the mask is true.
+  int movemask() const { return _mm256_movemask_ps(v); }
+#elif defined(__SSE2__)
+  __m128 lo, hi;
+
+  vfloat8() {}
+  vfloat8(__m128 l, __m128 h)
+    : lo(l)
+    , hi(h)
+  {}
+  vfloat8(float x)
+    : lo(_mm_set1_ps(x))
+    , hi(_mm_set1_ps(x))
+  {}
+
+  static vfloat8 load(const float* p)
+  {
+    return { _mm_loadu_ps(p), _mm_loadu_ps(p + 4) };
+  }
+  void store(float* p) const
+  {
+    _mm_storeu_ps(p, lo);
+    _mm_storeu_ps(p + 4, hi);
+  }
+
+  int movemask() const
+  {
+    return _mm_movemask_ps(lo) | (_mm_movemask_ps(hi) << 4);
+  }
+#else
+  float e[8];
+
+  vfloat8() {}
+  vfloat8(float x)
+    : e{ x, x, x, x, x, x, x, x }
+  {}
+
+  static vfloat8 load(const float* p)
+  {
+    vfloat8 r;
+    for (int i = 0; i < 8; ++i)
+      r.e[i] = p[i];
+    return r;
+  }
+  void store(float* p) const
+  {
+    for (int i = 0; i < 8; ++i)
+      p[i] = e[i];
+  }
+
+  int movemask() const
+  {
+    int m = 0;
+    for (int i = 0; i < 8; ++i)
+      m |= (std::signbit(e[i]) ? 1 : 0) << i;
+    return m;
+  }
+#endif
+};
+
+#if defined(__AVX__)
+
+inline vfloat8
+operator+(vfloat8 a, vfloat8 b)
+{
+  return _mm256_add_ps(a.v, b.v);
+}
+inline vfloat8
+operator-(vfloat8 a, vfloat8 b)
+{
+  return _mm256_sub_ps(a.v, b.v);
+}
+inline vfloat8
+operator*(vfloat8 a, vfloat8 b)
+{
+  return _mm256_mul_ps(a.v, b.v);
+}
+inline vfloat8
+operator/(vfloat8 a, vfloat8 b)
+{
+  return _mm256_div_ps(a.v, b.v);
+}
+inline vfloat8
+min(vfloat8 a, vfloat8 b)
+{
+  return _mm256_min_ps(a.v, b.v);
+}
+inline vfloat8
+max(vfloat8 a, vfloat8 b)
+{
+  return _mm256_max_ps(a.v, b.v);
+}
+inline vfloat8
+sqrt(vfloat8 a)
+{
+  return _mm256_sqrt_ps(a.v);
+}
+inline vfloat8
+operator<(vfloat8 a, vfloat8 b)
+{
+  return _mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ);
+}
+inline vfloat8
+operator<=(vfloat8 a, vfloat8 b)
+{
+  return _mm256_cmp_ps(a.v, b.v, _CMP_LE_OQ);
+}
+inline vfloat8
+operator&(vfloat8 a, vfloat8 b)
+{
+  return _mm256_and_ps(a.v, b.v);
+}
+inline vfloat8
+operator|(vfloat8 a, vfloat8 b)
+{
+  return _mm256_or_ps(a.v, b.v);
+}
+// Lanes of a where the mask is set, lanes of b elsewhere.
+inline vfloat8
+select(vfloat8 mask, vfloat8 a, vfloat8 b)
+{
+  return _mm256_blendv_ps(b.v, a.v, mask.v);
+}
+
+#elif defined(__SSE2__)
+
+#define VFLOAT8_BINARY(fn, intrinsic)                                          \
+  inline vfloat8 fn(vfloat8 a, vfloat8 b)                                      \
+  {                                                                            \
+    return { intrinsic(a.lo, b.lo), intrinsic(a.hi, b.hi) };                   \
+  }
+
+VFLOAT8_BINARY(operator+, _mm_add_ps)
+VFLOAT8_BINARY(operator-, _mm_sub_ps)
+VFLOAT8_BINARY(operator*, _mm_mul_ps)
+VFLOAT8_BINARY(operator/, _mm_div_ps)
+VFLOAT8_BINARY(min, _mm_min_ps)
+VFLOAT8_BINARY(max, _mm_max_ps)
+VFLOAT8_BINARY(operator<, _mm_cmplt_ps)
+VFLOAT8_BINARY(operator<=, _mm_cmple_ps)
+VFLOAT8_BINARY(operator&, _mm_and_ps)
+VFLOAT8_BINARY(operator|, _mm_or_ps)
+
+#undef VFLOAT8_BINARY
+
+inline vfloat8
+sqrt(vfloat8 a)
+{
+  return { _mm_sqrt_ps(a.lo), _mm_sqrt_ps(a.hi) };
+}
+inline vfloat8
+select(vfloat8 mask, vfloat8 a, vfloat8 b)
+{
+  return { _mm_or_ps(_mm_and_ps(mask.lo, a.lo), _mm_andnot_ps(mask.lo, b.lo)),
+           _mm_or_ps(_mm_and_ps(mask.hi, a.hi), _mm_andnot_ps(mask.hi, b.hi)) };
+}
+
+#else
+
+#define VFLOAT8_BINARY(fn, expr)                                               \
+  inline vfloat8 fn(vfloat8 a, vfloat8 b)                                      \
+  {                                                                            \
+    vfloat8 r;                                                                 \
+    for (int i = 0; i < 8; ++i) {                                              \
+      float x = a.e[i], y = b.e[i];                                            \
+      r.e[i] = (expr);                                                         \
+    }                                                                          \
+    return r;                                                                  \
+  }
+
+// Masks are -0.0f (sign bit set) in true lanes and +0.0f in false ones.
+VFLOAT8_BINARY(operator+, x + y)
+VFLOAT8_BINARY(operator-, x - y)
+VFLOAT8_BINARY(operator*, x* y)
+VFLOAT8_BINARY(operator/, x / y)
+VFLOAT8_BINARY(min, x < y ? x : y)
+VFLOAT8_BINARY(max, x > y ? x : y)
+VFLOAT8_BINARY(operator<, x < y ? -0.0f : 0.0f)
+VFLOAT8_BINARY(operator<=, x <= y ? -0.0f : 0.0f)
+VFLOAT8_BINARY(operator&, std::signbit(x) && std::signbit(y) ? -0.0f : 0.0f)
+VFLOAT8_BINARY(operator|, std::signbit(x) || std::signbit(y) ? -0.0f : 0.0f)
+
+#undef VFLOAT8_BINARY
+
+inline vfloat8
+sqrt(vfloat8 a)
+{
+  vfloat8 r;
+  for (int i = 0; i < 8; ++i)
+    r.e[i] = std::sqrt(a.e[i]);
+  return r;
+}
+inline vfloat8
+select(vfloat8 mask, vfloat8 a, vfloat8 b)
+{
+  vfloat8 r;
+  for (int i = 0; i < 8; ++i)
+    r.e[i] = std::signbit(mask.e[i]) ? a.e[i] : b.e[i];
+  return r;
+}
+
+#endif
@@ -0,0 +1,48 @@
+#pragma once
+
+#include "ray.h"
+
+// Wavelength bands, in micrometres, that the colour channels stand for when
+// a bundle is split at a dispersive surface.
+struct wavelength_band
+{
+  double lo;
+  double hi;
+};
+
+constexpr wavelength_band
+channel_band(RGB const rgb)
+{
+  switch (rgb) {
+    case RGB::R:
+      return { 0.630, 0.780 };
+    case RGB::G:
+      return { 0.510, 0.550 };
+    default:
+      return { 0.450, 0.480 };
+  }
+}
+
+// Shortest and longest wavelengths any band reaches.
+constexpr double min_wavelength = 0.450;
+constexpr double max_wavelength = 0.780;
+
+// Wavelength of the channel's band for a uniform number u in [0, 1): bands
+// are sampled uniformly and continuously.
+inline double
+sample_wavelength(RGB const rgb, double u)
+{
+  auto const band = channel_band(rgb);
+  return band.lo + u * (band.hi - band.lo);
+}
+
+// Wavelength a ray stands for: the one drawn for it, or the middle of the
+// band of its first channel while none was drawn.
+inline double
+ray_wavelength(const ray& r)
+{
+  if (r.wavelength_ > 0)
+    return r.wavelength_;
+  auto const band = channel_band(r.rgb());
+  return 0.5 * (band.lo + band.hi);
+}
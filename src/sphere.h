@@ -1,16 +1,22 @@
 #pragma once
 
+#include <sstream>
+#include <string>
+
 #include "hittable.h"
+#include "material.h"
+#include "onb.h"
+#include "simd.h"
 #include "vec3.h"
 
 class sphere : public hittable
 {
 public:
   sphere() {}
-  sphere(point3 cen, double r, shared_ptr<material> m)
+  sphere(point3 cen, double r, material_id m)
     : center(cen)
     , radius(r)
-    , mat_ptr(m){};
+    , mat_id(m){};
 
   bool hit(const ray& r,
            double t_min,
@@ -18,23 +24,35 @@ public:
            hit_record& rec) const override;
   bool bounding_box(aabb& output_box) const override;
 
-  std::string about() const override
+  int hit_packet(const ray_packet& rp,
+                 int active,
+                 double t_min,
+                 double* t_max,
+                 hit_record* rec) const override;
+
+  bool is_light(const material_table& materials) const override
   {
-    return QString{ "Шар с центром (%1, %2, %3), r = %4; Материал: %5" }
-      .arg(center.e[0])
-      .arg(center.e[1])
-      .arg(center.e[2])
-      .arg(radius)
-      .arg(QString::fromStdString(mat_ptr->about()))
-      .toStdString();
+    return materials[mat_id].emissive();
+  }
+
+  // Directions are sampled uniformly over the cone the sphere subtends.
+  double pdf_value(const point3& origin, const vec3& direction) const override;
+  vec3 random(const point3& origin) const override;
+
+  std::string about(const material_table& materials) const override
+  {
+    std::ostringstream ss;
+    ss << "Шар с центром (" << center.e[0] << ", " << center.e[1] << ", "
+       << center.e[2] << "), r = " << radius
+       << "; Материал: " << materials[mat_id].about();
+    return ss.str();
   }
 
 public:
   point3 center;
   double radius;
-  shared_ptr<material> mat_ptr;
+  material_id mat_id;
 
-private:
   static void get_sphere_uv(const point3& p, double& u, double& v)
   {
     // p: a given point on the sphere of radius one, centered at the origin.
@@ -50,6 +68,17 @@ private:
     u = phi / (2 * pi);
     v = theta / pi;
   }
+
+private:
+  void set_hit(const ray& r, double root, hit_record& rec) const
+  {
+    rec.t = root;
+    rec.p = r.at(rec.t);
+    vec3 outward_normal = (rec.p - center) / radius;
+    rec.set_face_normal(r, outward_normal);
+    get_sphere_uv(outward_normal, rec.u, rec.v);
+    rec.mat_id = mat_id;
+  }
 };
 
 inline bool
@@ -73,17 +102,75 @@ sphere::hit(const ray& r, double t_min, double t_max, hit_record& rec) const
       return false;
   }
 
-  rec.t = root;
-  rec.p = r.at(rec.t);
-  vec3 outward_normal = (rec.p - center) / radius;
-  rec.set_face_normal(r, outward_normal);
-  get_sphere_uv(outward_normal, rec.u, rec.v);
-  rec.mat_ptr = mat_ptr;
+  set_hit(r, root, rec);
   //  rec.normal = (rec.p - center) / radius;
 
   return true;
 }
 
+// Intersects the lanes of `active` with one sphere, four rays at a time: the
+// test of sphere::hit() evaluated for every lane. Returns the lanes with a
+// root in [t_min, t_max] and stores those roots.
+inline int
+hit_sphere_packet(const ray_packet& rp,
+                  int active,
+                  const point3& center,
+                  double radius,
+                  double t_min,
+                  const double* t_max,
+                  double* roots)
+{
+  auto const dx = vdouble4::load(rp.dir[0]);
+  auto const dy = vdouble4::load(rp.dir[1]);
+  auto const dz = vdouble4::load(rp.dir[2]);
+  auto const ocx = vdouble4::load(rp.org[0]) - vdouble4(center.e[0]);
+  auto const ocy = vdouble4::load(rp.org[1]) - vdouble4(center.e[1]);
+  auto const ocz = vdouble4::load(rp.org[2]) - vdouble4(center.e[2]);
+
+  auto const a = dx * dx + dy * dy + dz * dz;
+  auto const half_b = ocx * dx + ocy * dy + ocz * dz;
+  auto const c =
+    (ocx * ocx + ocy * ocy + ocz * ocz) - vdouble4(radius * radius);
+
+  auto const discriminant = half_b * half_b - a * c;
+  auto const sqrtd = sqrt(discriminant);
+
+  auto const lo = vdouble4(t_min);
+  auto const hi = vdouble4::load(t_max);
+  auto const near_root = (vdouble4(0.0) - half_b - sqrtd) / a;
+  auto const far_root = (vdouble4(0.0) - half_b + sqrtd) / a;
+  auto const near_ok = (lo <= near_root) & (near_root <= hi);
+  auto const far_ok = (lo <= far_root) & (far_root <= hi);
+
+  int hits = active & (vdouble4(0.0) <= discriminant).movemask() &
+             (near_ok | far_ok).movemask();
+  if (0 != hits)
+    select(near_ok, near_root, far_root).store(roots);
+
+  return hits;
+}
+
+inline int
+sphere::hit_packet(const ray_packet& rp,
+                   int active,
+                   double t_min,
+                   double* t_max,
+                   hit_record* rec) const
+{
+  double roots[ray_packet::size];
+  int hits =
+    hit_sphere_packet(rp, active, center, radius, t_min, t_max, roots);
+
+  for (int i = 0; i < ray_packet::size; ++i) {
+    if (hits & (1 << i)) {
+      set_hit(rp.rays[i], roots[i], rec[i]);
+      t_max[i] = roots[i];
+    }
+  }
+
+  return hits;
+}
+
 inline bool
 sphere::bounding_box(aabb& output_box) const
 {
@@ -91,3 +178,38 @@ sphere::bounding_box(aabb& output_box) const
                     center + vec3(radius, radius, radius));
   return true;
 }
+
+inline double
+sphere::pdf_value(const point3& origin, const vec3& direction) const
+{
+  // Seen from inside, the sphere is everywhere; such origins are left to
+  // other sampling.
+  auto const distance_squared = (center - origin).length_squared();
+  hit_record rec;
+  if (distance_squared <= radius * radius ||
+      !hit(ray(origin, direction), 0.001, infinity, rec))
+    return 0.0;
+
+  auto cos_theta_max = sqrt(1 - radius * radius / distance_squared);
+  auto solid_angle = 2 * pi * (1 - cos_theta_max);
+  return 1 / solid_angle;
+}
+
+inline vec3
+sphere::random(const point3& origin) const
+{
+  vec3 direction = center - origin;
+  auto distance_squared = direction.length_squared();
+  if (distance_squared <= radius * radius)
+    return random_unit_vector();
+
+  // Uniform in the cone: cos(theta) uniform in [cos_theta_max, 1].
+  auto r1 = random_double();
+  auto r2 = random_double();
+  auto z = 1 + r2 * (sqrt(1 - radius * radius / distance_squared) - 1);
+  auto phi = 2 * pi * r1;
+  auto sin_theta = sqrt(1 - z * z);
+
+  onb uvw(direction);
+  return uvw.local(cos(phi) * sin_theta, sin(phi) * sin_theta, z);
+}
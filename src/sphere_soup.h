@@ -0,0 +1,311 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "bvh.h"
+#include "hittable_list.h"
+#include "simd.h"
+#include "sphere.h"
+
+// Many spheres stored as one primitive. Centres and radii live in separate
+// arrays ordered by the leaves of the soup's own BVH, so a leaf is
+// intersected vreal::lanes spheres per instruction.
+class sphere_soup : public hittable
+{
+public:
+  // Vector of the geometry scalar: four doubles or, in single precision
+  // builds, eight floats.
+  using vreal =
+    std::conditional_t<std::is_same<real, float>::value, vfloat8, vdouble4>;
+
+  // Dummy entries at the end of the geometry arrays.
+  static constexpr int padding = vreal::lanes - 1;
+
+  sphere_soup() {}
+
+  void add(const point3& center, double r, material_id m)
+  {
+    cx.push_back(center.x());
+    cy.push_back(center.y());
+    cz.push_back(center.z());
+    radius.push_back(r);
+    materials.push_back(m);
+  }
+
+  // Builds the hierarchy and reorders the spheres by it; call once after
+  // all spheres are added.
+  void build();
+
+  std::size_t size() const { return materials.size(); }
+
+  bool hit(const ray& r,
+           double t_min,
+           double t_max,
+           hit_record& rec) const override;
+
+  int hit_packet(const ray_packet& rp,
+                 int active,
+                 double t_min,
+                 double* t_max,
+                 hit_record* rec) const override;
+
+  bool bounding_box(aabb& output_box) const override
+  {
+    if (nodes.empty())
+      return false;
+    output_box = nodes[0].box;
+    return true;
+  }
+
+  std::string about(const material_table& materials) const override
+  {
+    return "Набор шаров (" + std::to_string(size()) + ")";
+  }
+
+  // Index of the closest of `count` spheres starting at `first` that the ray
+  // hits in [t_min, t_max], or -1. t_max is shrunk to that hit.
+  int closest_hit(const ray& r,
+                  std::uint32_t first,
+                  std::uint32_t count,
+                  double t_min,
+                  double& t_max) const;
+
+public:
+  std::vector<bvh_node> nodes;
+  bvh_stats stats;
+  // Sphere data in leaf order. The geometry arrays are padded with
+  // `padding` dummy entries so vector loads stay in bounds.
+  std::vector<real> cx, cy, cz, radius;
+  std::vector<material_id> materials;
+
+private:
+  int closest_in_subtree(std::uint32_t root,
+                         const ray& r,
+                         double t_min,
+                         double& t_max) const;
+
+  void set_hit(const ray& r, int i, double t, hit_record& rec) const
+  {
+    point3 center(cx[i], cy[i], cz[i]);
+    rec.t = t;
+    rec.p = r.at(t);
+    vec3 outward_normal = (rec.p - center) / radius[i];
+    rec.set_face_normal(r, outward_normal);
+    sphere::get_sphere_uv(outward_normal, rec.u, rec.v);
+    rec.mat_id = materials[i];
+  }
+};
+
+inline void
+sphere_soup::build()
+{
+  auto const n = size();
+
+  std::vector<aabb> boxes(n);
+  for (size_t i = 0; i < n; ++i) {
+    vec3 half(radius[i], radius[i], radius[i]);
+    point3 center(cx[i], cy[i], cz[i]);
+    boxes[i] = aabb(center - half, center + half);
+  }
+
+  bvh_build_params params;
+  params.intersection_cost = 1.0 / vreal::lanes;
+  params.max_leaf_size = 4 * vreal::lanes;
+  bvh_tree tree = build_bvh(boxes, params);
+  nodes = std::move(tree.nodes);
+  stats = tree.stats;
+
+  auto reorder = [&tree](auto& v) {
+    std::remove_reference_t<decltype(v)> sorted;
+    sorted.reserve(v.size() + padding);
+    for (auto i : tree.indices)
+      sorted.push_back(v[i]);
+    v = std::move(sorted);
+  };
+  reorder(cx);
+  reorder(cy);
+  reorder(cz);
+  reorder(radius);
+  reorder(materials);
+
+  for (int i = 0; i < padding; ++i) {
+    cx.push_back(0);
+    cy.push_back(0);
+    cz.push_back(0);
+    radius.push_back(0);
+  }
+}
+
+inline int
+sphere_soup::closest_hit(const ray& r,
+                         std::uint32_t first,
+                         std::uint32_t count,
+                         double t_min,
+                         double& t_max) const
+{
+  // sphere::hit() for vreal::lanes spheres at once, one ray.
+  auto const ox = vreal(r.origin().x());
+  auto const oy = vreal(r.origin().y());
+  auto const oz = vreal(r.origin().z());
+  auto const dx = vreal(r.direction().x());
+  auto const dy = vreal(r.direction().y());
+  auto const dz = vreal(r.direction().z());
+  auto const a = vreal(r.direction().length_squared());
+  auto const lo = vreal(static_cast<real>(t_min));
+
+  int best = -1;
+  auto const end = first + count;
+
+  for (auto k = first; k < end; k += vreal::lanes) {
+    auto const ocx = ox - vreal::load(&cx[k]);
+    auto const ocy = oy - vreal::load(&cy[k]);
+    auto const ocz = oz - vreal::load(&cz[k]);
+    auto const rad = vreal::load(&radius[k]);
+
+    auto const half_b = ocx * dx + ocy * dy + ocz * dz;
+    auto const c = (ocx * ocx + ocy * ocy + ocz * ocz) - rad * rad;
+    auto const discriminant = half_b * half_b - a * c;
+    auto const sqrtd = sqrt(discriminant);
+
+    auto const hi = vreal(static_cast<real>(t_max));
+    auto const near_root = (vreal(0) - half_b - sqrtd) / a;
+    auto const far_root = (vreal(0) - half_b + sqrtd) / a;
+    auto const near_ok = (lo <= near_root) & (near_root <= hi);
+    auto const far_ok = (lo <= far_root) & (far_root <= hi);
+
+    auto const left = end - k;
+    int valid = left >= vreal::lanes ? (1 << vreal::lanes) - 1
+                                     : (1 << left) - 1;
+    int hits = valid & (vreal(0) <= discriminant).movemask() &
+               (near_ok | far_ok).movemask();
+    if (0 == hits)
+      continue;
+
+    real roots[vreal::lanes];
+    select(near_ok, near_root, far_root).store(roots);
+    for (int i = 0; i < vreal::lanes; ++i) {
+      if ((hits & (1 << i)) && roots[i] < t_max) {
+        t_max = roots[i];
+        best = static_cast<int>(k) + i;
+      }
+    }
+  }
+
+  return best;
+}
+
+inline int
+sphere_soup::closest_in_subtree(std::uint32_t root,
+                                const ray& r,
+                                double t_min,
+                                double& t_max) const
+{
+  int best = -1;
+  traverse_bvh(
+    nodes,
+    r,
+    t_min,
+    t_max,
+    [this, &r, t_min, &best, &t_max](
+      std::uint32_t first, std::uint32_t count, double& closest) {
+      int i = closest_hit(r, first, count, t_min, closest);
+      if (i < 0)
+        return false;
+      best = i;
+      t_max = closest;
+      return true;
+    },
+    root);
+  return best;
+}
+
+inline bool
+sphere_soup::hit(const ray& r,
+                 double t_min,
+                 double t_max,
+                 hit_record& rec) const
+{
+  int i = closest_in_subtree(0, r, t_min, t_max);
+  if (i < 0)
+    return false;
+
+  set_hit(r, i, t_max, rec);
+  return true;
+}
+
+inline int
+sphere_soup::hit_packet(const ray_packet& rp,
+                        int active,
+                        double t_min,
+                        double* t_max,
+                        hit_record* rec) const
+{
+  if (!rp.coherent(active))
+    return hittable::hit_packet(rp, active, t_min, t_max, rec);
+
+  int best[ray_packet::size];
+
+  int hits = traverse_bvh_packet(
+    nodes,
+    rp,
+    active,
+    t_min,
+    t_max,
+    [this, &rp, t_min, t_max, &best](
+      std::uint32_t first, std::uint32_t count, int lanes) {
+      int hits = 0;
+      double roots[ray_packet::size];
+      for (auto k = first; k < first + count; ++k) {
+        point3 center(cx[k], cy[k], cz[k]);
+        int h = hit_sphere_packet(
+          rp, lanes, center, radius[k], t_min, t_max, roots);
+        for (int i = 0; i < ray_packet::size; ++i) {
+          if (h & (1 << i)) {
+            t_max[i] = roots[i];
+            best[i] = static_cast<int>(k);
+          }
+        }
+        hits |= h;
+      }
+      return hits;
+    },
+    [this, &rp, t_min, t_max, &best](std::uint32_t node, int i) {
+      int k = closest_in_subtree(node, rp.rays[i], t_min, t_max[i]);
+      if (k < 0)
+        return false;
+      best[i] = k;
+      return true;
+    });
+
+  for (int i = 0; i < ray_packet::size; ++i)
+    if (hits & (1 << i))
+      set_hit(rp.rays[i], best[i], t_max[i], rec[i]);
+
+  return hits;
+}
+
+// Moves the plain spheres of a list into one sphere_soup; other objects are
+// kept as they are.
+inline hittable_list
+pack_spheres(const hittable_list& list)
+{
+  auto soup = make_shared<sphere_soup>();
+  hittable_list packed;
+
+  for (const auto& object : list.objects) {
+    if (auto s = std::dynamic_pointer_cast<sphere>(object))
+      soup->add(s->center, s->radius, s->mat_id);
+    else
+      packed.add(object);
+  }
+
+  if (0 != soup->size()) {
+    soup->build();
+    packed.add(soup);
+  }
+
+  return packed;
+}
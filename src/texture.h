@@ -29,7 +29,7 @@ public:
 
   std::string about() override { return "Одноцветный"; }
 
-private:
+public:
   color color_value;
 };
 
@@ -0,0 +1,433 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "bvh.h"
+#include "material.h"
+
+// Ray prepared for the watertight ray-triangle test (Woop, Benthin, Wald,
+// "Watertight Ray/Triangle Intersection", 2013): the axes are permuted so
+// the direction is mostly along kz, and a shear turns it into that axis.
+// Triangles sharing an edge compute the same edge function for it, so rays
+// never slip between them.
+struct triangle_ray
+{
+  triangle_ray() {}
+  explicit triangle_ray(const ray& r)
+    : org(r.origin())
+  {
+    auto const& d = r.direction();
+    kz = fabs(d.x()) > fabs(d.y()) ? (fabs(d.x()) > fabs(d.z()) ? 0 : 2)
+                                   : (fabs(d.y()) > fabs(d.z()) ? 1 : 2);
+    kx = (kz + 1) % 3;
+    ky = (kx + 1) % 3;
+    // Keep the winding of the triangles.
+    if (d[kz] < 0)
+      std::swap(kx, ky);
+    sx = d[kx] / d[kz];
+    sy = d[ky] / d[kz];
+    sz = 1.0 / d[kz];
+  }
+
+  point3 org;
+  int kx = 0, ky = 1, kz = 2;
+  double sx = 0.0, sy = 0.0, sz = 1.0;
+};
+
+// Triangles sharing their vertices, stored as one primitive of a single
+// material. Vertex positions, normals and texture coordinates are kept in
+// single precision, normals and coordinates only if the mesh has them.
+// Triangles are triples of 32-bit vertex indices ordered by the leaves of
+// the mesh's own BVH, so a triangle costs 12 bytes besides its share of the
+// vertices and the nodes.
+class triangle_mesh : public hittable
+{
+public:
+  triangle_mesh() {}
+  explicit triangle_mesh(material_id m)
+    : mat_id(m)
+  {}
+
+  // Returns the index of the new vertex.
+  std::uint32_t add_vertex(const point3& p)
+  {
+    positions.push_back(static_cast<float>(p.x()));
+    positions.push_back(static_cast<float>(p.y()));
+    positions.push_back(static_cast<float>(p.z()));
+    return static_cast<std::uint32_t>(vertex_count() - 1);
+  }
+
+  void add_triangle(std::uint32_t a, std::uint32_t b, std::uint32_t c)
+  {
+    indices.push_back(a);
+    indices.push_back(b);
+    indices.push_back(c);
+  }
+
+  // Builds the hierarchy and reorders the triangles by it; call once after
+  // all triangles are added.
+  void build();
+
+  std::size_t size() const { return indices.size() / 3; }
+  std::size_t vertex_count() const { return positions.size() / 3; }
+  bool has_normals() const { return !normals.empty(); }
+  bool has_uvs() const { return !uvs.empty(); }
+
+  point3 position(std::uint32_t v) const
+  {
+    auto const* p = &positions[3 * std::size_t{ v }];
+    return point3(p[0], p[1], p[2]);
+  }
+
+  bool hit(const ray& r,
+           double t_min,
+           double t_max,
+           hit_record& rec) const override;
+
+  int hit_packet(const ray_packet& rp,
+                 int active,
+                 double t_min,
+                 double* t_max,
+                 hit_record* rec) const override;
+
+  bool bounding_box(aabb& output_box) const override
+  {
+    if (nodes.empty())
+      return false;
+    output_box = nodes[0].box;
+    return true;
+  }
+
+  bool is_light(const material_table& materials) const override
+  {
+    return materials[mat_id].emissive();
+  }
+
+  // A triangle is picked uniformly and a point uniformly on it, so a point
+  // of triangle i has the area density 1 / (size() * area_i). Every
+  // triangle the direction crosses adds to the density.
+  double pdf_value(const point3& origin, const vec3& direction) const override;
+
+  vec3 random(const point3& origin) const override;
+
+  std::string about(const material_table& materials) const override
+  {
+    return "Сетка треугольников (" + std::to_string(size()) + ")";
+  }
+
+  // Watertight test of triangle `tri`; on a hit in [t_min, t_max] returns
+  // the distance and the barycentric weights of its second and third
+  // vertices.
+  bool intersect(const triangle_ray& tr,
+                 std::uint32_t tri,
+                 double t_min,
+                 double t_max,
+                 double& t,
+                 double& b1,
+                 double& b2) const;
+
+public:
+  material_id mat_id = 0;
+  std::vector<bvh_node> nodes;
+  bvh_stats stats;
+  // Three floats per vertex; normals are empty or as long as positions.
+  std::vector<float> positions, normals;
+  // Two floats per vertex, or empty.
+  std::vector<float> uvs;
+  // Three vertex indices per triangle, in leaf order.
+  std::vector<std::uint32_t> indices;
+
+private:
+  struct closest
+  {
+    std::uint32_t tri;
+    double b1, b2;
+  };
+
+  bool closest_in_subtree(std::uint32_t root,
+                          const ray& r,
+                          const triangle_ray& tr,
+                          double t_min,
+                          double& t_max,
+                          closest& c) const;
+
+  void set_hit(const ray& r,
+               const closest& c,
+               double t,
+               hit_record& rec) const;
+};
+
+inline void
+triangle_mesh::build()
+{
+  auto const n = size();
+
+  std::vector<aabb> boxes(n);
+#pragma omp parallel for
+  for (std::int64_t i = 0; i < static_cast<std::int64_t>(n); ++i) {
+    aabb box = aabb::empty();
+    for (int k = 0; k < 3; ++k)
+      bvh_detail::grow(box, position(indices[3 * i + k]));
+    // Slab tests miss boxes of zero width, which triangles lying in an axis
+    // plane would have.
+    for (int a = 0; a < 3; ++a) {
+      auto const pad = 1e-7 * (1.0 + fabs(box.minimum.e[a]) +
+                               (box.maximum.e[a] - box.minimum.e[a]));
+      box.minimum.e[a] -= pad;
+      box.maximum.e[a] += pad;
+    }
+    boxes[i] = box;
+  }
+
+  bvh_tree tree = build_bvh(boxes);
+  nodes = std::move(tree.nodes);
+  stats = tree.stats;
+
+  std::vector<std::uint32_t> sorted;
+  sorted.reserve(indices.size());
+  for (auto i : tree.indices)
+    for (int k = 0; k < 3; ++k)
+      sorted.push_back(indices[3 * std::size_t{ i } + k]);
+  indices = std::move(sorted);
+}
+
+inline bool
+triangle_mesh::intersect(const triangle_ray& tr,
+                         std::uint32_t tri,
+                         double t_min,
+                         double t_max,
+                         double& t,
+                         double& b1,
+                         double& b2) const
+{
+  auto const* idx = &indices[3 * std::size_t{ tri }];
+  auto const a = position(idx[0]) - tr.org;
+  auto const b = position(idx[1]) - tr.org;
+  auto const c = position(idx[2]) - tr.org;
+
+  // Vertices in the sheared space, where the ray runs along z from the
+  // origin.
+  auto const ax = a[tr.kx] - tr.sx * a[tr.kz];
+  auto const ay = a[tr.ky] - tr.sy * a[tr.kz];
+  auto const bx = b[tr.kx] - tr.sx * b[tr.kz];
+  auto const by = b[tr.ky] - tr.sy * b[tr.kz];
+  auto const cx = c[tr.kx] - tr.sx * c[tr.kz];
+  auto const cy = c[tr.ky] - tr.sy * c[tr.kz];
+
+  // Scaled barycentric coordinates: the edge functions.
+  auto const u = cx * by - cy * bx;
+  auto const v = ax * cy - ay * cx;
+  auto const w = bx * ay - by * ax;
+  if ((u < 0 || v < 0 || w < 0) && (u > 0 || v > 0 || w > 0))
+    return false;
+
+  auto const det = u + v + w;
+  if (0.0 == det)
+    return false;
+
+  auto const dist = tr.sz * (u * a[tr.kz] + v * b[tr.kz] + w * c[tr.kz]);
+  t = dist / det;
+  if (t < t_min || t > t_max)
+    return false;
+
+  b1 = v / det;
+  b2 = w / det;
+  return true;
+}
+
+inline bool
+triangle_mesh::closest_in_subtree(std::uint32_t root,
+                                  const ray& r,
+                                  const triangle_ray& tr,
+                                  double t_min,
+                                  double& t_max,
+                                  closest& c) const
+{
+  return traverse_bvh(
+    nodes,
+    r,
+    t_min,
+    t_max,
+    [this, &tr, t_min, &t_max, &c](
+      std::uint32_t first, std::uint32_t count, double& nearest) {
+      bool hit_anything = false;
+      double t, b1, b2;
+      for (auto k = first; k < first + count; ++k) {
+        if (intersect(tr, k, t_min, nearest, t, b1, b2)) {
+          nearest = t;
+          c = { k, b1, b2 };
+          hit_anything = true;
+        }
+      }
+      if (hit_anything)
+        t_max = nearest;
+      return hit_anything;
+    },
+    root);
+}
+
+inline void
+triangle_mesh::set_hit(const ray& r,
+                       const closest& c,
+                       double t,
+                       hit_record& rec) const
+{
+  auto const* idx = &indices[3 * std::size_t{ c.tri }];
+  auto const b0 = 1.0 - c.b1 - c.b2;
+
+  auto const p0 = position(idx[0]);
+  vec3 const geometric = cross(position(idx[1]) - p0, position(idx[2]) - p0);
+
+  rec.t = t;
+  rec.p = r.at(t);
+  rec.front_face = dot(r.direction(), geometric) < 0;
+
+  // The interpolated normal, turned to the side the triangle faces, where
+  // the vertices have normals.
+  vec3 normal = geometric;
+  if (has_normals()) {
+    vec3 interpolated(0, 0, 0);
+    double const weight[3] = { b0, c.b1, c.b2 };
+    for (int k = 0; k < 3; ++k) {
+      auto const* n = &normals[3 * std::size_t{ idx[k] }];
+      interpolated += weight[k] * vec3(n[0], n[1], n[2]);
+    }
+    if (interpolated.length_squared() > 0)
+      normal = dot(interpolated, geometric) < 0 ? -interpolated : interpolated;
+  }
+  normal = unit_vector(normal);
+  rec.normal = rec.front_face ? normal : -normal;
+
+  if (has_uvs()) {
+    rec.u = rec.v = 0.0;
+    double const weight[3] = { b0, c.b1, c.b2 };
+    for (int k = 0; k < 3; ++k) {
+      auto const* uv = &uvs[2 * std::size_t{ idx[k] }];
+      rec.u += weight[k] * uv[0];
+      rec.v += weight[k] * uv[1];
+    }
+  } else {
+    rec.u = c.b1;
+    rec.v = c.b2;
+  }
+
+  rec.mat_id = mat_id;
+}
+
+inline bool
+triangle_mesh::hit(const ray& r,
+                   double t_min,
+                   double t_max,
+                   hit_record& rec) const
+{
+  closest c{};
+  if (!closest_in_subtree(0, r, triangle_ray(r), t_min, t_max, c))
+    return false;
+
+  set_hit(r, c, t_max, rec);
+  return true;
+}
+
+inline int
+triangle_mesh::hit_packet(const ray_packet& rp,
+                          int active,
+                          double t_min,
+                          double* t_max,
+                          hit_record* rec) const
+{
+  if (!rp.coherent(active))
+    return hittable::hit_packet(rp, active, t_min, t_max, rec);
+
+  triangle_ray trs[ray_packet::size];
+  for (int i = 0; i < ray_packet::size; ++i)
+    if (active & (1 << i))
+      trs[i] = triangle_ray(rp.rays[i]);
+
+  closest best[ray_packet::size]{};
+
+  int hits = traverse_bvh_packet(
+    nodes,
+    rp,
+    active,
+    t_min,
+    t_max,
+    [this, &trs, t_min, t_max, &best](
+      std::uint32_t first, std::uint32_t count, int lanes) {
+      int hits = 0;
+      double t, b1, b2;
+      for (auto k = first; k < first + count; ++k) {
+        for (int i = 0; i < ray_packet::size; ++i) {
+          if ((lanes & (1 << i)) &&
+              intersect(trs[i], k, t_min, t_max[i], t, b1, b2)) {
+            t_max[i] = t;
+            best[i] = { k, b1, b2 };
+            hits |= 1 << i;
+          }
+        }
+      }
+      return hits;
+    },
+    [this, &rp, &trs, t_min, t_max, &best](std::uint32_t node, int i) {
+      return closest_in_subtree(
+        node, rp.rays[i], trs[i], t_min, t_max[i], best[i]);
+    });
+
+  for (int i = 0; i < ray_packet::size; ++i)
+    if (hits & (1 << i))
+      set_hit(rp.rays[i], best[i], t_max[i], rec[i]);
+
+  return hits;
+}
+
+inline double
+triangle_mesh::pdf_value(const point3& origin, const vec3& direction) const
+{
+  ray const r(origin, direction);
+  triangle_ray const tr(r);
+  double sum = 0.0;
+
+  // Visits every triangle along the ray: the leaves never shrink t_max.
+  traverse_bvh(
+    nodes,
+    r,
+    0.001,
+    infinity,
+    [this, &tr, &direction, &sum](
+      std::uint32_t first, std::uint32_t count, double& t_max) {
+      double t, b1, b2;
+      for (auto k = first; k < first + count; ++k) {
+        if (!intersect(tr, k, 0.001, t_max, t, b1, b2))
+          continue;
+        auto const* idx = &indices[3 * std::size_t{ k }];
+        auto const p0 = position(idx[0]);
+        auto const n = cross(position(idx[1]) - p0, position(idx[2]) - p0);
+        // Squared distance over the cosine and the area |n| / 2.
+        auto const len = direction.length();
+        sum += 2 * t * t * len * len * len / fabs(dot(n, direction));
+      }
+      return false;
+    });
+
+  return sum / size();
+}
+
+inline vec3
+triangle_mesh::random(const point3& origin) const
+{
+  auto const tri = std::min(
+    static_cast<std::size_t>(random_double() * size()), size() - 1);
+  auto const* idx = &indices[3 * tri];
+
+  // Uniform barycentric coordinates by the square root warp of Osada et al.
+  auto const s = sqrt(random_double());
+  auto const b1 = s * random_double();
+  auto const b2 = 1 - s;
+  auto const p0 = position(idx[0]);
+  auto const p = p0 + b1 * (position(idx[1]) - p0) +
+                 b2 * (position(idx[2]) - p0);
+  return p - origin;
+}
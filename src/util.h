@@ -1,7 +1,9 @@
 #pragma once
 
 #include "color.h"
+#include "image.h"
 #include <QColor>
+#include <QImage>
 
 color
 to_color(QColor const& qc)
@@ -9,4 +11,16 @@ to_color(QColor const& qc)
   return color{ qRed(qc.rgb()) / 256.0,
                 qGreen(qc.rgb()) / 256.0,
                 qBlue(qc.rgb()) / 256.0 };
-}
\ No newline at end of file
+}
+
+// Copies the pixels, the result does not refer to img.
+inline QImage
+to_qimage(const image& img)
+{
+  QImage wrapped(reinterpret_cast<const uchar*>(img.pixels_.data()),
+                 img.width_,
+                 img.height_,
+                 img.width_ * sizeof(std::uint32_t),
+                 QImage::Format_RGB32);
+  return wrapped.copy();
+}
@@ -2,26 +2,44 @@
 
 #include <cmath>
 #include <iostream>
+#include <type_traits>
 
-class vec3
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Three components of type T. The padded layout adds a fourth, always zero,
+// and aligns the vector to 16 bytes: four floats are then one SSE register,
+// and arithmetic on them is a single instruction.
+template<typename T, bool Padded = false>
+class basic_vec3
 {
 public:
-  vec3()
+  using value_type = T;
+  static constexpr bool padded = Padded;
+
+  basic_vec3()
     : e{ 0, 0, 0 }
   {}
-  vec3(double e0, double e1, double e2)
-    : e{ e0, e1, e2 }
+  // Coordinates are given in double precision whatever T is.
+  basic_vec3(double e0, double e1, double e2)
+    : e{ static_cast<T>(e0), static_cast<T>(e1), static_cast<T>(e2) }
+  {}
+  // Conversion between precisions and layouts.
+  template<typename U, bool P>
+  explicit basic_vec3(const basic_vec3<U, P>& v)
+    : basic_vec3(v[0], v[1], v[2])
   {}
 
-  double x() const { return e[0]; }
-  double y() const { return e[1]; }
-  double z() const { return e[2]; }
+  T x() const { return e[0]; }
+  T y() const { return e[1]; }
+  T z() const { return e[2]; }
 
-  vec3 operator-() const { return vec3(-e[0], -e[1], -e[2]); }
-  double operator[](int i) const { return e[i]; }
-  double& operator[](int i) { return e[i]; }
+  basic_vec3 operator-() const { return basic_vec3(-e[0], -e[1], -e[2]); }
+  T operator[](int i) const { return e[i]; }
+  T& operator[](int i) { return e[i]; }
 
-  vec3& operator+=(const vec3& v)
+  basic_vec3& operator+=(const basic_vec3& v)
   {
     e[0] += v.e[0];
     e[1] += v.e[1];
@@ -29,7 +47,7 @@ public:
     return *this;
   }
 
-  vec3& operator*=(const double t)
+  basic_vec3& operator*=(const T t)
   {
     e[0] *= t;
     e[1] *= t;
@@ -37,25 +55,22 @@ public:
     return *this;
   }
 
-  vec3& operator/=(const double t) { return *this *= 1 / t; }
+  basic_vec3& operator/=(const T t) { return *this *= 1 / t; }
 
-  double length() const { return std::sqrt(length_squared()); }
+  T length() const { return std::sqrt(length_squared()); }
 
-  double length_squared() const
-  {
-    return e[0] * e[0] + e[1] * e[1] + e[2] * e[2];
-  }
+  T length_squared() const { return e[0] * e[0] + e[1] * e[1] + e[2] * e[2]; }
 
-  inline static vec3 random()
+  inline static basic_vec3 random()
   {
-    return vec3(random_double(), random_double(), random_double());
+    return basic_vec3(random_double(), random_double(), random_double());
   }
 
-  inline static vec3 random(double min, double max)
+  inline static basic_vec3 random(double min, double max)
   {
-    return vec3(random_double(min, max),
-                random_double(min, max),
-                random_double(min, max));
+    return basic_vec3(random_double(min, max),
+                      random_double(min, max),
+                      random_double(min, max));
   }
 
   bool near_zero() const
@@ -66,92 +81,169 @@ public:
   }
 
 public:
-  double e[3];
+  alignas(Padded ? 16 : alignof(T)) T e[Padded ? 4 : 3];
 };
 
+// Scalar type of the geometry, chosen at build time (ENABLE_FLOAT32).
+// Single precision shrinks points, normals and boxes, and so hierarchy nodes
+// and hit records, and the sphere soup tests twice as many spheres per
+// instruction. Colors are vectors too, so the throughput of paths is carried
+// in the same precision; distances along rays and the packet kernels, whose
+// lanes are rays, stay in double precision.
+#if defined(DENISKA_FLOAT32)
+using real = float;
+#else
+using real = double;
+#endif
+
+#if defined(DENISKA_PADDED_VEC3)
+using vec3 = basic_vec3<real, true>;
+#else
+using vec3 = basic_vec3<real>;
+#endif
+
 // Type aliases for vec3
 using point3 = vec3; // 3D point
 using color = vec3;  // RGB color
 
 // vec3 Utility Functions
 
+namespace vec3_detail {
+
+// Whether a vector is one SSE register of floats.
+template<typename T, bool P>
+constexpr bool sse_ps = P && std::is_same<T, float>::value;
+
+} // namespace vec3_detail
+
+template<typename T, bool P>
 inline std::ostream&
-operator<<(std::ostream& out, const vec3& v)
+operator<<(std::ostream& out, const basic_vec3<T, P>& v)
 {
   return out << v.e[0] << ' ' << v.e[1] << ' ' << v.e[2];
 }
 
-inline vec3
-operator+(const vec3& u, const vec3& v)
+template<typename T, bool P>
+inline basic_vec3<T, P>
+operator+(const basic_vec3<T, P>& u, const basic_vec3<T, P>& v)
 {
-  return vec3(u.e[0] + v.e[0], u.e[1] + v.e[1], u.e[2] + v.e[2]);
+#if defined(__SSE2__)
+  if constexpr (vec3_detail::sse_ps<T, P>) {
+    basic_vec3<T, P> r;
+    _mm_store_ps(r.e, _mm_add_ps(_mm_load_ps(u.e), _mm_load_ps(v.e)));
+    return r;
+  }
+#endif
+  return basic_vec3<T, P>(u.e[0] + v.e[0], u.e[1] + v.e[1], u.e[2] + v.e[2]);
 }
 
-inline vec3
-operator-(const vec3& u, const vec3& v)
+template<typename T, bool P>
+inline basic_vec3<T, P>
+operator-(const basic_vec3<T, P>& u, const basic_vec3<T, P>& v)
 {
-  return vec3(u.e[0] - v.e[0], u.e[1] - v.e[1], u.e[2] - v.e[2]);
+#if defined(__SSE2__)
+  if constexpr (vec3_detail::sse_ps<T, P>) {
+    basic_vec3<T, P> r;
+    _mm_store_ps(r.e, _mm_sub_ps(_mm_load_ps(u.e), _mm_load_ps(v.e)));
+    return r;
+  }
+#endif
+  return basic_vec3<T, P>(u.e[0] - v.e[0], u.e[1] - v.e[1], u.e[2] - v.e[2]);
 }
 
-inline vec3
-operator*(const vec3& u, const vec3& v)
+template<typename T, bool P>
+inline basic_vec3<T, P>
+operator*(const basic_vec3<T, P>& u, const basic_vec3<T, P>& v)
 {
-  return vec3(u.e[0] * v.e[0], u.e[1] * v.e[1], u.e[2] * v.e[2]);
+#if defined(__SSE2__)
+  if constexpr (vec3_detail::sse_ps<T, P>) {
+    basic_vec3<T, P> r;
+    _mm_store_ps(r.e, _mm_mul_ps(_mm_load_ps(u.e), _mm_load_ps(v.e)));
+    return r;
+  }
+#endif
+  return basic_vec3<T, P>(u.e[0] * v.e[0], u.e[1] * v.e[1], u.e[2] * v.e[2]);
 }
 
-inline vec3
-operator*(double t, const vec3& v)
+// The scalar is converted to T rather than taking part in deducing it.
+template<typename T, bool P>
+inline basic_vec3<T, P>
+operator*(typename basic_vec3<T, P>::value_type t, const basic_vec3<T, P>& v)
 {
-  return vec3(t * v.e[0], t * v.e[1], t * v.e[2]);
+#if defined(__SSE2__)
+  if constexpr (vec3_detail::sse_ps<T, P>) {
+    basic_vec3<T, P> r;
+    _mm_store_ps(r.e, _mm_mul_ps(_mm_set1_ps(t), _mm_load_ps(v.e)));
+    return r;
+  }
+#endif
+  return basic_vec3<T, P>(t * v.e[0], t * v.e[1], t * v.e[2]);
 }
 
-inline vec3
-operator*(const vec3& v, double t)
+template<typename T, bool P>
+inline basic_vec3<T, P>
+operator*(const basic_vec3<T, P>& v, typename basic_vec3<T, P>::value_type t)
 {
   return t * v;
 }
 
-inline vec3
-operator/(vec3 v, double t)
+template<typename T, bool P>
+inline basic_vec3<T, P>
+operator/(basic_vec3<T, P> v, typename basic_vec3<T, P>::value_type t)
 {
   return (1 / t) * v;
 }
 
-inline double
-dot(const vec3& u, const vec3& v)
+template<typename T, bool P>
+inline T
+dot(const basic_vec3<T, P>& u, const basic_vec3<T, P>& v)
 {
   return u.e[0] * v.e[0] + u.e[1] * v.e[1] + u.e[2] * v.e[2];
 }
 
-inline vec3
-cross(const vec3& u, const vec3& v)
+template<typename T, bool P>
+inline basic_vec3<T, P>
+cross(const basic_vec3<T, P>& u, const basic_vec3<T, P>& v)
 {
-  return vec3(u.e[1] * v.e[2] - u.e[2] * v.e[1],
-              u.e[2] * v.e[0] - u.e[0] * v.e[2],
-              u.e[0] * v.e[1] - u.e[1] * v.e[0]);
+  return basic_vec3<T, P>(u.e[1] * v.e[2] - u.e[2] * v.e[1],
+                          u.e[2] * v.e[0] - u.e[0] * v.e[2],
+                          u.e[0] * v.e[1] - u.e[1] * v.e[0]);
 }
 
-inline vec3
-unit_vector(vec3 v)
+template<typename T, bool P>
+inline basic_vec3<T, P>
+unit_vector(basic_vec3<T, P> v)
 {
   return v / v.length();
 }
 
+// The random directions and points below are drawn in closed form, with a
+// fixed number of random numbers each, rather than by rejection.
+
+inline vec3
+random_unit_vector()
+{
+  auto z = 1 - 2 * random_double();
+  auto r = sqrt(fmax(0.0, 1 - z * z));
+  auto phi = 2 * pi * random_double();
+  return vec3(r * cos(phi), r * sin(phi), z);
+}
+
 inline vec3
 random_in_unit_sphere()
 {
-  while (true) {
-    auto p = vec3::random(-1, 1);
-    if (p.length_squared() >= 1)
-      continue;
-    return p;
-  }
+  return std::cbrt(random_double()) * random_unit_vector();
 }
 
+// Direction around the z axis with density cos(theta) / pi.
 inline vec3
-random_unit_vector()
+random_cosine_direction()
 {
-  return unit_vector(random_in_unit_sphere());
+  auto r1 = random_double();
+  auto r2 = random_double();
+  auto phi = 2 * pi * r1;
+  auto r = sqrt(r2);
+  return vec3(r * cos(phi), r * sin(phi), sqrt(1 - r2));
 }
 
 inline vec3
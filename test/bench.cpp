@@ -0,0 +1,849 @@
+// Benchmark suite. Renders fixed, reproducibly generated scenes and reports
+// repeated-run statistics of separate metrics as JSON; with a baseline it
+// fails if a metric got worse than the tolerance allows.
+
+#include <algorithm>
+#include <boost/program_options.hpp>
+#include <boost/property_tree/json_parser.hpp>
+#include <boost/property_tree/ptree.hpp>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <numeric>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "box.h"
+#include "bvh.h"
+#include "camera.h"
+#include "dynamic_bvh.h"
+#include "manager_draw.h"
+#include "material.h"
+#include "sphere.h"
+#include "sphere_soup.h"
+#include "triangle_mesh.h"
+
+namespace po = boost::program_options;
+namespace pt = boost::property_tree;
+
+namespace {
+
+using clock_type = std::chrono::steady_clock;
+
+struct options
+{
+  unsigned runs;
+  unsigned warmup;
+  unsigned threads;
+  unsigned width;
+  unsigned height;
+  std::string filter;
+};
+
+// ---------------------------------------------------------------------------
+// Fixtures
+
+struct fixture
+{
+  std::string name;
+  std::function<scene()> make;
+};
+
+// Stream of the fixture generators; fixed so every run sees the same scenes.
+pcg32
+fixture_rng(std::uint64_t seed)
+{
+  return pcg32(seed, 0x5eed);
+}
+
+double
+uniform(pcg32& rng, double lo, double hi)
+{
+  return lo + (hi - lo) * rng.next_double();
+}
+
+// Materials shared by the generated scenes: matte, checker, metal, glass.
+material_table
+fixture_materials()
+{
+  material_table materials;
+  materials.add(
+    make_shared<lambertian>(make_shared<solid_color>(color(0.8, 0.6, 0.2))));
+  materials.add(make_shared<lambertian>(
+    make_shared<checker_texture>(color(0, 0, 0), color(1, 1, 1))));
+  materials.add(make_shared<metal>(color(0.1, 0.2, 0.5), 0.1));
+  std::array<double, 3> b{ 1.03961212, 0.231792344, 1.01046945 };
+  std::array<double, 3> c{ 6.00069867 * 1e-3,
+                           2.00179144 * 1e-2,
+                           1.03560653 * 1e2 };
+  materials.add(make_shared<dielectric>(b, c));
+  return materials;
+}
+
+scene
+default_fixture()
+{
+  material_table materials = fixture_materials();
+  hittable_list world;
+  world.add(make_shared<sphere>(point3{ 0, -101, 0 }, 100, 1));
+  world.add(make_shared<sphere>(point3{ 0, 1, 0 }, 1, 3));
+  world.add(make_shared<sphere>(point3{ 2, 0, 0 }, 1, 0));
+  world.add(make_shared<sphere>(point3{ -2, 0, 0 }, 1, 2));
+  return scene{
+    color(0.7, 0.8, 1.0), point3{ 1, 3, 3 }, point3{ 0, 1, 0 }, world, materials
+  };
+}
+
+// n small spheres in a cube above a ground sphere.
+scene
+spheres_fixture(unsigned n)
+{
+  material_table materials = fixture_materials();
+  hittable_list world;
+  world.add(make_shared<sphere>(point3{ 0, -1000, 0 }, 1000, 1));
+
+  auto rng = fixture_rng(n);
+  double const extent = 10.0 * std::cbrt(n / 1000.0);
+  double const r = 0.25;
+  for (unsigned i = 0; i < n; ++i) {
+    point3 center(uniform(rng, -extent, extent),
+                  uniform(rng, r, 2 * extent),
+                  uniform(rng, -extent, extent));
+    auto mat = static_cast<material_id>(rng.next_uint() % materials.size());
+    world.add(make_shared<sphere>(center, uniform(rng, 0.5, 1.0) * r, mat));
+  }
+
+  return scene{ color(0.7, 0.8, 1.0),
+                point3{ 0, extent, 3 * extent },
+                point3{ 0, extent / 2, 0 },
+                world,
+                materials };
+}
+
+// Rotated boxes standing on a rectangle: the generic, non-SIMD path.
+scene
+boxes_fixture(unsigned n)
+{
+  material_table materials = fixture_materials();
+  hittable_list world;
+  world.add(make_shared<xz_rect>(-50, 50, -50, 50, 0, 1));
+
+  auto rng = fixture_rng(n + 1);
+  for (unsigned i = 0; i < n; ++i) {
+    double const s = uniform(rng, 0.5, 2.0);
+    auto mat = static_cast<material_id>(rng.next_uint() % materials.size());
+    shared_ptr<hittable> b =
+      make_shared<box>(point3(0, 0, 0), point3(s, uniform(rng, 1, 4), s), mat);
+    b = rotate_y(b, uniform(rng, 0, 90));
+    b = translate(b, vec3(uniform(rng, -40, 40), 0, uniform(rng, -40, 40)));
+    world.add(b);
+  }
+
+  return scene{ color(0.7, 0.8, 1.0),
+                point3{ 0, 30, 60 },
+                point3{ 0, 0, 0 },
+                world,
+                materials };
+}
+
+// The default scene lit only by a small sphere and a rectangle: the light
+// sampling path.
+scene
+studio_fixture()
+{
+  material_table materials = fixture_materials();
+  auto const bulb =
+    materials.add(make_shared<diffuse_light>(color(40, 36, 30)));
+  auto const panel = materials.add(make_shared<diffuse_light>(color(6, 6, 6)));
+  hittable_list world;
+  world.add(make_shared<sphere>(point3{ 0, -101, 0 }, 100, 1));
+  world.add(make_shared<sphere>(point3{ 0, 1, 0 }, 1, 3));
+  world.add(make_shared<sphere>(point3{ 2, 0, 0 }, 1, 0));
+  world.add(make_shared<sphere>(point3{ -2, 0, 0 }, 1, 2));
+  world.add(make_shared<sphere>(point3{ 1.5, 2.5, 1.5 }, 0.15, bulb));
+  world.add(make_shared<xz_rect>(-0.6, 0.6, -0.6, 0.6, 4, panel));
+  return scene{ color(0.01, 0.01, 0.015),
+                point3{ 1, 3, 3 },
+                point3{ 0, 1, 0 },
+                world,
+                materials };
+}
+
+// A bumpy ball of about n triangles and radius 1 around (0, 1, 0).
+shared_ptr<triangle_mesh>
+bumpy_ball(unsigned n, material_id mat)
+{
+  // A latitude-longitude grid of rows by 2 * rows quads, two triangles each.
+  auto const rows = static_cast<unsigned>(std::sqrt(n / 4.0)) + 1;
+  auto const cols = 2 * rows;
+  auto mesh = make_shared<triangle_mesh>(mat);
+  for (unsigned i = 0; i <= rows; ++i) {
+    for (unsigned j = 0; j <= cols; ++j) {
+      double const theta = pi * i / rows;
+      double const phi = 2 * pi * j / cols;
+      double const r = 1 + 0.05 * std::sin(7 * theta) * std::cos(9 * phi);
+      mesh->add_vertex(point3(r * std::sin(theta) * std::cos(phi),
+                              1 + r * std::cos(theta),
+                              r * std::sin(theta) * std::sin(phi)));
+    }
+  }
+  for (unsigned i = 0; i < rows; ++i) {
+    for (unsigned j = 0; j < cols; ++j) {
+      auto const a = i * (cols + 1) + j;
+      auto const b = a + cols + 1;
+      mesh->add_triangle(a, a + 1, b + 1);
+      mesh->add_triangle(a, b + 1, b);
+    }
+  }
+  mesh->build();
+  return mesh;
+}
+
+// One bumpy ball on a ground sphere: one large mesh.
+scene
+mesh_fixture(unsigned n)
+{
+  material_table materials = fixture_materials();
+  hittable_list world;
+  world.add(make_shared<sphere>(point3{ 0, -1000, 0 }, 1000, 1));
+  world.add(bumpy_ball(n, 0));
+
+  return scene{ color(0.7, 0.8, 1.0),
+                point3{ 1, 3, 3 },
+                point3{ 0, 1, 0 },
+                world,
+                materials };
+}
+
+// n turned, scaled and moved copies of one small mesh: the instancing path.
+// The hierarchy built per frame is the top level over the instances only.
+scene
+instances_fixture(unsigned n)
+{
+  material_table materials = fixture_materials();
+  hittable_list world;
+  world.add(make_shared<xz_rect>(-50, 50, -50, 50, 0, 1));
+
+  auto const ball = bumpy_ball(2000, 0);
+  auto rng = fixture_rng(n + 2);
+  for (unsigned i = 0; i < n; ++i) {
+    auto const s = uniform(rng, 0.3, 1.0);
+    vec3 const axis(uniform(rng, -1, 1), 1, uniform(rng, -1, 1));
+    auto const t =
+      affine::translation(
+        vec3(uniform(rng, -45, 45), 0, uniform(rng, -45, 45))) *
+      affine::rotation(axis, uniform(rng, 0, 360)) *
+      affine::scaling(vec3(s, s * uniform(rng, 0.5, 1.5), s));
+    world.add(transformed(ball, t));
+  }
+
+  return scene{ color(0.7, 0.8, 1.0),
+                point3{ 0, 30, 60 },
+                point3{ 0, 0, 0 },
+                world,
+                materials };
+}
+
+std::vector<fixture>
+fixtures()
+{
+  return {
+    { "default", default_fixture },
+    { "spheres_10k", [] { return spheres_fixture(10000); } },
+    { "spheres_100k", [] { return spheres_fixture(100000); } },
+    { "boxes_1k", [] { return boxes_fixture(1000); } },
+    { "studio", studio_fixture },
+    { "mesh_200k", [] { return mesh_fixture(200000); } },
+    { "instances_10k", [] { return instances_fixture(10000); } },
+  };
+}
+
+// ---------------------------------------------------------------------------
+// Measurement
+
+struct metric
+{
+  std::string name;
+  // Whether larger values are better (rates) or smaller (times).
+  bool higher_is_better;
+  double min, median, mean, stddev;
+};
+
+// Runs `sample` warmup + runs times and summarizes the last runs.
+metric
+measure(const options& opt,
+        const std::string& name,
+        bool higher_is_better,
+        const std::function<double()>& sample)
+{
+  for (unsigned i = 0; i < opt.warmup; ++i)
+    sample();
+
+  std::vector<double> v;
+  for (unsigned i = 0; i < opt.runs; ++i)
+    v.push_back(sample());
+  std::sort(v.begin(), v.end());
+
+  metric m{ name, higher_is_better };
+  m.min = v.front();
+  m.median = v.size() % 2 ? v[v.size() / 2]
+                          : (v[v.size() / 2 - 1] + v[v.size() / 2]) / 2;
+  m.mean = std::accumulate(v.begin(), v.end(), 0.0) / v.size();
+  double sq = 0;
+  for (double x : v)
+    sq += (x - m.mean) * (x - m.mean);
+  m.stddev = v.size() > 1 ? std::sqrt(sq / (v.size() - 1)) : 0.0;
+  return m;
+}
+
+// Stores a result where the optimizer can not prove it unused, so the work
+// producing it is not removed.
+template<typename T>
+void
+keep(T value)
+{
+  asm volatile("" : : "g"(&value) : "memory");
+}
+
+double
+elapsed_ms(clock_type::time_point start)
+{
+  return std::chrono::duration<double, std::milli>(clock_type::now() - start)
+    .count();
+}
+
+// Camera rays of one sample per pixel, row by row from the bottom.
+std::vector<ray>
+camera_rays(const scene& sc, const options& opt)
+{
+  camera cam(sc.lookfrom_,
+             sc.lookto_,
+             vec3(0, 1, 0),
+             45,
+             static_cast<double>(opt.width) / opt.height);
+
+  std::vector<ray> rays;
+  rays.reserve(static_cast<std::size_t>(opt.width) * opt.height);
+  for (unsigned i = 0; i < opt.height; ++i) {
+    for (unsigned j = 0; j < opt.width; ++j) {
+      seed_sample(i * opt.width + j, 0);
+      auto u = (j + random_double()) / (opt.width - 1);
+      auto v = (i + random_double()) / (opt.height - 1);
+      rays.push_back(cam.get_ray(u, v));
+    }
+  }
+  return rays;
+}
+
+// Diffuse bounces off the first hits of the camera rays: incoherent rays
+// like the ones after the first bounce of a path.
+std::vector<ray>
+bounce_rays(const hittable& world, const std::vector<ray>& primary)
+{
+  std::vector<ray> rays;
+  for (std::size_t k = 0; k < primary.size(); ++k) {
+    hit_record rec;
+    if (!world.hit(primary[k], 0.001, infinity, rec))
+      continue;
+    seed_sample(k, 1);
+    rays.emplace_back(rec.p, rec.normal + random_unit_vector());
+  }
+  return rays;
+}
+
+// Millions of rays per second of closest-hit queries, camera rays traced as
+// packets like the renderer does.
+double
+trace_mrays(const hittable& world,
+            const std::vector<ray>& rays,
+            bool packets,
+            unsigned threads)
+{
+  constexpr int n = ray_packet::size;
+  auto const groups = static_cast<long>((rays.size() + n - 1) / n);
+  long hits = 0;
+
+  auto start = clock_type::now();
+#pragma omp parallel for schedule(dynamic, 64) reduction(+ : hits)             \
+  num_threads(threads)
+  for (long g = 0; g < groups; ++g) {
+    auto const first = static_cast<std::size_t>(g) * n;
+    int const lanes =
+      static_cast<int>(std::min<std::size_t>(n, rays.size() - first));
+
+    if (packets && n == lanes) {
+      ray rs[n];
+      std::copy(&rays[first], &rays[first] + n, rs);
+      ray_packet rp(rs);
+      double t_max[n];
+      hit_record recs[n];
+      std::fill(t_max, t_max + n, infinity);
+      hits += lane_count(
+        world.hit_packet(rp, ray_packet::all_lanes, 0.001, t_max, recs));
+    } else {
+      for (int k = 0; k < lanes; ++k) {
+        hit_record rec;
+        hits += world.hit(rays[first + k], 0.001, infinity, rec);
+      }
+    }
+  }
+  double const seconds = elapsed_ms(start) / 1e3;
+
+  keep(hits);
+  return rays.size() / seconds / 1e6;
+}
+
+// Full paths of a small frame, the end-to-end number.
+double
+frame_ms(const scene& sc,
+         const hittable& world,
+         const options& opt,
+         unsigned spp)
+{
+  camera cam(sc.lookfrom_,
+             sc.lookto_,
+             vec3(0, 1, 0),
+             45,
+             static_cast<double>(opt.width) / opt.height);
+  int const w = opt.width;
+  int const h = opt.height;
+  auto const lights = sc.lights();
+  double sum = 0;
+
+  auto start = clock_type::now();
+#pragma omp parallel for schedule(dynamic) reduction(+ : sum)                  \
+  num_threads(opt.threads)
+  for (int p = 0; p < w * h; ++p) {
+    for (unsigned s = 0; s < spp; ++s) {
+      seed_sample(p, s);
+      auto u = (p % w + random_double()) / (w - 1);
+      auto v = (p / w + random_double()) / (h - 1);
+      sum += ray_color(cam.get_ray(u, v),
+                       sc.background_,
+                       world,
+                       *sc.materials_,
+                       lights,
+                       50,
+                       3)
+               .x();
+    }
+  }
+  double const ms = elapsed_ms(start);
+
+  keep(sum);
+  return ms;
+}
+
+// A frame of spp samples with its denoiser guides, as the renderer would
+// hand them to the denoiser.
+void
+noisy_frame(const scene& sc,
+            const hittable& world,
+            const options& opt,
+            unsigned spp,
+            framebuffer& fb,
+            guide_buffer& guides)
+{
+  camera cam(sc.lookfrom_,
+             sc.lookto_,
+             vec3(0, 1, 0),
+             45,
+             static_cast<double>(opt.width) / opt.height);
+  int const w = opt.width;
+  int const h = opt.height;
+  auto const lights = sc.lights();
+
+#pragma omp parallel for schedule(dynamic) num_threads(opt.threads)
+  for (int p = 0; p < w * h; ++p) {
+    for (unsigned s = 0; s < spp; ++s) {
+      seed_sample(p, s);
+      auto u = (p % w + random_double()) / (w - 1);
+      auto v = (p / w + random_double()) / (h - 1);
+      guide_sample guide;
+      auto const c = ray_color(cam.get_ray(u, v),
+                               sc.background_,
+                               world,
+                               *sc.materials_,
+                               lights,
+                               50,
+                               3,
+                               &guide);
+      fb.add(p % w, p / w, c, c * c, 1);
+      guides.add(p % w, p / w, guide);
+    }
+  }
+}
+
+std::vector<metric>
+run_fixture(const fixture& f, const options& opt)
+{
+  scene sc = f.make();
+  auto packed = pack_spheres(*sc.world_);
+
+  std::vector<metric> metrics;
+
+  metrics.push_back(measure(opt, "bvh_build_ms", false, [&] {
+    auto start = clock_type::now();
+    bvh world(pack_spheres(*sc.world_));
+    return elapsed_ms(start);
+  }));
+
+  // An edit in the window: an object taken out of the persistent hierarchy
+  // and put back in.
+  dynamic_bvh edited(*sc.world_);
+  auto edit_rng = fixture_rng(3);
+  metrics.push_back(measure(opt, "bvh_edit_us", false, [&] {
+    constexpr int edits = 1000;
+    auto const n = static_cast<std::uint32_t>(edited.size());
+    auto start = clock_type::now();
+    for (int k = 0; k < edits; ++k) {
+      auto const h = edit_rng.next_uint() % n;
+      auto object = edited.object(h);
+      edited.remove(h);
+      edited.insert(std::move(object));
+    }
+    return elapsed_ms(start) * 1000 / edits;
+  }));
+
+  // Spheres added one around the other, as the window's add button does:
+  // each one deepens the same branch, past the traversal stack unless the
+  // hierarchy is rebuilt in time. The ray through them all reaches the
+  // deepest leaf.
+  aabb bounds;
+  edited.bounding_box(bounds);
+  auto const center = 0.5 * (bounds.min() + bounds.max());
+  metrics.push_back(measure(opt, "bvh_nested_insert_us", false, [&] {
+    constexpr int nested = 80;
+    std::vector<dynamic_bvh::handle> handles;
+    auto start = clock_type::now();
+    for (int k = 0; k < nested; ++k)
+      handles.push_back(
+        edited.insert(make_shared<sphere>(center, 0.01 * (k + 1), 0)));
+    edited.optimize();
+    auto const us = elapsed_ms(start) * 1000 / nested;
+
+    hit_record rec;
+    keep(edited.hit(
+      ray(center - vec3(0, 0, 1), vec3(0, 0, 1)), 0.001, infinity, rec));
+    for (auto h : handles)
+      edited.remove(h);
+    return us;
+  }));
+
+  bvh world(packed);
+  auto const primary = camera_rays(sc, opt);
+  auto const secondary = bounce_rays(world, primary);
+
+  metrics.push_back(measure(opt, "primary_mrays", true, [&] {
+    return trace_mrays(world, primary, true, opt.threads);
+  }));
+  metrics.push_back(measure(opt, "secondary_mrays", true, [&] {
+    return trace_mrays(world, secondary, false, opt.threads);
+  }));
+  metrics.push_back(measure(opt, "frame_ms", false, [&] {
+    return frame_ms(sc, world, opt, 4);
+  }));
+
+  framebuffer fb(opt.width, opt.height);
+  guide_buffer guides(opt.width, opt.height);
+  noisy_frame(sc, world, opt, 4, fb, guides);
+  denoiser filter(opt.threads);
+  metrics.push_back(measure(opt, "denoise_ms", false, [&] {
+    auto start = clock_type::now();
+    keep(filter.denoise(fb, guides).pixels_.back());
+    return elapsed_ms(start);
+  }));
+
+  return metrics;
+}
+
+// Nanoseconds per ray-primitive test, without any hierarchy: every ray is
+// tested against every primitive.
+std::vector<metric>
+run_primitives(const options& opt)
+{
+  constexpr unsigned n_prims = 64;
+  constexpr unsigned n_rays = 4096;
+
+  auto rng = fixture_rng(7);
+  std::vector<sphere> spheres;
+  sphere_soup soup;
+  for (unsigned i = 0; i < n_prims; ++i) {
+    point3 c(uniform(rng, -4, 4), uniform(rng, -4, 4), uniform(rng, -4, 4));
+    double r = uniform(rng, 0.2, 1.0);
+    spheres.emplace_back(c, r, 0);
+    soup.add(c, r, 0);
+  }
+  soup.build();
+
+  // Triangles of the same sizes around the same points.
+  triangle_mesh mesh;
+  for (unsigned i = 0; i < n_prims; ++i) {
+    auto const c = spheres[i].center;
+    auto const r = spheres[i].radius;
+    auto const a = mesh.add_vertex(c + vec3(-r, -r, 0));
+    mesh.add_vertex(c + vec3(r, -r, 0));
+    mesh.add_vertex(c + vec3(0, r, 0));
+    mesh.add_triangle(a, a + 1, a + 2);
+  }
+  mesh.build();
+
+  std::vector<ray> rays;
+  for (unsigned i = 0; i < n_rays; ++i) {
+    point3 o(uniform(rng, -8, 8), uniform(rng, -8, 8), 10);
+    vec3 d(uniform(rng, -0.3, 0.3), uniform(rng, -0.3, 0.3), -1);
+    rays.emplace_back(o, d);
+  }
+  double const tests = static_cast<double>(n_prims) * n_rays;
+
+  std::vector<metric> metrics;
+
+  metrics.push_back(measure(opt, "sphere_hit_ns", false, [&] {
+    long hits = 0;
+    auto start = clock_type::now();
+    for (const auto& r : rays) {
+      for (const auto& s : spheres) {
+        hit_record rec;
+        hits += s.hit(r, 0.001, infinity, rec);
+      }
+    }
+    double const ns = elapsed_ms(start) * 1e6 / tests;
+    keep(hits);
+    return ns;
+  }));
+
+  metrics.push_back(measure(opt, "soup_sphere_hit_ns", false, [&] {
+    long closest = 0;
+    auto start = clock_type::now();
+    for (const auto& r : rays) {
+      double t_max = infinity;
+      closest += soup.closest_hit(r, 0, n_prims, 0.001, t_max);
+    }
+    double const ns = elapsed_ms(start) * 1e6 / tests;
+    keep(closest);
+    return ns;
+  }));
+
+  metrics.push_back(measure(opt, "triangle_hit_ns", false, [&] {
+    long hits = 0;
+    auto start = clock_type::now();
+    for (const auto& r : rays) {
+      triangle_ray const tr(r);
+      double t, b1, b2;
+      for (std::uint32_t k = 0; k < n_prims; ++k)
+        hits += mesh.intersect(tr, k, 0.001, infinity, t, b1, b2);
+    }
+    double const ns = elapsed_ms(start) * 1e6 / tests;
+    keep(hits);
+    return ns;
+  }));
+
+  return metrics;
+}
+
+// ---------------------------------------------------------------------------
+// Reporting
+
+using results = std::vector<std::pair<std::string, std::vector<metric>>>;
+
+const char*
+simd_backend()
+{
+#if defined(__AVX__)
+  return "avx";
+#elif defined(__SSE2__)
+  return "sse2";
+#else
+  return "scalar";
+#endif
+}
+
+// Scalar type and layout of vec3; a baseline of another layout is refused.
+std::string
+vec3_layout()
+{
+  std::string name = std::is_same<real, float>::value ? "float32" : "float64";
+  return vec3::padded ? name + "_padded" : name;
+}
+
+void
+write_json(std::ostream& out, const options& opt, const results& res)
+{
+  out << "{\n  \"config\": { \"runs\": " << opt.runs
+      << ", \"warmup\": " << opt.warmup << ", \"threads\": " << opt.threads
+      << ", \"width\": " << opt.width << ", \"height\": " << opt.height
+      << ", \"simd\": \"" << simd_backend() << "\", \"vec3\": \""
+      << vec3_layout() << "\" },\n"
+      << "  \"benchmarks\": {";
+
+  for (std::size_t i = 0; i < res.size(); ++i) {
+    out << (i ? "," : "") << "\n    \"" << res[i].first << "\": {";
+    const auto& metrics = res[i].second;
+    for (std::size_t k = 0; k < metrics.size(); ++k) {
+      const auto& m = metrics[k];
+      out << (k ? "," : "") << "\n      \"" << m.name << "\": { \"median\": "
+          << m.median << ", \"min\": " << m.min << ", \"mean\": " << m.mean
+          << ", \"stddev\": " << m.stddev << ", \"better\": \""
+          << (m.higher_is_better ? "higher" : "lower") << "\" }";
+    }
+    out << "\n    }";
+  }
+  out << "\n  }\n}\n";
+}
+
+// Settings of this run that the baseline was recorded with different values
+// of, as "name: baseline -> current"; empty if its medians are comparable.
+std::string
+config_mismatch(const pt::ptree& baseline, const options& opt)
+{
+  std::pair<const char*, std::string> const current[] = {
+    { "runs", std::to_string(opt.runs) },
+    { "threads", std::to_string(opt.threads) },
+    { "width", std::to_string(opt.width) },
+    { "height", std::to_string(opt.height) },
+    { "simd", simd_backend() },
+  };
+
+  std::string mismatch;
+  auto check = [&mismatch](const char* key,
+                           const std::string& recorded,
+                           const std::string& value) {
+    if (recorded != value)
+      mismatch += (mismatch.empty() ? "" : ", ") + std::string(key) + ": " +
+                  recorded + " -> " + value;
+  };
+  for (const auto& [key, value] : current)
+    check(key, baseline.get<std::string>(std::string("config.") + key), value);
+  // Baselines older than the field all come from float64 builds.
+  check("vec3",
+        baseline.get<std::string>("config.vec3", "float64"),
+        vec3_layout());
+  return mismatch;
+}
+
+// Compares medians with the baseline; returns the number of regressions.
+// Metrics missing from the baseline are skipped.
+int
+compare(const results& res, const pt::ptree& baseline, double tolerance)
+{
+  int regressions = 0;
+  for (const auto& [fixture, metrics] : res) {
+    for (const auto& m : metrics) {
+      auto base = baseline.get_optional<double>(
+        pt::ptree::path_type(
+          "benchmarks/" + fixture + "/" + m.name + "/median", '/'));
+      if (!base || *base <= 0)
+        continue;
+
+      // Changes within the spread of the runs are noise, whatever their size.
+      double const change = (m.median - *base) / *base;
+      bool const worse =
+        (m.higher_is_better ? change < -tolerance : change > tolerance) &&
+        std::abs(m.median - *base) > 3 * m.stddev;
+      regressions += worse;
+      std::cerr << (worse ? "REGRESSION " : "           ") << fixture << '.'
+                << m.name << ": " << *base << " -> " << m.median << " ("
+                << (change >= 0 ? "+" : "") << 100 * change << "%)\n";
+    }
+  }
+  return regressions;
+}
+
+} // namespace
+
+int
+main(int argc, char* argv[])
+{
+  options opt;
+  std::string json_path, baseline_path;
+  double tolerance;
+
+  po::options_description desc("Options");
+  desc.add_options()("help,h", "show this message")(
+    "runs,r", po::value(&opt.runs)->default_value(5), "measured runs")(
+    "warmup,w", po::value(&opt.warmup)->default_value(1), "discarded runs")(
+    "threads,j",
+    po::value(&opt.threads)->default_value(1),
+    "threads of the ray tracing metrics")(
+    "width,W", po::value(&opt.width)->default_value(320), "frame width")(
+    "height,H", po::value(&opt.height)->default_value(240), "frame height")(
+    "filter,f",
+    po::value(&opt.filter),
+    "run only benchmarks whose names contain this")(
+    "json,o", po::value(&json_path), "write the results here, not to stdout")(
+    "baseline,b",
+    po::value(&baseline_path),
+    "results of an earlier run to compare with")(
+    "tolerance,t",
+    po::value(&tolerance)->default_value(0.1),
+    "relative change of a median counted as a regression");
+
+  po::variables_map vm;
+  try {
+    po::store(po::parse_command_line(argc, argv, desc), vm);
+    po::notify(vm);
+  } catch (const po::error& e) {
+    std::cerr << e.what() << '\n' << desc;
+    return 2;
+  }
+
+  if (vm.count("help")) {
+    std::cout << "Usage: " << argv[0] << " [options]\n" << desc;
+    return 0;
+  }
+  if (0 == opt.runs || 0 == opt.threads || opt.width < 2 || opt.height < 2) {
+    std::cerr << "runs, threads and the frame size must be positive\n";
+    return 2;
+  }
+
+  results res;
+  auto selected = [&opt](const std::string& name) {
+    return name.find(opt.filter) != std::string::npos;
+  };
+
+  if (selected("primitives")) {
+    std::cerr << "primitives\n";
+    res.emplace_back("primitives", run_primitives(opt));
+  }
+  for (const auto& f : fixtures()) {
+    if (!selected(f.name))
+      continue;
+    std::cerr << f.name << '\n';
+    res.emplace_back(f.name, run_fixture(f, opt));
+  }
+
+  if (json_path.empty()) {
+    write_json(std::cout, opt, res);
+  } else {
+    std::ofstream out(json_path);
+    write_json(out, opt, res);
+  }
+
+  if (!baseline_path.empty()) {
+    try {
+      pt::ptree baseline;
+      pt::read_json(baseline_path, baseline);
+      auto const mismatch = config_mismatch(baseline, opt);
+      if (!mismatch.empty()) {
+        std::cerr << "The baseline was recorded with other settings ("
+                  << mismatch << ")\n";
+        return 2;
+      }
+      int const regressions = compare(res, baseline, tolerance);
+      if (regressions) {
+        std::cerr << regressions << " metric(s) regressed by more than "
+                  << 100 * tolerance << "%\n";
+        return 1;
+      }
+    } catch (const pt::ptree_error& e) {
+      std::cerr << "Can not read the baseline: " << e.what() << '\n';
+      return 2;
+    }
+  }
+
+  return 0;
+}